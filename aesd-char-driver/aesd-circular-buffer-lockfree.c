@@ -0,0 +1,277 @@
+/**
+ * @file aesd-circular-buffer-lockfree.c
+ * @brief Lock-free bounded MPMC ring with aesd_circular_buffer entry semantics
+ *
+ * Each slot carries a sequence number (Dmitry Vyukov's bounded MPMC queue):
+ * a producer may fill the slot for position pos once seq == pos, and a
+ * consumer may take it once seq == pos + 1.  Positions only grow, so a slot
+ * is never mistaken for an older lap.
+ *
+ * Like aesd_circular_buffer_add_entry(), aesd_lockfree_ring_add_entry()
+ * overwrites the oldest entries when the ring is full.  Offset lookups work
+ * on a consistent copy taken with aesd_lockfree_ring_snapshot(), which feeds
+ * aesd_circular_buffer_find_entry_offset_for_fpos().
+ *
+ * A snapshot refers to the entries' memory, so it pins it until
+ * aesd_lockfree_ring_snapshot_release().  Evicted entries reach the evict
+ * callback only after aesd_lockfree_ring_synchronize() has waited for every
+ * snapshot that could have copied them, in the manner of userspace RCU: each
+ * snapshot counts itself in the current of two phases, and the wait flips
+ * the phase twice and lets the old one drain each time, so snapshots taken
+ * meanwhile cannot starve it.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "aesd-circular-buffer-lockfree.h"
+
+/**
+* Initializes @param ring with room for @param capacity entries, rounded up to a power of two.
+* @return 0 on success, -1 with errno set if the slots could not be allocated
+*/
+int aesd_lockfree_ring_init(struct aesd_lockfree_ring *ring, size_t capacity)
+{
+    size_t rounded = 2;
+    size_t i;
+
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+
+    ring->slots = calloc(rounded, sizeof(struct aesd_lockfree_slot));
+    if (ring->slots == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ring->mask = rounded - 1;
+
+    for (i = 0; i < rounded; i++) {
+        atomic_init(&ring->slots[i].seq, i);
+        atomic_init(&ring->slots[i].buffptr, NULL);
+        atomic_init(&ring->slots[i].size, 0);
+    }
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    atomic_init(&ring->readers[0], 0);
+    atomic_init(&ring->readers[1], 0);
+    atomic_init(&ring->phase, 0);
+    atomic_flag_clear(&ring->grace_lock);
+    return 0;
+}
+
+/**
+* Removes all remaining entries, passing each to @param evict if it is not NULL, and frees the slots.
+* No other thread may use @param ring at this point.
+*/
+void aesd_lockfree_ring_free(struct aesd_lockfree_ring *ring, aesd_lockfree_evict_fn evict, void *arg)
+{
+    struct aesd_buffer_entry entry;
+
+    while (aesd_lockfree_ring_remove_entry(ring, &entry)) {
+        if (evict != NULL) {
+            evict(entry.buffptr, arg);
+        }
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/**
+* Appends @param add_entry as the newest entry of @param ring.
+* Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return false without modifying the ring if it is full
+*/
+bool aesd_lockfree_ring_try_add_entry(struct aesd_lockfree_ring *ring, const struct aesd_buffer_entry *add_entry)
+{
+    struct aesd_lockfree_slot *slot;
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    size_t seq;
+    intptr_t diff;
+
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            // slot is free for this lap, try to claim the position
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // slot still holds the entry from the previous lap
+            return false;
+        }
+        else {
+            // another producer claimed pos first
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&slot->buffptr, add_entry->buffptr, memory_order_relaxed);
+    atomic_store_explicit(&slot->size, add_entry->size, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+* Appends @param add_entry to @param ring, evicting the oldest entries while the ring is full.
+* Each evicted buffptr is passed to @param evict (if not NULL) so the caller can release it.
+* @return the number of entries evicted to make room
+*/
+int aesd_lockfree_ring_add_entry(struct aesd_lockfree_ring *ring, const struct aesd_buffer_entry *add_entry,
+            aesd_lockfree_evict_fn evict, void *arg)
+{
+    struct aesd_buffer_entry oldest;
+    int evicted = 0;
+
+    while (!aesd_lockfree_ring_try_add_entry(ring, add_entry)) {
+        // full: drop the oldest entry, another producer may still win the freed slot
+        if (aesd_lockfree_ring_remove_entry(ring, &oldest)) {
+            if (evict != NULL) {
+                // a snapshot may still point at it
+                aesd_lockfree_ring_synchronize(ring);
+                evict(oldest.buffptr, arg);
+            }
+            evicted++;
+        }
+    }
+    return evicted;
+}
+
+/**
+* Removes the oldest entry of @param ring and stores it in @param entry_rtn.
+* @return false if the ring was empty
+*/
+bool aesd_lockfree_ring_remove_entry(struct aesd_lockfree_ring *ring, struct aesd_buffer_entry *entry_rtn)
+{
+    struct aesd_lockfree_slot *slot;
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    size_t seq;
+    intptr_t diff;
+
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (diff == 0) {
+            // entry is published, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // nothing published at pos yet
+            return false;
+        }
+        else {
+            // another consumer took pos first
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    entry_rtn->buffptr = atomic_load_explicit(&slot->buffptr, memory_order_relaxed);
+    entry_rtn->size = atomic_load_explicit(&slot->size, memory_order_relaxed);
+    // hand the slot to the producer of the next lap
+    atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+    return true;
+}
+
+/**
+* Copies the newest published entries of @param ring (at most AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+* into @param snapshot in order, so aesd_circular_buffer_find_entry_offset_for_fpos() can be used on them.
+* Entries consumed or still being written while the copy is taken are left out, the ring is not modified.
+* The snapshot does not own the referenced memory, but keeps evict callbacks from freeing it until it is
+* passed to aesd_lockfree_ring_snapshot_release() with the returned phase.
+*/
+unsigned int aesd_lockfree_ring_snapshot(struct aesd_lockfree_ring *ring, struct aesd_circular_buffer *snapshot)
+{
+    struct aesd_lockfree_slot *slot;
+    struct aesd_buffer_entry entry;
+    unsigned int phase = atomic_load_explicit(&ring->phase, memory_order_relaxed) & 1;
+    size_t head;
+    size_t tail;
+    size_t pos;
+    size_t seq;
+
+    // counted before the slots are read, pairs with the fence in aesd_lockfree_ring_synchronize()
+    atomic_fetch_add_explicit(&ring->readers[phase], 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    head = atomic_load_explicit(&ring->dequeue_pos, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->enqueue_pos, memory_order_acquire);
+    aesd_circular_buffer_init(snapshot);
+
+    if (tail - head > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        head = tail - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+
+    for (pos = head; pos != tail; pos++) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq == pos + 1) {
+            entry.buffptr = atomic_load_explicit(&slot->buffptr, memory_order_relaxed);
+            entry.size = atomic_load_explicit(&slot->size, memory_order_relaxed);
+
+            // seqlock style validation: the slot must not have moved on while it was copied
+            atomic_thread_fence(memory_order_acquire);
+            seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+            if (seq == pos + 1) {
+                aesd_circular_buffer_add_entry(snapshot, &entry);
+                continue;
+            }
+        }
+
+        if ((intptr_t) seq - (intptr_t) (pos + 1) < 0) {
+            // claimed but not yet published, later entries would leave a gap
+            break;
+        }
+
+        // consumed since head was read, so everything copied so far is gone too
+        aesd_circular_buffer_init(snapshot);
+    }
+    return phase;
+}
+
+/**
+* Ends the snapshot of @param ring taken in @param phase, its entries may be evicted and freed afterwards.
+*/
+void aesd_lockfree_ring_snapshot_release(struct aesd_lockfree_ring *ring, unsigned int phase)
+{
+    atomic_fetch_sub_explicit(&ring->readers[phase], 1, memory_order_release);
+}
+
+/**
+* Waits until no snapshot of @param ring can still refer to an entry removed before the call.
+* Consumers that free what aesd_lockfree_ring_remove_entry() returned must call it first when
+* other threads take snapshots, aesd_lockfree_ring_add_entry() does so for its evict callback.
+*/
+void aesd_lockfree_ring_synchronize(struct aesd_lockfree_ring *ring)
+{
+    unsigned int phase;
+    int flip;
+
+    while (atomic_flag_test_and_set_explicit(&ring->grace_lock, memory_order_acquire)) {
+        sched_yield();
+    }
+
+    // a snapshot may have read the phase just before the first flip and count itself after it
+    for (flip = 0; flip < 2; flip++) {
+        atomic_thread_fence(memory_order_seq_cst);
+        phase = atomic_fetch_xor_explicit(&ring->phase, 1, memory_order_relaxed) & 1;
+        atomic_thread_fence(memory_order_seq_cst);
+        while (atomic_load_explicit(&ring->readers[phase], memory_order_acquire) != 0) {
+            sched_yield();
+        }
+    }
+
+    atomic_flag_clear_explicit(&ring->grace_lock, memory_order_release);
+}
@@ -0,0 +1,83 @@
+/*
+ * aesd-circular-buffer-lockfree.h
+ *
+ * Userspace companion to aesd-circular-buffer.h: a bounded multi-producer
+ * multi-consumer ring of struct aesd_buffer_entry built on C11 atomics, with
+ * sequence numbered slots, so callers do not need an external mutex.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_LOCKFREE_H
+#define AESD_CIRCULAR_BUFFER_LOCKFREE_H
+
+#ifdef __KERNEL__
+#error "aesd-circular-buffer-lockfree is userspace only, the driver uses aesd-circular-buffer.h with its mutex"
+#endif
+
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_LOCKFREE_CACHE_LINE 64
+
+/**
+ * Called for every entry evicted by aesd_lockfree_ring_add_entry() so the
+ * caller can free the memory referenced by buffptr.
+ */
+typedef void (*aesd_lockfree_evict_fn)(const char *buffptr, void *arg);
+
+struct aesd_lockfree_slot
+{
+	/**
+	 * pos + 1 once the entry for position pos is published, pos + capacity once
+	 * it has been consumed and the slot can take position pos + capacity
+	 */
+	_Atomic size_t seq;
+	_Atomic(const char *) buffptr;
+	_Atomic size_t size;
+};
+
+struct aesd_lockfree_ring
+{
+	/**
+	 * Next position a producer will claim
+	 */
+	_Alignas(AESD_LOCKFREE_CACHE_LINE) _Atomic size_t enqueue_pos;
+	/**
+	 * Position of the oldest entry, next position a consumer will claim
+	 */
+	_Alignas(AESD_LOCKFREE_CACHE_LINE) _Atomic size_t dequeue_pos;
+	/**
+	 * Slot array and capacity - 1, capacity is a power of two
+	 */
+	_Alignas(AESD_LOCKFREE_CACHE_LINE) struct aesd_lockfree_slot *slots;
+	size_t mask;
+	/**
+	 * Snapshots not yet released, per phase, and the phase new snapshots join.
+	 * aesd_lockfree_ring_synchronize() flips the phase and waits for the old one
+	 * to drain, grace_lock serializes those waits.
+	 */
+	_Alignas(AESD_LOCKFREE_CACHE_LINE) _Atomic size_t readers[2];
+	_Atomic unsigned int phase;
+	atomic_flag grace_lock;
+};
+
+extern int aesd_lockfree_ring_init(struct aesd_lockfree_ring *ring, size_t capacity);
+
+extern void aesd_lockfree_ring_free(struct aesd_lockfree_ring *ring, aesd_lockfree_evict_fn evict, void *arg);
+
+extern bool aesd_lockfree_ring_try_add_entry(struct aesd_lockfree_ring *ring, const struct aesd_buffer_entry *add_entry);
+
+extern int aesd_lockfree_ring_add_entry(struct aesd_lockfree_ring *ring, const struct aesd_buffer_entry *add_entry,
+			aesd_lockfree_evict_fn evict, void *arg);
+
+extern bool aesd_lockfree_ring_remove_entry(struct aesd_lockfree_ring *ring, struct aesd_buffer_entry *entry_rtn);
+
+extern unsigned int aesd_lockfree_ring_snapshot(struct aesd_lockfree_ring *ring, struct aesd_circular_buffer *snapshot);
+
+extern void aesd_lockfree_ring_snapshot_release(struct aesd_lockfree_ring *ring, unsigned int phase);
+
+extern void aesd_lockfree_ring_synchronize(struct aesd_lockfree_ring *ring);
+
+#endif /* AESD_CIRCULAR_BUFFER_LOCKFREE_H */
@@ -74,11 +74,15 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     // update read pos
     if (buffer->full) {
         overwrite_ptr = buffer->entry[buffer->out_offs].buffptr;
+        buffer->total_size -= buffer->entry[buffer->out_offs].size;
+        buffer->evicted_size += buffer->entry[buffer->out_offs].size;
+        buffer->evictions++;
         buffer->out_offs++;
         buffer->out_offs %= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
     }
 
     buffer->entry[buffer->in_offs] = *add_entry; // add entry
+    buffer->total_size += add_entry->size;
     
     // update write pos
     buffer->in_offs++;
@@ -92,6 +96,42 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     return overwrite_ptr;
 }
 
+/**
+* Evicts the oldest entry of @param buffer if adding an entry of @param add_size bytes would
+* push buffer->total_size past buffer->max_size.  Call repeatedly until it returns NULL before
+* aesd_circular_buffer_add_entry() to enforce the byte budget.  An entry larger than max_size on
+* its own empties the buffer and is then stored anyway.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the evicted entry, which the caller must free, or NULL if the entry fits
+*/
+const char* aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t add_size)
+{
+    const char* evicted_ptr;
+
+    // no byte budget, or it already fits
+    if (buffer->max_size == 0 || buffer->total_size + add_size <= buffer->max_size) {
+        return NULL;
+    }
+
+    // empty case
+    if (buffer->out_offs == buffer->in_offs && buffer->full == false) {
+        return NULL;
+    }
+
+    evicted_ptr = buffer->entry[buffer->out_offs].buffptr;
+    buffer->total_size -= buffer->entry[buffer->out_offs].size;
+    buffer->evicted_size += buffer->entry[buffer->out_offs].size;
+    buffer->entry[buffer->out_offs].buffptr = NULL;
+    buffer->entry[buffer->out_offs].size = 0;
+    buffer->evictions++;
+
+    buffer->out_offs++;
+    buffer->out_offs %= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = false;
+
+    return evicted_ptr;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
@@ -122,4 +162,6 @@ extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer) {
 
     buffer->in_offs = 0;
     buffer->out_offs = 0;
+    buffer->full = false;
+    buffer->total_size = 0;
 }
\ No newline at end of file
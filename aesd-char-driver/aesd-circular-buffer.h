@@ -49,6 +49,22 @@ struct aesd_circular_buffer
 	 * set to true when the buffer entry structure is full
 	 */
 	bool full;
+	/**
+	 * Sum of the sizes of all entries currently stored
+	 */
+	size_t total_size;
+	/**
+	 * Optional byte budget for all stored entries, 0 means only the entry count limit applies
+	 */
+	size_t max_size;
+	/**
+	 * Number of entries evicted so far, either to free a slot or to stay under max_size
+	 */
+	unsigned long evictions;
+	/**
+	 * Sum of the sizes of all entries evicted so far, the stream offset of the oldest stored byte
+	 */
+	uint64_t evicted_size;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,6 +72,8 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char* aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t add_size);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
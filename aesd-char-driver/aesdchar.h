@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,16 +25,51 @@
 
 #include "aesd-circular-buffer.h"
 
+#ifndef AESD_NR_DEVS
+#define AESD_NR_DEVS 1    /* aesdchar0 by default, override with aesd_nr_devs= */
+#endif
+
+#define AESD_HIST_BUCKETS 32 /* log2(ns) latency buckets, the last one catches everything slower */
+
+/*
+ * Counters reported in debugfs.  The lock fields are only updated while
+ * holding the device lock, the histograms are updated after it is dropped.
+ */
+struct aesd_stats
+{
+	u64 lock_acquisitions;
+	u64 lock_wait_ns;
+	u64 lock_wait_max_ns;
+	atomic64_t read_hist[AESD_HIST_BUCKETS];
+	atomic64_t write_hist[AESD_HIST_BUCKETS];
+};
+
 struct aesd_dev
 {
 	/**
 	 * TODO: Add structure(s) and locks needed to complete assignment requirements
 	 */
 	struct aesd_circular_buffer queue;
-	struct aesd_buffer_entry entry;
+	struct aesd_buffer_entry entry; /* Partial command left by a writer that closed mid-command */
 	struct mutex lock;
+	wait_queue_head_t wq;	  /* Readers/pollers waiting for a new command */
+	unsigned long write_seq;  /* Bumped each time a command is committed */
+	struct aesd_stats stats;
+	struct dentry *debugfs_dir;
+	int minor;
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
+/*
+ * Per open file state, stored in filp->private_data.  Writers stage partial
+ * commands here without holding the device lock.
+ */
+struct aesd_file
+{
+	struct aesd_dev *dev;		/* Device this file was opened on */
+	struct aesd_buffer_entry entry;	/* Partial command staged by this file */
+	struct mutex lock;		/* Serializes writers sharing this file */
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,101 @@
+/*
+ * aesdchar_trace.h
+ *
+ * Static tracepoints for the aesdchar hot paths.  Enable them at runtime with
+ * e.g. echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_io_enter,
+	TP_PROTO(int minor, size_t count, loff_t pos),
+	TP_ARGS(minor, count, pos),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, count)
+		__field(loff_t, pos)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->pos = pos;
+	),
+	TP_printk("aesdchar%d count=%zu pos=%lld", __entry->minor, __entry->count, __entry->pos)
+);
+
+DEFINE_EVENT(aesd_io_enter, aesd_read_enter,
+	TP_PROTO(int minor, size_t count, loff_t pos),
+	TP_ARGS(minor, count, pos));
+
+DEFINE_EVENT(aesd_io_enter, aesd_write_enter,
+	TP_PROTO(int minor, size_t count, loff_t pos),
+	TP_ARGS(minor, count, pos));
+
+DECLARE_EVENT_CLASS(aesd_io_exit,
+	TP_PROTO(int minor, ssize_t ret, u64 latency_ns),
+	TP_ARGS(minor, ret, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(ssize_t, ret)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->ret = ret;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("aesdchar%d ret=%zd latency_ns=%llu", __entry->minor, __entry->ret, __entry->latency_ns)
+);
+
+DEFINE_EVENT(aesd_io_exit, aesd_read_exit,
+	TP_PROTO(int minor, ssize_t ret, u64 latency_ns),
+	TP_ARGS(minor, ret, latency_ns));
+
+DEFINE_EVENT(aesd_io_exit, aesd_write_exit,
+	TP_PROTO(int minor, ssize_t ret, u64 latency_ns),
+	TP_ARGS(minor, ret, latency_ns));
+
+TRACE_EVENT(aesd_lock_acquired,
+	TP_PROTO(int minor, u64 wait_ns),
+	TP_ARGS(minor, wait_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("aesdchar%d wait_ns=%llu", __entry->minor, __entry->wait_ns)
+);
+
+TRACE_EVENT(aesd_evict,
+	TP_PROTO(int minor, unsigned long entries, size_t bytes),
+	TP_ARGS(minor, entries, bytes),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned long, entries)
+		__field(size_t, bytes)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->entries = entries;
+		__entry->bytes = bytes;
+	),
+	TP_printk("aesdchar%d entries=%lu bytes=%zu", __entry->minor, __entry->entries, __entry->bytes)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,361 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace microbenchmark and randomized stress test for aesd-circular-buffer.c
+ *
+ * Builds against the same aesd-circular-buffer.c the driver uses (the non __KERNEL__ branch).
+ * The benchmark reports ns/op for aesd_circular_buffer_add_entry (including byte budget
+ * eviction through aesd_circular_buffer_make_room) and for
+ * aesd_circular_buffer_find_entry_offset_for_fpos under a choice of read patterns.
+ * The stress test drives random operations against a simple reference model and
+ * exits non-zero on the first mismatch.
+ *
+ * Usage: aesd-circular-buffer-bench [-n ops] [-s min_size:max_size] [-r seq|random|tail]
+ *                                   [-b max_bytes] [-x stress_ops] [-S seed] [-t] [-h]
+ *   -t runs only the stress test (used by ctest)
+ *   -h prints the usage line
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../aesd-circular-buffer.h"
+
+#define DEFAULT_OPS 10000000UL
+#define DEFAULT_STRESS_OPS 1000000UL
+#define DEFAULT_MAX_ENTRY_SIZE 256
+#define NUM_SIZES 4096 // pregenerated entry sizes, power of 2 so it can be masked
+#define NUM_OFFSETS 4096 // pregenerated read offsets
+
+enum read_pattern {
+    READ_SEQ, // walk the whole buffer front to back like cat
+    READ_RANDOM, // uniformly random offsets
+    READ_TAIL, // offsets inside the newest entry, like a tailing reader
+};
+
+struct bench_config {
+    unsigned long ops;
+    unsigned long stress_ops;
+    size_t min_size;
+    size_t max_size;
+    size_t max_bytes;
+    enum read_pattern pattern;
+    unsigned int seed;
+    bool stress_only;
+};
+
+// reference model: a plain array shifted on every eviction
+struct model {
+    struct aesd_buffer_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    int count;
+    size_t total_size;
+    unsigned long evictions;
+};
+
+static volatile size_t sink; // keeps the compiler from dropping benchmarked calls
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t random_size(const struct bench_config* cfg) {
+    return cfg->min_size + (size_t) rand() % (cfg->max_size - cfg->min_size + 1);
+}
+
+static void add_with_budget(struct aesd_circular_buffer* buffer, const struct aesd_buffer_entry* entry) {
+    while (aesd_circular_buffer_make_room(buffer, entry->size) != NULL) {
+        // bench entries point into a shared pool, nothing to free
+    }
+    aesd_circular_buffer_add_entry(buffer, entry);
+}
+
+static void bench_add(const struct bench_config* cfg, const char* pool) {
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    size_t sizes[NUM_SIZES];
+    unsigned long i;
+    uint64_t start;
+    uint64_t elapsed;
+
+    for (i = 0; i < NUM_SIZES; i++) {
+        sizes[i] = random_size(cfg);
+    }
+
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_size = cfg->max_bytes;
+    entry.buffptr = pool;
+
+    start = now_ns();
+    for (i = 0; i < cfg->ops; i++) {
+        entry.size = sizes[i & (NUM_SIZES - 1)];
+        add_with_budget(&buffer, &entry);
+    }
+    elapsed = now_ns() - start;
+    sink = buffer.total_size;
+
+    printf("add_entry:   %lu ops, %.2f ns/op, %lu evictions\n",
+           cfg->ops, (double) elapsed / cfg->ops, buffer.evictions);
+}
+
+static void bench_find(const struct bench_config* cfg, const char* pool) {
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry* found;
+    size_t offsets[NUM_OFFSETS];
+    size_t entry_offset;
+    size_t newest_size;
+    size_t pos = 0;
+    unsigned long hits = 0;
+    unsigned long i;
+    uint64_t start;
+    uint64_t elapsed;
+    const char* pattern_name;
+
+    // fill the buffer so every lookup sees the steady state
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_size = cfg->max_bytes;
+    entry.buffptr = pool;
+    for (i = 0; i < 2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        entry.size = random_size(cfg);
+        add_with_budget(&buffer, &entry);
+    }
+    newest_size = entry.size;
+
+    for (i = 0; i < NUM_OFFSETS; i++) {
+        if (cfg->pattern == READ_RANDOM) {
+            offsets[i] = (size_t) rand() % buffer.total_size;
+        }
+        else {
+            offsets[i] = buffer.total_size - newest_size + (size_t) rand() % newest_size;
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < cfg->ops; i++) {
+        if (cfg->pattern == READ_SEQ) {
+            found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, pos, &entry_offset);
+            // jump to the start of the next entry like a reader draining it
+            pos = (found == NULL) ? 0 : pos + found->size - entry_offset;
+        }
+        else {
+            found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i & (NUM_OFFSETS - 1)], &entry_offset);
+        }
+        hits += (found != NULL);
+    }
+    elapsed = now_ns() - start;
+    sink = hits;
+
+    switch (cfg->pattern) {
+    case READ_SEQ:
+        pattern_name = "seq";
+        break;
+    case READ_RANDOM:
+        pattern_name = "random";
+        break;
+    default:
+        pattern_name = "tail";
+        break;
+    }
+    printf("find_offset: %lu ops (%s), %.2f ns/op, %lu hits\n",
+           cfg->ops, pattern_name, (double) elapsed / cfg->ops, hits);
+}
+
+static void model_add(struct model* m, const struct aesd_buffer_entry* entry, size_t max_bytes) {
+    // byte budget first, then the slot limit, same order as the driver
+    while (max_bytes != 0 && m->count > 0 && m->total_size + entry->size > max_bytes) {
+        m->total_size -= m->entry[0].size;
+        memmove(&m->entry[0], &m->entry[1], (m->count - 1) * sizeof(struct aesd_buffer_entry));
+        m->count--;
+        m->evictions++;
+    }
+    if (m->count == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        m->total_size -= m->entry[0].size;
+        memmove(&m->entry[0], &m->entry[1], (m->count - 1) * sizeof(struct aesd_buffer_entry));
+        m->count--;
+        m->evictions++;
+    }
+    m->entry[m->count++] = *entry;
+    m->total_size += entry->size;
+}
+
+static const struct aesd_buffer_entry* model_find(const struct model* m, size_t char_offset, size_t* entry_offset) {
+    int i;
+
+    for (i = 0; i < m->count; i++) {
+        if (char_offset < m->entry[i].size) {
+            *entry_offset = char_offset;
+            return &m->entry[i];
+        }
+        char_offset -= m->entry[i].size;
+    }
+    return NULL;
+}
+
+static int run_stress(const struct bench_config* cfg) {
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry* found;
+    const struct aesd_buffer_entry* expected;
+    struct model m;
+    size_t entry_offset = 0;
+    size_t expected_offset = 0;
+    size_t offset;
+    size_t max_bytes = 0;
+    unsigned long serial = 0;
+    unsigned long i;
+    char* data;
+
+    aesd_circular_buffer_init(&buffer);
+    memset(&m, 0, sizeof(m));
+
+    for (i = 0; i < cfg->stress_ops; i++) {
+        // change the byte budget now and then to cover both eviction paths
+        if (i % 10000 == 0) {
+            max_bytes = (rand() % 2) ? 0 : cfg->max_size * (1 + rand() % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+            buffer.max_size = max_bytes;
+        }
+
+        if (rand() % 2) {
+            entry.size = random_size(cfg);
+            data = malloc(entry.size);
+            if (data == NULL) {
+                perror("malloc");
+                return -1;
+            }
+            memset(data, (char) serial++, entry.size);
+            entry.buffptr = data;
+
+            while ((data = (char*) aesd_circular_buffer_make_room(&buffer, entry.size)) != NULL) {
+                free(data);
+            }
+            data = (char*) aesd_circular_buffer_add_entry(&buffer, &entry);
+            free(data);
+            model_add(&m, &entry, max_bytes);
+        }
+        else {
+            offset = (size_t) rand() % (m.total_size + cfg->max_size + 1);
+            found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset);
+            expected = model_find(&m, offset, &expected_offset);
+
+            if ((found == NULL) != (expected == NULL) ||
+                (found != NULL && (found->buffptr != expected->buffptr || found->size != expected->size ||
+                                   entry_offset != expected_offset))) {
+                printf("stress: mismatch at op %lu for offset %zu\n", i, offset);
+                return -1;
+            }
+        }
+
+        if (buffer.total_size != m.total_size || buffer.evictions != m.evictions) {
+            printf("stress: accounting mismatch at op %lu: total %zu/%zu evictions %lu/%lu\n",
+                   i, buffer.total_size, m.total_size, buffer.evictions, m.evictions);
+            return -1;
+        }
+    }
+
+    aesd_circular_buffer_free(&buffer);
+    printf("stress: %lu ops ok (seed %u)\n", cfg->stress_ops, cfg->seed);
+    return 0;
+}
+
+static bool parse_sizes(const char* arg, struct bench_config* cfg) {
+    char* end;
+
+    cfg->min_size = strtoul(arg, &end, 10);
+    cfg->max_size = cfg->min_size;
+    if (*end == ':') {
+        cfg->max_size = strtoul(end + 1, &end, 10);
+    }
+    return *end == '\0' && cfg->min_size > 0 && cfg->max_size >= cfg->min_size;
+}
+
+int main(int argc, char** argv) {
+    struct bench_config cfg = {
+        .ops = DEFAULT_OPS,
+        .stress_ops = DEFAULT_STRESS_OPS,
+        .min_size = 1,
+        .max_size = DEFAULT_MAX_ENTRY_SIZE,
+        .max_bytes = 0,
+        .pattern = READ_RANDOM,
+        .seed = (unsigned int) time(NULL),
+        .stress_only = false,
+    };
+    char* pool;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:r:b:x:S:th")) != -1) {
+        switch (opt) {
+        case 'n':
+            cfg.ops = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if (!parse_sizes(optarg, &cfg)) {
+                printf("invalid size range %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "seq") == 0) {
+                cfg.pattern = READ_SEQ;
+            }
+            else if (strcmp(optarg, "random") == 0) {
+                cfg.pattern = READ_RANDOM;
+            }
+            else if (strcmp(optarg, "tail") == 0) {
+                cfg.pattern = READ_TAIL;
+            }
+            else {
+                printf("unknown read pattern %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            cfg.max_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            cfg.stress_ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            cfg.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            cfg.stress_only = true;
+            break;
+        case 'h':
+        default:
+            printf("usage: %s [-n ops] [-s min:max] [-r seq|random|tail] [-b max_bytes] [-x stress_ops] [-S seed] [-t] [-h]\n",
+                   argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.ops == 0) {
+        cfg.ops = 1;
+    }
+    srand(cfg.seed);
+
+    if (!cfg.stress_only) {
+        pool = malloc(cfg.max_size);
+        if (pool == NULL) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        memset(pool, 'x', cfg.max_size);
+
+        printf("entries %d, sizes %zu-%zu, max_bytes %zu\n",
+               AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, cfg.min_size, cfg.max_size, cfg.max_bytes);
+        bench_add(&cfg, pool);
+        bench_find(&cfg, pool);
+        free(pool);
+    }
+
+    if (run_stress(&cfg) != 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,371 @@
+/**
+ * @file aesd-circular-buffer-lockfree-bench.c
+ * @brief Throughput of aesd-circular-buffer-lockfree.c against the mutex wrapped aesd-circular-buffer.c
+ *
+ * Two workloads are measured for 1, 2, 4 ... max_threads threads:
+ *   log   - every thread appends entries (evicting the oldest when full) and
+ *           read_pct percent of operations take an offset lookup instead,
+ *           like writers and readers of the char driver
+ *   queue - half the threads produce and half consume, like a hand-off
+ *           between threads in aesdsocket
+ *
+ * Usage: aesd-circular-buffer-lockfree-bench [-T max_threads] [-d ms_per_run] [-r read_pct] [-c]
+ *   -c runs a multithreaded conservation check instead (used by ctest): every
+ *      entry added must be removed or evicted exactly once, and never while a
+ *      snapshot still holds it
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../aesd-circular-buffer.h"
+#include "../aesd-circular-buffer-lockfree.h"
+
+#define DEFAULT_MAX_THREADS 64
+#define DEFAULT_RUN_MS 200
+#define DEFAULT_READ_PCT 10
+#define CHECK_THREADS 8
+#define CHECK_ENTRIES_PER_PRODUCER 200000
+
+enum workload {
+    WORKLOAD_LOG,
+    WORKLOAD_QUEUE,
+};
+
+struct shared_state {
+    // mutex wrapped original
+    pthread_mutex_t mutex;
+    struct aesd_circular_buffer buffer;
+    // lock-free variant
+    struct aesd_lockfree_ring ring;
+    bool use_lockfree;
+    enum workload workload;
+    int read_pct;
+    atomic_bool stop;
+};
+
+struct worker {
+    pthread_t thread_id;
+    struct shared_state* state;
+    int index;
+    unsigned long ops;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the original API has no consumer side, pop the oldest entry the same way add_entry overwrites it
+static bool locked_remove_entry(struct shared_state* state, struct aesd_buffer_entry* entry_rtn) {
+    struct aesd_circular_buffer* buffer = &state->buffer;
+    bool found = false;
+
+    pthread_mutex_lock(&state->mutex);
+    if (buffer->out_offs != buffer->in_offs || buffer->full) {
+        *entry_rtn = buffer->entry[buffer->out_offs];
+        buffer->total_size -= entry_rtn->size;
+        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->full = false;
+        found = true;
+    }
+    pthread_mutex_unlock(&state->mutex);
+    return found;
+}
+
+static bool locked_try_add_entry(struct shared_state* state, const struct aesd_buffer_entry* entry) {
+    bool added = false;
+
+    pthread_mutex_lock(&state->mutex);
+    if (!state->buffer.full) {
+        aesd_circular_buffer_add_entry(&state->buffer, entry);
+        added = true;
+    }
+    pthread_mutex_unlock(&state->mutex);
+    return added;
+}
+
+static void log_op(struct shared_state* state, unsigned int* seed, const struct aesd_buffer_entry* entry) {
+    struct aesd_circular_buffer snapshot;
+    size_t entry_offset;
+    unsigned int phase;
+
+    if ((int) (rand_r(seed) % 100) < state->read_pct) {
+        if (state->use_lockfree) {
+            phase = aesd_lockfree_ring_snapshot(&state->ring, &snapshot);
+            aesd_circular_buffer_find_entry_offset_for_fpos(&snapshot, rand_r(seed) % 64, &entry_offset);
+            aesd_lockfree_ring_snapshot_release(&state->ring, phase);
+        }
+        else {
+            pthread_mutex_lock(&state->mutex);
+            aesd_circular_buffer_find_entry_offset_for_fpos(&state->buffer, rand_r(seed) % 64, &entry_offset);
+            pthread_mutex_unlock(&state->mutex);
+        }
+    }
+    else {
+        if (state->use_lockfree) {
+            aesd_lockfree_ring_add_entry(&state->ring, entry, NULL, NULL);
+        }
+        else {
+            pthread_mutex_lock(&state->mutex);
+            aesd_circular_buffer_add_entry(&state->buffer, entry);
+            pthread_mutex_unlock(&state->mutex);
+        }
+    }
+}
+
+static void* worker_function(void* arg) {
+    struct worker* w = (struct worker*) arg;
+    struct shared_state* state = w->state;
+    struct aesd_buffer_entry entry = { .buffptr = "bench\n", .size = 6 };
+    struct aesd_buffer_entry removed;
+    unsigned int seed = (unsigned int) w->index * 7919 + 1;
+    bool producer = (w->index % 2) == 0;
+    bool done;
+
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        if (state->workload == WORKLOAD_LOG) {
+            log_op(state, &seed, &entry);
+            w->ops++;
+            continue;
+        }
+
+        // queue workload: only successful transfers count
+        if (state->use_lockfree) {
+            done = producer ? aesd_lockfree_ring_try_add_entry(&state->ring, &entry)
+                            : aesd_lockfree_ring_remove_entry(&state->ring, &removed);
+        }
+        else {
+            done = producer ? locked_try_add_entry(state, &entry)
+                            : locked_remove_entry(state, &removed);
+        }
+        if (done) {
+            w->ops++;
+        }
+        else {
+            // ring full or empty, let the other side run when threads outnumber cores
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static double run_once(struct shared_state* state, int num_threads, int run_ms) {
+    struct worker workers[DEFAULT_MAX_THREADS * 4];
+    struct timespec run_time = { run_ms / 1000, (run_ms % 1000) * 1000000L };
+    unsigned long total_ops = 0;
+    uint64_t start;
+    uint64_t elapsed;
+    int i;
+
+    aesd_circular_buffer_init(&state->buffer);
+    if (aesd_lockfree_ring_init(&state->ring, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) != 0) {
+        perror("aesd_lockfree_ring_init");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&state->stop, false);
+
+    start = now_ns();
+    for (i = 0; i < num_threads; i++) {
+        workers[i].state = state;
+        workers[i].index = i;
+        workers[i].ops = 0;
+        if (pthread_create(&workers[i].thread_id, NULL, worker_function, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    nanosleep(&run_time, NULL);
+    atomic_store(&state->stop, true);
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        total_ops += workers[i].ops;
+    }
+    elapsed = now_ns() - start;
+
+    aesd_lockfree_ring_free(&state->ring, NULL, NULL);
+    return (double) total_ops * 1000.0 / elapsed; // Mops/s
+}
+
+struct check_state {
+    struct aesd_lockfree_ring ring;
+    atomic_uchar* seen; // one counter per entry id, bumped where the entry would be freed
+    atomic_int producers_left;
+    atomic_bool freed_in_snapshot;
+};
+
+static void check_mark(const char* buffptr, void* arg) {
+    struct check_state* check = (struct check_state*) arg;
+    atomic_fetch_add(&check->seen[(uintptr_t) buffptr - 1], 1);
+}
+
+// nothing a snapshot holds may have been freed yet
+static void check_snapshot(struct check_state* check, struct aesd_circular_buffer* snapshot) {
+    struct aesd_buffer_entry* entry;
+    uint8_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, snapshot, index) {
+        if (entry->buffptr != NULL && atomic_load(&check->seen[(uintptr_t) entry->buffptr - 1]) != 0) {
+            atomic_store(&check->freed_in_snapshot, true);
+        }
+    }
+}
+
+static void* check_producer(void* arg) {
+    struct check_state* check = (struct check_state*) arg;
+    static atomic_int next_producer;
+    int producer = atomic_fetch_add(&next_producer, 1);
+    struct aesd_buffer_entry entry;
+    uintptr_t id;
+    int i;
+
+    for (i = 0; i < CHECK_ENTRIES_PER_PRODUCER; i++) {
+        id = (uintptr_t) producer * CHECK_ENTRIES_PER_PRODUCER + i;
+        entry.buffptr = (const char*) (id + 1); // ids double as non-NULL pointers
+        entry.size = 1;
+        aesd_lockfree_ring_add_entry(&check->ring, &entry, check_mark, check);
+    }
+    atomic_fetch_sub(&check->producers_left, 1);
+    return NULL;
+}
+
+static void* check_consumer(void* arg) {
+    struct check_state* check = (struct check_state*) arg;
+    struct aesd_circular_buffer snapshot;
+    struct aesd_buffer_entry entry;
+    size_t entry_offset;
+    unsigned int phase;
+
+    while (atomic_load(&check->producers_left) > 0) {
+        if (aesd_lockfree_ring_remove_entry(&check->ring, &entry)) {
+            // other consumers may hold it in a snapshot
+            aesd_lockfree_ring_synchronize(&check->ring);
+            check_mark(entry.buffptr, check);
+        }
+        else {
+            // snapshots must always be internally consistent, and pin what they hold
+            phase = aesd_lockfree_ring_snapshot(&check->ring, &snapshot);
+            aesd_circular_buffer_find_entry_offset_for_fpos(&snapshot, 0, &entry_offset);
+            check_snapshot(check, &snapshot);
+            aesd_lockfree_ring_snapshot_release(&check->ring, phase);
+        }
+    }
+    return NULL;
+}
+
+static int run_check(void) {
+    struct check_state check;
+    pthread_t threads[CHECK_THREADS];
+    size_t total = (size_t) (CHECK_THREADS / 2) * CHECK_ENTRIES_PER_PRODUCER;
+    size_t i;
+    int t;
+
+    if (aesd_lockfree_ring_init(&check.ring, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) != 0) {
+        perror("aesd_lockfree_ring_init");
+        return -1;
+    }
+    check.seen = calloc(total, sizeof(atomic_uchar));
+    if (check.seen == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    atomic_init(&check.producers_left, CHECK_THREADS / 2);
+    atomic_init(&check.freed_in_snapshot, false);
+
+    for (t = 0; t < CHECK_THREADS; t++) {
+        if (pthread_create(&threads[t], NULL, (t % 2) ? check_consumer : check_producer, &check) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    for (t = 0; t < CHECK_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    aesd_lockfree_ring_free(&check.ring, check_mark, &check);
+
+    if (atomic_load(&check.freed_in_snapshot)) {
+        printf("check: a snapshot held an entry that was already freed\n");
+        free(check.seen);
+        return -1;
+    }
+    for (i = 0; i < total; i++) {
+        if (atomic_load(&check.seen[i]) != 1) {
+            printf("check: entry %zu seen %d times\n", i, (int) atomic_load(&check.seen[i]));
+            free(check.seen);
+            return -1;
+        }
+    }
+    free(check.seen);
+    printf("check: %zu entries, each removed or evicted exactly once\n", total);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    struct shared_state state;
+    int max_threads = DEFAULT_MAX_THREADS;
+    int run_ms = DEFAULT_RUN_MS;
+    int threads;
+    double mutex_mops;
+    double lockfree_mops;
+    int opt;
+
+    memset(&state, 0, sizeof(state));
+    state.read_pct = DEFAULT_READ_PCT;
+
+    while ((opt = getopt(argc, argv, "T:d:r:c")) != -1) {
+        switch (opt) {
+        case 'T':
+            max_threads = atoi(optarg);
+            if (max_threads < 1 || max_threads > DEFAULT_MAX_THREADS * 4) {
+                printf("max_threads must be 1-%d\n", DEFAULT_MAX_THREADS * 4);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            run_ms = atoi(optarg);
+            break;
+        case 'r':
+            state.read_pct = atoi(optarg);
+            break;
+        case 'c':
+            return (run_check() == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        default:
+            printf("usage: %s [-T max_threads] [-d ms_per_run] [-r read_pct] [-c]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_mutex_init(&state.mutex, NULL);
+
+    for (state.workload = WORKLOAD_LOG; state.workload <= WORKLOAD_QUEUE; state.workload++) {
+        printf("%s workload%s\n", (state.workload == WORKLOAD_LOG) ? "log" : "queue",
+               (state.workload == WORKLOAD_LOG) ? "" : " (even threads produce, odd threads consume)");
+        printf("threads  mutex Mops/s  lockfree Mops/s\n");
+
+        for (threads = 1; threads <= max_threads; threads *= 2) {
+            // the queue workload needs at least one producer and one consumer
+            if (state.workload == WORKLOAD_QUEUE && threads == 1) {
+                continue;
+            }
+            state.use_lockfree = false;
+            mutex_mops = run_once(&state, threads, run_ms);
+            state.use_lockfree = true;
+            lockfree_mops = run_once(&state, threads, run_ms);
+            printf("%7d  %12.2f  %15.2f\n", threads, mutex_mops, lockfree_mops);
+        }
+    }
+
+    pthread_mutex_destroy(&state.mutex);
+    return EXIT_SUCCESS;
+}
@@ -17,154 +17,561 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h> // iov_iter
+#include <linux/splice.h>
+#include <linux/version.h>
 #include <linux/slab.h>
+#include <linux/kernel.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
 #include "aesdchar.h"
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = AESD_NR_DEVS; // number of /dev/aesdcharN devices
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of independent aesdchar devices to create");
+
+/*
+ * When set, a blocking reader that reaches the end of the buffer sleeps until
+ * a new command is committed instead of returning 0 (like tail -f).
+ */
+static bool aesd_blocking_read = false;
+module_param(aesd_blocking_read, bool, S_IRUGO);
+MODULE_PARM_DESC(aesd_blocking_read, "Block readers at end of buffer until a new command is written");
+
+/*
+ * Optional per-device byte budget for stored commands.  Oldest commands are
+ * evicted until a new one fits, on top of the fixed entry count limit.
+ */
+static unsigned long aesd_max_bytes = 0;
+module_param(aesd_max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_bytes, "Maximum bytes stored per device, 0 for no byte limit");
 
 MODULE_AUTHOR("Bjorn Nelson"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; // allocated in aesd_init_module
+static struct dentry *aesd_debugfs_root;
+
+/*
+ * Accounts time spent waiting for dev_ptr->lock, call right after acquiring it.
+ */
+static void aesd_note_lock_wait(struct aesd_dev *dev_ptr, u64 start_ns)
+{
+	u64 wait_ns = ktime_get_ns() - start_ns;
+
+	dev_ptr->stats.lock_acquisitions++;
+	dev_ptr->stats.lock_wait_ns += wait_ns;
+	if (wait_ns > dev_ptr->stats.lock_wait_max_ns) {
+		dev_ptr->stats.lock_wait_max_ns = wait_ns;
+	}
+	trace_aesd_lock_acquired(dev_ptr->minor, wait_ns);
+}
+
+/*
+ * Bucket n counts latencies in [2^(n-1), 2^n) ns
+ */
+static void aesd_hist_add(atomic64_t *hist, u64 ns)
+{
+	int bucket = fls64(ns);
+
+	if (bucket >= AESD_HIST_BUCKETS) {
+		bucket = AESD_HIST_BUCKETS - 1;
+	}
+	atomic64_inc(&hist[bucket]);
+}
+
+static int aesd_queue_entries(const struct aesd_circular_buffer *queue)
+{
+	if (queue->full) {
+		return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	}
+	return (queue->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - queue->out_offs) %
+		AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
 	struct aesd_dev* dev_ptr;
+	struct aesd_file* file_ptr;
 	PDEBUG("open");
 	/**
 	 * TODO: handle open
 	 */
 
 	dev_ptr = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = dev_ptr;
+
+	file_ptr = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+	if (file_ptr == NULL) {
+		return -ENOMEM;
+	}
+	file_ptr->dev = dev_ptr;
+	mutex_init(&file_ptr->lock);
+
+	// pick up a partial command left behind by the previous writer
+	if (filp->f_mode & FMODE_WRITE) {
+		if (mutex_lock_interruptible(&dev_ptr->lock)) {
+			kfree(file_ptr);
+			return -ERESTARTSYS;
+		}
+		file_ptr->entry = dev_ptr->entry;
+		dev_ptr->entry.buffptr = NULL;
+		dev_ptr->entry.size = 0;
+		mutex_unlock(&dev_ptr->lock);
+	}
+
+	filp->private_data = file_ptr;
 	return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+	struct aesd_file* file_ptr = (struct aesd_file*)(filp->private_data);
+	struct aesd_dev* dev_ptr = file_ptr->dev;
+	char* new_buffptr;
 	PDEBUG("release");
 	/**
 	 * TODO: handle release
 	 */
+
+	// park an unterminated command on the device so the next writer continues it
+	if (file_ptr->entry.size > 0) {
+		mutex_lock(&dev_ptr->lock);
+		if (dev_ptr->entry.size == 0) {
+			kfree(dev_ptr->entry.buffptr);
+			dev_ptr->entry = file_ptr->entry;
+			file_ptr->entry.buffptr = NULL;
+		}
+		else {
+			new_buffptr = krealloc(dev_ptr->entry.buffptr, dev_ptr->entry.size + file_ptr->entry.size, GFP_KERNEL);
+			if (new_buffptr != NULL) {
+				memcpy(&new_buffptr[dev_ptr->entry.size], file_ptr->entry.buffptr, file_ptr->entry.size);
+				dev_ptr->entry.buffptr = new_buffptr;
+				dev_ptr->entry.size += file_ptr->entry.size;
+			}
+			else {
+				// release cannot fail, the parked start of the command is kept and this part is lost
+				printk(KERN_WARNING "aesdchar: out of memory, dropping %zu bytes of a partial write\n",
+				       file_ptr->entry.size);
+			}
+		}
+		mutex_unlock(&dev_ptr->lock);
+	}
+
+	kfree(file_ptr->entry.buffptr);
+	kfree(file_ptr);
 	return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Reader positions are offsets into everything ever written to the device, so
+ * evicting old commands does not move them.  Returns the entry holding *pos,
+ * first moving *pos up to the oldest stored byte if the reader fell behind.
+ * Caller must hold dev_ptr->lock.
+ */
+static struct aesd_buffer_entry *aesd_find_stream_pos(struct aesd_dev *dev_ptr, loff_t *pos, size_t *entry_offset)
+{
+	if (*pos < dev_ptr->queue.evicted_size) {
+		*pos = dev_ptr->queue.evicted_size;
+	}
+	return aesd_circular_buffer_find_entry_offset_for_fpos(&dev_ptr->queue, *pos - dev_ptr->queue.evicted_size,
+							       entry_offset);
+}
+
+static ssize_t aesd_do_read(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t retval = 0;
-	struct aesd_dev* dev_ptr = (struct aesd_dev*)(filp->private_data);
-	size_t buf_index = 0;
-	size_t bytes_left = count;
+	struct file *filp = iocb->ki_filp;
+	struct aesd_dev* dev_ptr = ((struct aesd_file*)(filp->private_data))->dev;
 	size_t bytes_read;
-	size_t bytes_missing;
+	size_t bytes_copied;
 	struct aesd_buffer_entry* cur_entry;
 	size_t entry_offset;
+	unsigned long write_seq;
+	u64 lock_start;
 
-	PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+	PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),iocb->ki_pos);
 	/**
 	 * TODO: handle read
 	 */
 
+	lock_start = ktime_get_ns();
 	if (mutex_lock_interruptible(&dev_ptr->lock)) {
 		return -ERESTARTSYS;
 	}
+	aesd_note_lock_wait(dev_ptr, lock_start);
 
-	do {
-		cur_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev_ptr->queue, *f_pos, &entry_offset);
+	// optionally wait for a writer to commit data past the current position
+	while (aesd_blocking_read &&
+	       aesd_find_stream_pos(dev_ptr, &iocb->ki_pos, &entry_offset) == NULL) {
+		write_seq = dev_ptr->write_seq;
+		mutex_unlock(&dev_ptr->lock);
+
+		if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(dev_ptr->wq, READ_ONCE(dev_ptr->write_seq) != write_seq)) {
+			return -ERESTARTSYS;
+		}
+		lock_start = ktime_get_ns();
+		if (mutex_lock_interruptible(&dev_ptr->lock)) {
+			return -ERESTARTSYS;
+		}
+		aesd_note_lock_wait(dev_ptr, lock_start);
+	}
+
+	// walk entries until the iterator (one buffer, an iovec array or a pipe) is full
+	while (iov_iter_count(to) > 0) {
+		cur_entry = aesd_find_stream_pos(dev_ptr, &iocb->ki_pos, &entry_offset);
 
 		if (cur_entry == NULL) {
-			goto exit;
+			break;
 		}
 
 		bytes_read = cur_entry->size - entry_offset;
-        if (count < bytes_read) {
-            bytes_read = count;
-        }
-
-		bytes_missing = copy_to_user(&buf[buf_index], &cur_entry->buffptr[entry_offset], bytes_read);
-		if (bytes_missing != 0) {
-			PDEBUG("Error: not all bytes copied in copy_to_user\n");
+		bytes_copied = copy_to_iter(&cur_entry->buffptr[entry_offset], bytes_read, to);
+		iocb->ki_pos += bytes_copied;
+		retval += bytes_copied;
+
+		if (bytes_copied != bytes_read) {
+			// destination full or faulted, report what was copied so far
+			if (bytes_copied == 0 && retval == 0) {
+				retval = -EFAULT;
+			}
+			break;
 		}
-		bytes_left -= (bytes_read - bytes_missing);
-		*f_pos += (bytes_read - bytes_missing);
-		buf_index += (bytes_read - bytes_missing);
-		retval += (bytes_read - bytes_missing);
-	} while (bytes_left > 0);
+	}
 
- exit:
 	mutex_unlock(&dev_ptr->lock);
 	return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct aesd_dev* dev_ptr = ((struct aesd_file*)(iocb->ki_filp->private_data))->dev;
+	u64 start_ns = ktime_get_ns();
+	u64 latency_ns;
+	ssize_t retval;
+
+	trace_aesd_read_enter(dev_ptr->minor, iov_iter_count(to), iocb->ki_pos);
+	retval = aesd_do_read(iocb, to);
+	latency_ns = ktime_get_ns() - start_ns;
+	aesd_hist_add(dev_ptr->stats.read_hist, latency_ns);
+	trace_aesd_read_exit(dev_ptr->minor, retval, latency_ns);
+
+	return retval;
+}
+
+/*
+ * Stores one newline terminated command in the device's circular buffer, freeing
+ * whatever it displaces.  Caller must hold dev_ptr->lock.
+ */
+static void aesd_commit_entry(struct aesd_dev *dev_ptr, const struct aesd_buffer_entry *cmd)
 {
-	struct aesd_dev* dev_ptr = (struct aesd_dev*)(filp->private_data);
-	size_t bytes_missed;
-	char* newline_status;
 	const char* overwrite_status;
+	unsigned long evictions = dev_ptr->queue.evictions;
+	size_t total_size = dev_ptr->queue.total_size;
+
+	// evict oldest commands until the new one fits the byte budget
+	while ((overwrite_status = aesd_circular_buffer_make_room(&dev_ptr->queue, cmd->size)) != NULL) {
+		kfree(overwrite_status);
+	}
+
+	overwrite_status = aesd_circular_buffer_add_entry(&dev_ptr->queue, cmd);
+	if (overwrite_status) {
+		kfree(overwrite_status);
+	}
+
+	if (dev_ptr->queue.evictions != evictions) {
+		trace_aesd_evict(dev_ptr->minor, dev_ptr->queue.evictions - evictions,
+				 total_size + cmd->size - dev_ptr->queue.total_size);
+	}
+}
+
+static ssize_t aesd_do_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct aesd_file* file_ptr = (struct aesd_file*)(iocb->ki_filp->private_data);
+	struct aesd_dev* dev_ptr = file_ptr->dev;
+	struct aesd_buffer_entry* staged = &file_ptr->entry;
+	size_t count = iov_iter_count(from);
+	size_t bytes_copied;
+	char* new_buffptr;
+	char* newline_status;
+	// only the newest commands of a batch can survive in the circular buffer
+	struct aesd_buffer_entry cmds[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	size_t cmd_starts[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	size_t scan_pos;
+	size_t staged_size;
+	size_t cmd_start = 0;
+	unsigned long total_cmds = 0;
+	unsigned long skipped_cmds;
+	size_t skipped_size = 0;
+	int num_cmds;
+	int first;
+	int i;
+	bool handed_over = false;
+	u64 lock_start;
 	ssize_t retval = -ENOMEM;
-	PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+	PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
 	/**
 	 * TODO: handle write
 	 */
-	
-    if (mutex_lock_interruptible(&dev_ptr->lock)) {
+
+	if (count == 0) {
+		return 0;
+	}
+
+	// the staging buffer is private to this file, the device lock is not needed to fill it
+	if (mutex_lock_interruptible(&file_ptr->lock)) {
 		return -ERESTARTSYS;
 	}
 
-	if (dev_ptr->entry.size == 0) {
-		dev_ptr->entry.buffptr = kmalloc(count, GFP_KERNEL);
+	// grow once for the whole request, even when writev passes many iovecs
+	new_buffptr = krealloc(staged->buffptr, staged->size + count, GFP_KERNEL);
+	if (new_buffptr == NULL) {
+		goto exit;
 	}
-	else {
-		dev_ptr->entry.buffptr = krealloc(dev_ptr->entry.buffptr, dev_ptr->entry.size + count, GFP_KERNEL);
+	staged->buffptr = new_buffptr;
+
+	bytes_copied = copy_from_iter(&new_buffptr[staged->size], count, from);
+	if (bytes_copied != count) {
+		printk("Bad copy_from_iter in aesd_write_iter\n");
+		if (bytes_copied == 0) {
+			retval = -EFAULT;
+			goto exit;
+		}
 	}
-	if (dev_ptr->entry.buffptr == NULL) {
-		goto exit;
+
+	// the carried over tail has no newline, so only the new bytes need scanning
+	scan_pos = staged->size;
+	staged_size = staged->size + bytes_copied;
+
+	// remember where the newest commands start, older ones would be evicted by this same write
+	while ((newline_status = memchr(&new_buffptr[scan_pos], '\n', staged_size - scan_pos)) != NULL) {
+		scan_pos = newline_status - new_buffptr + 1;
+		cmd_starts[total_cmds % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED] = cmd_start;
+		cmd_start = scan_pos;
+		total_cmds++;
+	}
+
+	num_cmds = min_t(unsigned long, total_cmds, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+	skipped_cmds = total_cmds - num_cmds;
+	first = total_cmds % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	if (total_cmds < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+		first = 0;
+	}
+	else {
+		// the skipped commands are everything before the first kept one
+		skipped_size = cmd_starts[first];
 	}
 
-    bytes_missed = copy_from_user((void *)(&dev_ptr->entry.buffptr[dev_ptr->entry.size]), buf, count);
-	if (bytes_missed != 0) {
-		printk("Bad copy_from_user in aesd_write\n");
+	// build the entries to publish before taking the device lock
+	for (i = 0; i < num_cmds; i++) {
+		size_t start = cmd_starts[(first + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+		size_t end = (i + 1 < num_cmds) ?
+			cmd_starts[(first + i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED] : cmd_start;
+
+		cmds[i].size = end - start;
+		if (start == 0 && end == staged_size) {
+			// the whole staging buffer is a single command, hand it over as is
+			cmds[i].buffptr = new_buffptr;
+			handed_over = true;
+		}
+		else {
+			cmds[i].buffptr = kmemdup(&new_buffptr[start], cmds[i].size, GFP_KERNEL);
+			if (cmds[i].buffptr == NULL) {
+				// drop this write entirely, the staged partial command is left as it was
+				while (--i >= 0) {
+					kfree(cmds[i].buffptr);
+				}
+				goto exit;
+			}
+		}
 	}
-	retval = count - bytes_missed;
-	dev_ptr->entry.size += retval;
 
-	newline_status = (char*) memchr(dev_ptr->entry.buffptr, '\n', dev_ptr->entry.size);
+	retval = bytes_copied;
 
-	if (newline_status != NULL) {
-		overwrite_status = aesd_circular_buffer_add_entry(&dev_ptr->queue, &dev_ptr->entry);
-		if (overwrite_status) {
-			kfree(overwrite_status);
+	// keep only the partial command after the last newline staged
+	if (handed_over || cmd_start == staged_size) {
+		if (!handed_over) {
+			kfree(new_buffptr);
 		}
-		dev_ptr->entry.buffptr = NULL;
-		dev_ptr->entry.size = 0;
+		staged->buffptr = NULL;
+		staged->size = 0;
 	}
+	else {
+		staged->size = staged_size - cmd_start;
+		if (cmd_start > 0) {
+			memmove(new_buffptr, &new_buffptr[cmd_start], staged->size);
+		}
+	}
+
+	if (num_cmds == 0) {
+		goto exit;
+	}
+
+	// publish the finished commands, the only part that needs the device lock
+	lock_start = ktime_get_ns();
+	mutex_lock(&dev_ptr->lock);
+	aesd_note_lock_wait(dev_ptr, lock_start);
+	dev_ptr->queue.evictions += skipped_cmds;
+	dev_ptr->queue.evicted_size += skipped_size;
+	for (i = 0; i < num_cmds; i++) {
+		aesd_commit_entry(dev_ptr, &cmds[i]);
+	}
+
+	// let readers and pollers know complete commands are available
+	WRITE_ONCE(dev_ptr->write_seq, dev_ptr->write_seq + total_cmds);
+	wake_up_interruptible(&dev_ptr->wq);
+	mutex_unlock(&dev_ptr->lock);
 
  exit:
-    mutex_unlock(&dev_ptr->lock);
+	mutex_unlock(&file_ptr->lock);
 	return retval;
 }
 
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct aesd_dev* dev_ptr = ((struct aesd_file*)(iocb->ki_filp->private_data))->dev;
+	u64 start_ns = ktime_get_ns();
+	u64 latency_ns;
+	ssize_t retval;
+
+	trace_aesd_write_enter(dev_ptr->minor, iov_iter_count(from), iocb->ki_pos);
+	retval = aesd_do_write(iocb, from);
+	latency_ns = ktime_get_ns() - start_ns;
+	aesd_hist_add(dev_ptr->stats.write_hist, latency_ns);
+	trace_aesd_write_exit(dev_ptr->minor, retval, latency_ns);
+
+	return retval;
+}
+
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct aesd_dev* dev_ptr = ((struct aesd_file*)(filp->private_data))->dev;
+	size_t entry_offset;
+	loff_t pos = filp->f_pos; // the next read moves it, not a poll
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM; // writes never block
+	u64 lock_start;
+
+	poll_wait(filp, &dev_ptr->wq, wait);
+
+	lock_start = ktime_get_ns();
+	mutex_lock(&dev_ptr->lock);
+	aesd_note_lock_wait(dev_ptr, lock_start);
+	if (aesd_find_stream_pos(dev_ptr, &pos, &entry_offset) != NULL) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	mutex_unlock(&dev_ptr->lock);
+
+	return mask;
+}
+
 struct file_operations aesd_fops = {
 	.owner =    THIS_MODULE,
-	.read =     aesd_read,
-	.write =    aesd_write,
+	.read_iter =  aesd_read_iter,
+	.write_iter = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.poll =     aesd_poll,
 	.open =     aesd_open,
 	.release =  aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/*
+ * /proc/aesdchar: one line of buffer usage per device
+ */
+static int aesd_proc_show(struct seq_file *s, void *v)
+{
+	struct aesd_dev *dev_ptr;
+	struct aesd_circular_buffer *queue;
+	int entries;
+	int i;
+
+	for (i = 0; i < aesd_nr_devs; i++) {
+		dev_ptr = &aesd_devices[i];
+		if (mutex_lock_interruptible(&dev_ptr->lock)) {
+			return -ERESTARTSYS;
+		}
+		queue = &dev_ptr->queue;
+		entries = aesd_queue_entries(queue);
+		seq_printf(s, "aesdchar%d: entries %d bytes %zu max_bytes %zu evictions %lu\n",
+			   i, entries, queue->total_size, queue->max_size, queue->evictions);
+		mutex_unlock(&dev_ptr->lock);
+	}
+	return 0;
+}
+
+/*
+ * debugfs aesdchar/aesdcharN/stats: buffer usage, lock wait time and
+ * read/write latency histograms for one device
+ */
+static int aesd_stats_show(struct seq_file *s, void *unused)
 {
-	int err, devno = MKDEV(aesd_major, aesd_minor);
+	struct aesd_dev *dev_ptr = s->private;
+	struct aesd_stats *stats = &dev_ptr->stats;
+	u64 acquisitions, wait_ns, wait_max_ns;
+	unsigned long evictions;
+	size_t total_size;
+	int entries;
+	int i;
+
+	if (mutex_lock_interruptible(&dev_ptr->lock)) {
+		return -ERESTARTSYS;
+	}
+	entries = aesd_queue_entries(&dev_ptr->queue);
+	total_size = dev_ptr->queue.total_size;
+	evictions = dev_ptr->queue.evictions;
+	acquisitions = stats->lock_acquisitions;
+	wait_ns = stats->lock_wait_ns;
+	wait_max_ns = stats->lock_wait_max_ns;
+	mutex_unlock(&dev_ptr->lock);
+
+	seq_printf(s, "entries %d\nbytes %zu\nevictions %lu\n", entries, total_size, evictions);
+	seq_printf(s, "lock_acquisitions %llu\nlock_wait_ns %llu\nlock_wait_max_ns %llu\n",
+		   acquisitions, wait_ns, wait_max_ns);
+
+	seq_puts(s, "latency_ns_below read write\n");
+	for (i = 0; i < AESD_HIST_BUCKETS; i++) {
+		s64 reads = atomic64_read(&stats->read_hist[i]);
+		s64 writes = atomic64_read(&stats->write_hist[i]);
+
+		if (reads == 0 && writes == 0) {
+			continue;
+		}
+		if (i == AESD_HIST_BUCKETS - 1) {
+			seq_printf(s, "inf %lld %lld\n", reads, writes);
+		}
+		else {
+			seq_printf(s, "%llu %lld %lld\n", 1ULL << i, reads, writes);
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
+{
+	int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
 	cdev_init(&dev->cdev, &aesd_fops);
 	dev->cdev.owner = THIS_MODULE;
 	dev->cdev.ops = &aesd_fops;
 	err = cdev_add (&dev->cdev, devno, 1);
 	if (err) {
-		printk(KERN_ERR "Error %d adding aesd cdev", err);
+		printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
 	}
 	return err;
 }
@@ -175,45 +582,94 @@ int aesd_init_module(void)
 {
 	dev_t dev = 0;
 	int result;
-	result = alloc_chrdev_region(&dev, aesd_minor, 1,
+	int i;
+
+	if (aesd_nr_devs < 1) {
+		printk(KERN_WARNING "aesd_nr_devs must be at least 1\n");
+		return -EINVAL;
+	}
+
+	result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
 			"aesdchar");
 	aesd_major = MAJOR(dev);
 	if (result < 0) {
 		printk(KERN_WARNING "Can't get major %d\n", aesd_major);
 		return result;
 	}
-	memset(&aesd_device,0,sizeof(struct aesd_dev));
+
+	aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+	if (aesd_devices == NULL) {
+		unregister_chrdev_region(dev, aesd_nr_devs);
+		return -ENOMEM;
+	}
 
 	/**
 	 * TODO: initialize the AESD specific portion of the device
 	 */
 
-	mutex_init(&aesd_device.lock);
-	aesd_circular_buffer_init(&aesd_device.queue);
+	// each device gets its own buffer, lock and staging entry
+	for (i = 0; i < aesd_nr_devs; i++) {
+		mutex_init(&aesd_devices[i].lock);
+		init_waitqueue_head(&aesd_devices[i].wq);
+		aesd_circular_buffer_init(&aesd_devices[i].queue);
+		aesd_devices[i].queue.max_size = aesd_max_bytes;
+		aesd_devices[i].minor = aesd_minor + i;
+	}
+
+	for (i = 0; i < aesd_nr_devs; i++) {
+		result = aesd_setup_cdev(&aesd_devices[i], i);
+		if (result) {
+			// only tear down the cdevs that were added
+			while (--i >= 0) {
+				cdev_del(&aesd_devices[i].cdev);
+			}
+			kfree(aesd_devices);
+			aesd_devices = NULL;
+			unregister_chrdev_region(dev, aesd_nr_devs);
+			return result;
+		}
+	}
+
+	proc_create_single("aesdchar", 0, NULL, aesd_proc_show);
 
-	result = aesd_setup_cdev(&aesd_device);
+	// debugfs is optional, failures here only lose the stats files
+	aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+	for (i = 0; i < aesd_nr_devs; i++) {
+		char name[16];
 
-	if( result ) {
-		unregister_chrdev_region(dev, 1);
+		snprintf(name, sizeof(name), "aesdchar%d", i);
+		aesd_devices[i].debugfs_dir = debugfs_create_dir(name, aesd_debugfs_root);
+		debugfs_create_file("stats", 0444, aesd_devices[i].debugfs_dir, &aesd_devices[i], &aesd_stats_fops);
 	}
 
-	return result;
+	return 0;
 
 }
 
+
 void aesd_cleanup_module(void)
 {
 	dev_t devno = MKDEV(aesd_major, aesd_minor);
-
-	cdev_del(&aesd_device.cdev);
+	int i;
 
 	/**
 	 * TODO: cleanup AESD specific poritions here as necessary
 	 */
 
-	unregister_chrdev_region(devno, 1);
+	debugfs_remove_recursive(aesd_debugfs_root);
+	remove_proc_entry("aesdchar", NULL);
+
+	if (aesd_devices) {
+		for (i = 0; i < aesd_nr_devs; i++) {
+			cdev_del(&aesd_devices[i].cdev);
+			aesd_circular_buffer_free(&aesd_devices[i].queue);
+			kfree(aesd_devices[i].entry.buffptr);
+		}
+		kfree(aesd_devices);
+		aesd_devices = NULL;
+	}
 
-	aesd_circular_buffer_free(&aesd_device.queue);
+	unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE // memrchr, memmem
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "aesd-grep.h"
+
+#define GREP_VECTOR 16 // candidate positions compared per step
+
+struct grep_job {
+    const char* start;
+    size_t len;
+    const char* pattern;
+    size_t pattern_len;
+    char* result; // matching lines, malloc'd
+    ssize_t result_len; // -1 on error
+    pthread_t thread_id;
+};
+
+/**
+ * Finds the first occurrence of @param needle in @param haystack.
+ * Positions whose first and last byte both match the needle are found 16 at a
+ * time, only those are compared in full.
+ * @return pointer to the match, or NULL
+ */
+const char* grep_find(const char* haystack, size_t len, const char* needle, size_t needle_len) {
+    size_t pos = 0;
+
+    if (needle_len == 0) {
+        return haystack;
+    }
+    if (needle_len > len) {
+        return NULL;
+    }
+
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    __m128i block_first;
+    __m128i block_last;
+    unsigned int mask;
+    int bit;
+
+    for (; pos + GREP_VECTOR + needle_len - 1 <= len; pos += GREP_VECTOR) {
+        block_first = _mm_loadu_si128((const __m128i*) (haystack + pos));
+        block_last = _mm_loadu_si128((const __m128i*) (haystack + pos + needle_len - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                               _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            bit = __builtin_ctz(mask);
+            // first and last byte already match
+            if (needle_len <= 2 || memcmp(haystack + pos + bit + 1, needle + 1, needle_len - 2) == 0) {
+                return haystack + pos + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t first = vdupq_n_u8(needle[0]);
+    const uint8x16_t last = vdupq_n_u8(needle[needle_len - 1]);
+    uint8x16_t block_first;
+    uint8x16_t block_last;
+    uint8x16_t eq;
+    int i;
+
+    for (; pos + GREP_VECTOR + needle_len - 1 <= len; pos += GREP_VECTOR) {
+        block_first = vld1q_u8((const uint8_t*) haystack + pos);
+        block_last = vld1q_u8((const uint8_t*) haystack + pos + needle_len - 1);
+        eq = vandq_u8(vceqq_u8(block_first, first), vceqq_u8(block_last, last));
+        if (vmaxvq_u8(eq) == 0) {
+            continue;
+        }
+        // rare enough that a plain scan of the 16 candidates is fine
+        for (i = 0; i < GREP_VECTOR; i++) {
+            if (haystack[pos + i] == needle[0] && memcmp(haystack + pos + i, needle, needle_len) == 0) {
+                return haystack + pos + i;
+            }
+        }
+    }
+#endif
+
+    // tail shorter than one vector, or no SIMD at all
+    return memmem(haystack + pos, len - pos, needle, needle_len);
+}
+
+// appends every line of [start, start + len) containing the pattern to job->result
+static void* grep_job_run(void* arg) {
+    struct grep_job* job = arg;
+    const char* end = job->start + job->len;
+    const char* pos = job->start;
+    const char* match;
+    const char* line_start;
+    const char* line_end;
+    size_t result_size = 0;
+    size_t line_len;
+    char* new_result;
+
+    job->result = NULL;
+    job->result_len = 0;
+
+    while (pos < end && (match = grep_find(pos, end - pos, job->pattern, job->pattern_len)) != NULL) {
+        line_start = memrchr(job->start, '\n', match - job->start);
+        line_start = (line_start == NULL) ? job->start : line_start + 1;
+        line_end = memchr(match, '\n', end - match);
+        line_end = (line_end == NULL) ? end : line_end + 1;
+        line_len = line_end - line_start;
+
+        if (job->result_len + line_len > result_size) {
+            result_size = (result_size == 0) ? 4096 : result_size * 2;
+            while (job->result_len + line_len > result_size) {
+                result_size *= 2;
+            }
+            new_result = realloc(job->result, result_size);
+            if (new_result == NULL) {
+                perror("realloc");
+                free(job->result);
+                job->result = NULL;
+                job->result_len = -1;
+                return NULL;
+            }
+            job->result = new_result;
+        }
+        memcpy(job->result + job->result_len, line_start, line_len);
+        job->result_len += line_len;
+
+        // one copy per line however often it matches
+        pos = line_end;
+    }
+    return NULL;
+}
+
+/**
+ * Collects the lines of @param history (@param len bytes) that contain the
+ * @param pattern_len bytes of @param pattern, in history order.
+ * @return size of the malloc'd @param result (NULL when 0), or -1 on error
+ */
+ssize_t grep_lines(const char* history, size_t len, const char* pattern, size_t pattern_len, char** result) {
+    struct grep_job jobs[GREP_MAX_THREADS];
+    size_t chunk_len;
+    ssize_t total = 0;
+    char* out = NULL;
+    size_t out_pos = 0;
+    bool failed = false;
+    const char* pos = history;
+    const char* end = history + len;
+    const char* split;
+    long num_cpus;
+    int num_jobs = 1;
+    int i;
+
+    if (len >= GREP_PARALLEL_MIN) {
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_jobs = (num_cpus > GREP_MAX_THREADS) ? GREP_MAX_THREADS : (num_cpus < 1 ? 1 : num_cpus);
+    }
+
+    // cut into roughly equal chunks, each ending on a newline
+    chunk_len = len / num_jobs;
+    for (i = 0; i < num_jobs; i++) {
+        split = end;
+        if (i < num_jobs - 1 && pos + chunk_len < end) {
+            split = memchr(pos + chunk_len, '\n', end - (pos + chunk_len));
+            split = (split == NULL) ? end : split + 1;
+        }
+        jobs[i].start = pos;
+        jobs[i].len = split - pos;
+        jobs[i].pattern = pattern;
+        jobs[i].pattern_len = pattern_len;
+        pos = split;
+    }
+
+    // the caller scans the first chunk itself
+    for (i = 1; i < num_jobs; i++) {
+        if (pthread_create(&jobs[i].thread_id, NULL, grep_job_run, &jobs[i]) != 0) {
+            grep_job_run(&jobs[i]);
+            jobs[i].thread_id = 0;
+        }
+    }
+    grep_job_run(&jobs[0]);
+    for (i = 1; i < num_jobs; i++) {
+        if (jobs[i].thread_id != 0) {
+            pthread_join(jobs[i].thread_id, NULL);
+        }
+    }
+
+    *result = NULL;
+    for (i = 0; i < num_jobs; i++) {
+        if (jobs[i].result_len == -1) {
+            failed = true;
+        }
+        total += jobs[i].result_len;
+    }
+
+    // one chunk needs no copy
+    if (num_jobs == 1) {
+        *result = jobs[0].result;
+        return jobs[0].result_len;
+    }
+
+    if (!failed && total > 0) {
+        out = malloc(total);
+        if (out == NULL) {
+            perror("malloc");
+            failed = true;
+        }
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        if (!failed && jobs[i].result_len > 0) {
+            memcpy(out + out_pos, jobs[i].result, jobs[i].result_len);
+            out_pos += jobs[i].result_len;
+        }
+        free(jobs[i].result);
+    }
+
+    if (failed) {
+        return -1;
+    }
+    *result = out;
+    return total;
+}
@@ -0,0 +1,25 @@
+/*
+ * aesd-grep.h
+ *
+ * Line search over a copy of the stored history, used by aesdsocket's
+ * "GREP <pattern>\n" command.  The substring scan compares 16 candidate
+ * positions at a time with SSE2 or NEON where available, and histories
+ * above GREP_PARALLEL_MIN are split at line boundaries across threads.
+ * finder-app's finder shares grep_find(), which is why this lives here.
+ */
+
+#ifndef AESD_GREP_H
+#define AESD_GREP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define GREP_COMMAND "GREP "
+#define GREP_PARALLEL_MIN (1024 * 1024) // smaller histories are scanned by the caller alone
+#define GREP_MAX_THREADS 8
+
+const char* grep_find(const char* haystack, size_t len, const char* needle, size_t needle_len);
+
+ssize_t grep_lines(const char* history, size_t len, const char* pattern, size_t pattern_len, char** result);
+
+#endif /* AESD_GREP_H */
@@ -1,10 +1,66 @@
+#define _GNU_SOURCE // pidfd_open through syscall()
 #include "systemcalls.h"
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 
+extern char** environ;
+
+/**
+ * Starts @param command with posix_spawn, which glibc implements with
+ * clone(CLONE_VM | CLONE_VFORK): nothing of a large parent is copied.
+ * @param stdout_fd and @param stderr_fd become the child's stdout and stderr
+ * unless they are -1.
+ * @return the child's pid, or -1 if it could not be started
+ */
+static pid_t spawn_command(char* const command[], int stdout_fd, int stderr_fd)
+{
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int status;
+
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        perror("posix_spawn_file_actions_init");
+        return -1;
+    }
+
+    if (stdout_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, stdout_fd);
+    }
+    if (stderr_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, stderr_fd, STDERR_FILENO);
+        posix_spawn_file_actions_addclose(&actions, stderr_fd);
+    }
+
+    // exec failures come back here as the return value
+    status = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (status != 0) {
+        errno = status;
+        perror("posix_spawn failure");
+        return -1;
+    }
+    return pid;
+}
+
+// same outcome rule as do_exec: only a non-zero exit code is a failure
+static bool exit_success(int status)
+{
+    return !(WIFEXITED(status) && WEXITSTATUS(status) != 0);
+}
+
 
 /**
  * @param cmd the command to execute with system()
@@ -71,30 +127,19 @@ bool do_exec(int count, ...)
 */
 
     int status;
-    pid_t pid = fork();
+    va_end(args);
+
+    pid_t pid = spawn_command(command, -1, -1);
 
     if (pid == -1) {
-        perror("fork failure");
         return false;
     }
-    else if (pid == 0) {
-        execv(command[0], command);
 
-        perror("exec failure");
-        exit(-1);
-    }
-    else {
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid failure");
-            return false;
-        }
-        else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-            return false;
-        }
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid failure");
+        return false;
     }
-
-    va_end(args);
-    return true;
+    return exit_success(status);
 
 }
 
@@ -124,46 +169,379 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
 */
 
     int status;
+    va_end(args);
 
-    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
 
     if (fd == -1) {
         perror("open failure");
         abort();
     }
 
-    pid_t pid = fork();
+    pid_t pid = spawn_command(command, fd, -1);
+    close(fd);
 
     if (pid == -1) {
-        perror("fork failure");
         return false;
     }
-    else if (pid == 0) {
 
-        if (dup2(fd, STDOUT_FILENO) < 0) {
-            perror("dup2 error");
-            return false;
-        }
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid failure");
+        return false;
+    }
+    return exit_success(status);
+}
 
-        close(fd);
+/**
+ * Stores @param len bytes read from the child's @param stream in
+ * @param capture, or hands them to its callback.  Past max_len the bytes
+ * are dropped and truncated is set.
+ * @return false if the buffer could not grow
+ */
+static bool capture_store(struct exec_capture* capture, int stream, const char* buf, size_t len)
+{
+    struct exec_output* output = (stream == STDERR_FILENO) ? &capture->err : &capture->out;
+    size_t new_size;
+    char* new_data;
 
-        execv(command[0], command);
+    if (capture->max_len != 0 && output->len + len > capture->max_len) {
+        len = capture->max_len - output->len;
+        capture->truncated = true;
+    }
+    if (len == 0) {
+        return true;
+    }
 
-        perror("exec failure");
-        exit(-1);
+    if (capture->callback != NULL) {
+        capture->callback(capture->ctx, stream, buf, len);
+        output->len += len;
+        return true;
     }
-    else {
-        close(fd);
 
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid failure");
-            return false;
+    // + 1 keeps room for the terminating null
+    if (output->len + len + 1 > output->size) {
+        new_size = (output->size == 0) ? CAPTURE_READ_SIZE : output->size;
+        while (output->len + len + 1 > new_size) {
+            new_size *= 2;
         }
-        else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        new_data = realloc(output->data, new_size);
+        if (new_data == NULL) {
+            perror("realloc");
             return false;
         }
+        output->data = new_data;
+        output->size = new_size;
     }
+    if (buf != output->data + output->len) {
+        memcpy(output->data + output->len, buf, len);
+    }
+    output->len += len;
+    output->data[output->len] = '\0';
+    return true;
+}
+
+/**
+ * Reads the next chunk of @param fd, straight into the spare room of the
+ * capture buffer when there is one so that each byte is copied only once.
+ * @return bytes read, 0 at EOF, -1 on error
+ */
+static ssize_t capture_read(struct exec_capture* capture, int stream, int fd, char* scratch)
+{
+    struct exec_output* output = (stream == STDERR_FILENO) ? &capture->err : &capture->out;
+    ssize_t num_bytes;
+    char* dest = scratch;
+
+    if (capture->callback == NULL && output->size - output->len > CAPTURE_READ_SIZE) {
+        dest = output->data + output->len;
+    }
+
+    do {
+        num_bytes = read(fd, dest, CAPTURE_READ_SIZE);
+    } while (num_bytes == -1 && errno == EINTR);
+
+    if (num_bytes > 0 && !capture_store(capture, stream, dest, num_bytes)) {
+        return -1;
+    }
+    return num_bytes;
+}
 
+/**
+ * Like do_exec, but the command's stdout and stderr come back through pipes
+ * into @param capture instead of going to a file.  With capture->callback
+ * set every chunk is passed on as it arrives, otherwise capture->out.data
+ * and capture->err.data grow as needed and are null terminated.  Output past
+ * capture->max_len bytes per stream (0 for no limit) is read and dropped so
+ * that the command is never blocked or killed by a full pipe.
+ * The caller frees out.data and err.data with free(), also on failure.
+ * @return true if the command ran and exited with 0
+*/
+bool do_exec_capture(struct exec_capture* capture, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
     va_end(args);
-    return true;
+
+    int out_pipe[2];
+    int err_pipe[2];
+    struct pollfd pfds[2];
+    char* scratch;
+    bool success = true;
+    ssize_t num_bytes;
+    int status;
+    int open_fds;
+
+    capture->out.len = 0;
+    capture->err.len = 0;
+    capture->truncated = false;
+
+    scratch = malloc(CAPTURE_READ_SIZE);
+    if (scratch == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        free(scratch);
+        return false;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        free(scratch);
+        return false;
+    }
+
+    // fewer wakeups for chatty commands, the default pipe holds only 64 KiB
+    fcntl(out_pipe[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+
+    pid_t pid = spawn_command(command, out_pipe[1], err_pipe[1]);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    if (pid == -1) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        free(scratch);
+        return false;
+    }
+
+    pfds[0].fd = out_pipe[0];
+    pfds[0].events = POLLIN;
+    pfds[1].fd = err_pipe[0];
+    pfds[1].events = POLLIN;
+    open_fds = 2;
+
+    // read until the child and anything it started have closed both pipes
+    while (open_fds > 0) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            success = false;
+            break;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (pfds[i].fd == -1 || pfds[i].revents == 0) {
+                continue;
+            }
+            num_bytes = capture_read(capture, (i == 0) ? STDOUT_FILENO : STDERR_FILENO, pfds[i].fd, scratch);
+            if (num_bytes > 0) {
+                continue;
+            }
+            if (num_bytes == -1) {
+                success = false;
+            }
+            close(pfds[i].fd);
+            pfds[i].fd = -1;
+            open_fds--;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (pfds[i].fd != -1) {
+            close(pfds[i].fd);
+        }
+    }
+    free(scratch);
+
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid failure");
+        return false;
+    }
+    return success && exit_success(status);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int pidfd_open_compat(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// records the outcome of a finished child
+static void finish_command(struct exec_command* cmd, int status)
+{
+    cmd->status = status;
+    cmd->duration_ns = now_ns() - cmd->start_ns;
+    cmd->success = exit_success(status);
+    cmd->pid = -1;
+}
+
+/**
+ * Runs @param count commands with at most @param max_parallel (0 for no limit)
+ * of them running at once, in the order given.  Each command's argv,
+ * outputfile and the results are in its struct exec_command.
+ * Finished children are noticed through one pidfd each, polled together; on
+ * kernels without pidfd_open the calling thread waits for SIGCHLD instead.
+ * @return true if every command was started and exited with 0
+*/
+bool do_exec_batch(struct exec_command* commands, size_t count, unsigned int max_parallel)
+{
+    struct pollfd* pfds;
+    size_t* running; // index into commands of each pfds entry
+    size_t num_running = 0;
+    size_t next = 0;
+    size_t i;
+    bool use_pidfd = true;
+    bool all_success = true;
+    sigset_t chld_set;
+    sigset_t prev_set;
+    struct timespec timeout = { 0, 10000000L };
+    int status;
+    int fd;
+
+    if (max_parallel == 0 || max_parallel > count) {
+        max_parallel = count;
+    }
+    if (count == 0) {
+        return true;
+    }
+
+    pfds = calloc(max_parallel, sizeof(struct pollfd));
+    running = calloc(max_parallel, sizeof(size_t));
+    if (pfds == NULL || running == NULL) {
+        perror("calloc");
+        free(pfds);
+        free(running);
+        return false;
+    }
+
+    // only needed by the fallback, harmless otherwise
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld_set, &prev_set);
+
+    while (next < count || num_running > 0) {
+
+        // top up to max_parallel running children
+        while (next < count && num_running < max_parallel) {
+            struct exec_command* cmd = &commands[next++];
+
+            cmd->success = false;
+            cmd->status = -1;
+            cmd->duration_ns = 0;
+            cmd->start_ns = now_ns();
+
+            fd = -1;
+            if (cmd->outputfile != NULL) {
+                fd = open(cmd->outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
+                if (fd == -1) {
+                    perror("open failure");
+                    cmd->pid = -1;
+                    all_success = false;
+                    continue;
+                }
+            }
+
+            cmd->pid = spawn_command(cmd->argv, fd, -1);
+            if (fd != -1) {
+                close(fd);
+            }
+            if (cmd->pid == -1) {
+                all_success = false;
+                continue;
+            }
+
+            pfds[num_running].fd = -1;
+            if (use_pidfd) {
+                pfds[num_running].fd = pidfd_open_compat(cmd->pid);
+                if (pfds[num_running].fd == -1) {
+                    use_pidfd = false;
+                }
+            }
+            pfds[num_running].events = POLLIN;
+            running[num_running] = cmd - commands;
+            num_running++;
+        }
+
+        if (num_running == 0) {
+            continue;
+        }
+
+        // sleep until at least one child exits
+        if (use_pidfd) {
+            if (poll(pfds, num_running, -1) == -1 && errno != EINTR) {
+                perror("poll");
+            }
+        }
+        else {
+            sigtimedwait(&chld_set, NULL, &timeout);
+        }
+
+        // reap whoever finished, keeping the running entries packed
+        for (i = 0; i < num_running; ) {
+            struct exec_command* cmd = &commands[running[i]];
+            pid_t pid = waitpid(cmd->pid, &status, WNOHANG);
+
+            if (pid == 0 || (pid == -1 && errno == EINTR)) {
+                i++;
+                continue;
+            }
+
+            // e.g. ECHILD when someone else reaped it, it will never be ours to wait for
+            if (pid == -1) {
+                perror("waitpid failure");
+                status = -1;
+            }
+            finish_command(cmd, status);
+            if (pid == -1) {
+                cmd->success = false;
+            }
+            if (!cmd->success) {
+                all_success = false;
+            }
+
+            if (pfds[i].fd != -1) {
+                close(pfds[i].fd);
+            }
+            num_running--;
+            pfds[i] = pfds[num_running];
+            running[i] = running[num_running];
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &prev_set, NULL);
+    free(pfds);
+    free(running);
+    return all_success;
 }
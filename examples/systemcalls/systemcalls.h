@@ -1,9 +1,55 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+#define CAPTURE_READ_SIZE (64 * 1024) // bytes asked for per read of a capture pipe
+#define CAPTURE_PIPE_SIZE (1024 * 1024) // requested stdout pipe size, capped by /proc/sys/fs/pipe-max-size
+
+/* Called with each chunk of output, stream is STDOUT_FILENO or STDERR_FILENO */
+typedef void (*exec_output_fn)(void* ctx, int stream, const char* buf, size_t len);
+
+struct exec_output {
+    char* data; // malloc'd and null terminated, NULL until something arrived
+    size_t len; // bytes captured (or passed to the callback)
+    size_t size;
+};
+
+/**
+ * Output of do_exec_capture.  Zero it, then optionally set max_len and
+ * callback/ctx.  The buffers may be reused for another call.
+ */
+struct exec_capture {
+    struct exec_output out;
+    struct exec_output err;
+    size_t max_len; // per stream, 0 for no limit
+    bool truncated; // some output was dropped because of max_len
+    exec_output_fn callback; // if set, output is streamed here instead of buffered
+    void* ctx;
+};
+
+bool do_exec_capture(struct exec_capture* capture, int count, ...);
+
+/**
+ * One command for do_exec_batch.  argv and outputfile are set by the
+ * caller, the remaining fields are filled in by do_exec_batch.
+ */
+struct exec_command {
+    char* const* argv; // full path to the command first, NULL terminated
+    const char* outputfile; // stdout is redirected here (truncated) unless NULL
+
+    bool success; // started and did not exit non-zero, the same rule as do_exec
+    int status; // waitpid status, -1 if the command could not be started or waited for
+    uint64_t start_ns; // CLOCK_MONOTONIC when it was started
+    uint64_t duration_ns; // start to reap
+    pid_t pid; // while running, -1 afterwards
+};
+
+bool do_exec_batch(struct exec_command* commands, size_t count, unsigned int max_parallel);
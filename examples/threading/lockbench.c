@@ -0,0 +1,326 @@
+/*
+ * lockbench.c
+ *
+ * Lock contention benchmark.  Starts N threads that take the same lock over
+ * and over for a fixed time, each time working outside the lock for a
+ * "think" time and inside it for a "hold" time, both either fixed or
+ * exponentially distributed around the given mean.  Every lock from locks.c
+ * (or the one named with -l) is run in turn, and for each one the total
+ * throughput, the fairness between threads and percentiles of the time
+ * spent waiting in lock() are printed.
+ *
+ * Usage: lockbench [-n threads] [-s seconds] [-l lock] [-H hold_ns] [-T think_ns] [-e]
+ */
+
+#include "locks.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#define MAX_THREADS 256
+#define SUB_BUCKETS 16 // per power of two, percentiles are within 1/16 of the true value
+#define NUM_BUCKETS (64 * SUB_BUCKETS)
+
+struct bench_options {
+    unsigned int num_threads;
+    unsigned int seconds;
+    uint64_t hold_ns;
+    uint64_t think_ns;
+    bool exponential;
+};
+
+struct bench_thread {
+    struct lock_node node; // first, it is what the MCS waiters spin on
+    const struct bench_options* options;
+    uint64_t acquires;
+    uint64_t max_wait_ns;
+    uint64_t rng;
+    pthread_t thread_id;
+    uint64_t wait_hist[NUM_BUCKETS];
+} __attribute__((aligned(64)));
+
+static const struct lock_ops* current_ops;
+static union any_lock current_lock;
+static uint64_t protected_counter; // only touched with the lock held, checked at the end
+static atomic_bool stop_flag;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64, good enough for spacing out lock requests
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static uint64_t draw_ns(struct bench_thread* thread, uint64_t mean_ns)
+{
+    double u;
+
+    if (!thread->options->exponential || mean_ns == 0) {
+        return mean_ns;
+    }
+    u = (next_random(&thread->rng) >> 11) * (1.0 / 9007199254740992.0);
+    return (uint64_t) (-log(1.0 - u) * mean_ns);
+}
+
+// busy work rather than sleeping, sleeping would hide the lock's own cost
+static void spin_for(uint64_t ns)
+{
+    uint64_t end;
+
+    if (ns == 0) {
+        return;
+    }
+    end = now_ns() + ns;
+    while (now_ns() < end) {
+    }
+}
+
+static unsigned int bucket_of(uint64_t ns)
+{
+    unsigned int msb;
+
+    if (ns < SUB_BUCKETS) {
+        return ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - 3) * SUB_BUCKETS + ((ns >> (msb - 4)) & (SUB_BUCKETS - 1));
+}
+
+// smallest value that falls into bucket
+static uint64_t bucket_value(unsigned int bucket)
+{
+    unsigned int msb;
+
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    msb = bucket / SUB_BUCKETS + 3;
+    return (uint64_t) (SUB_BUCKETS | (bucket % SUB_BUCKETS)) << (msb - 4);
+}
+
+static void* bench_thread_function(void* arg)
+{
+    struct bench_thread* thread = arg;
+    const struct bench_options* options = thread->options;
+    uint64_t start;
+    uint64_t waited;
+
+    pthread_barrier_wait(&start_barrier);
+
+    while (!atomic_load_explicit(&stop_flag, memory_order_relaxed)) {
+        spin_for(draw_ns(thread, options->think_ns));
+
+        start = now_ns();
+        current_ops->lock(&current_lock, &thread->node);
+        waited = now_ns() - start;
+
+        protected_counter++;
+        spin_for(draw_ns(thread, options->hold_ns));
+
+        current_ops->unlock(&current_lock, &thread->node);
+
+        thread->acquires++;
+        thread->wait_hist[bucket_of(waited)]++;
+        if (waited > thread->max_wait_ns) {
+            thread->max_wait_ns = waited;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t percentile(const uint64_t* hist, uint64_t total, double fraction)
+{
+    uint64_t target = (uint64_t) (total * fraction);
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < NUM_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > target) {
+            return bucket_value(i);
+        }
+    }
+    return bucket_value(NUM_BUCKETS - 1);
+}
+
+/**
+ * Runs one lock with @param options and prints its line of results.
+ * @return false if the lock could not be set up or lost updates
+ */
+static bool run_bench(const struct lock_ops* ops, const struct bench_options* options)
+{
+    struct bench_thread* threads;
+    uint64_t hist[NUM_BUCKETS];
+    uint64_t total = 0;
+    uint64_t min_acquires = UINT64_MAX;
+    uint64_t max_acquires = 0;
+    uint64_t max_wait = 0;
+    double sum_squares = 0;
+    double elapsed;
+    double jain;
+    uint64_t start;
+    unsigned int i;
+    unsigned int j;
+    bool success = true;
+
+    threads = aligned_alloc(64, options->num_threads * sizeof(struct bench_thread));
+    if (threads == NULL) {
+        perror("aligned_alloc");
+        return false;
+    }
+    memset(threads, 0, options->num_threads * sizeof(struct bench_thread));
+
+    current_ops = ops;
+    if (!ops->init(&current_lock)) {
+        free(threads);
+        return false;
+    }
+    protected_counter = 0;
+    atomic_store(&stop_flag, false);
+    pthread_barrier_init(&start_barrier, NULL, options->num_threads + 1);
+
+    for (i = 0; i < options->num_threads; i++) {
+        threads[i].options = options;
+        threads[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&threads[i].thread_id, NULL, bench_thread_function, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    sleep(options->seconds);
+    atomic_store(&stop_flag, true);
+
+    for (i = 0; i < options->num_threads; i++) {
+        pthread_join(threads[i].thread_id, NULL);
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < options->num_threads; i++) {
+        total += threads[i].acquires;
+        sum_squares += (double) threads[i].acquires * threads[i].acquires;
+        if (threads[i].acquires < min_acquires)
+            min_acquires = threads[i].acquires;
+        if (threads[i].acquires > max_acquires)
+            max_acquires = threads[i].acquires;
+        if (threads[i].max_wait_ns > max_wait)
+            max_wait = threads[i].max_wait_ns;
+        for (j = 0; j < NUM_BUCKETS; j++) {
+            hist[j] += threads[i].wait_hist[j];
+        }
+    }
+
+    // Jain's index: 1.0 when every thread got the lock equally often, 1/n when one got it all
+    jain = (sum_squares > 0) ? ((double) total * total) / (options->num_threads * sum_squares) : 0;
+
+    printf("%-9s %4u %12.0f %6.3f %10llu %10llu %8llu %8llu %8llu %8llu %10llu\n",
+           ops->name, options->num_threads, total / elapsed, jain,
+           (unsigned long long) min_acquires, (unsigned long long) max_acquires,
+           (unsigned long long) percentile(hist, total, 0.50),
+           (unsigned long long) percentile(hist, total, 0.90),
+           (unsigned long long) percentile(hist, total, 0.99),
+           (unsigned long long) percentile(hist, total, 0.999),
+           (unsigned long long) max_wait);
+
+    if (protected_counter != total) {
+        printf("%s ERROR: %llu updates under the lock, expected %llu\n", ops->name,
+               (unsigned long long) protected_counter, (unsigned long long) total);
+        success = false;
+    }
+
+    pthread_barrier_destroy(&start_barrier);
+    ops->destroy(&current_lock);
+    free(threads);
+    return success;
+}
+
+int main(int argc, char** argv)
+{
+    struct bench_options options;
+    const struct lock_ops* ops = NULL;
+    long num_cpus;
+    bool success = true;
+    int opt;
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options.num_threads = (num_cpus < 2) ? 2 : num_cpus;
+    options.seconds = 1;
+    options.hold_ns = 100;
+    options.think_ns = 500;
+    options.exponential = false;
+
+    while ((opt = getopt(argc, argv, "n:s:l:H:T:e")) != -1) {
+        switch (opt) {
+        case 'n':
+            options.num_threads = atoi(optarg);
+            break;
+        case 's':
+            options.seconds = atoi(optarg);
+            break;
+        case 'l':
+            ops = find_lock(optarg);
+            if (ops == NULL) {
+                printf("lockbench ERROR: unknown lock %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'H':
+            options.hold_ns = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            options.think_ns = strtoull(optarg, NULL, 10);
+            break;
+        case 'e':
+            options.exponential = true;
+            break;
+        default:
+            printf("Usage: %s [-n threads] [-s seconds] [-l lock] [-H hold_ns] [-T think_ns] [-e]\n", argv[0]);
+            printf("  -e  exponentially distributed hold and think times instead of fixed ones\n");
+            printf("  locks:");
+            for (ops = lock_implementations; ops->name != NULL; ops++) {
+                printf(" %s", ops->name);
+            }
+            printf("\n");
+            return 1;
+        }
+    }
+
+    if (options.num_threads < 1 || options.num_threads > MAX_THREADS || options.seconds < 1) {
+        printf("lockbench ERROR: threads must be 1 to %d and seconds at least 1\n", MAX_THREADS);
+        return 1;
+    }
+
+    printf("hold %llu ns, think %llu ns, %s, %u CPUs\n",
+           (unsigned long long) options.hold_ns, (unsigned long long) options.think_ns,
+           options.exponential ? "exponential" : "fixed", (unsigned int) num_cpus);
+    printf("%-9s %4s %12s %6s %10s %10s %8s %8s %8s %8s %10s\n", "lock", "thr", "acquires/s", "jain",
+           "min/thr", "max/thr", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+
+    if (ops != NULL) {
+        success = run_bench(ops, &options);
+    }
+    else {
+        for (ops = lock_implementations; ops->name != NULL; ops++) {
+            success = run_bench(ops, &options) && success;
+        }
+    }
+    return success ? 0 : 1;
+}
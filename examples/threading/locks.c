@@ -0,0 +1,208 @@
+#define _GNU_SOURCE // PTHREAD_MUTEX_ADAPTIVE_NP
+#include "locks.h"
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * Spinning waiters give up their CPU every SPIN_YIELD iterations.  Without
+ * it a ticket or MCS waiter that is ahead of a preempted lock holder would
+ * burn its whole time slice, which on a single core stalls everyone.
+ */
+#define SPIN_YIELD 128
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void spin_wait(unsigned int* spins)
+{
+    if (++(*spins) % SPIN_YIELD == 0) {
+        sched_yield();
+    }
+    else {
+        cpu_relax();
+    }
+}
+
+static bool mutex_init(union any_lock* lock)
+{
+    if (pthread_mutex_init(&lock->mutex, NULL) != 0) {
+        perror("pthread_mutex_init");
+        return false;
+    }
+    return true;
+}
+
+static bool adaptive_init(union any_lock* lock)
+{
+    pthread_mutexattr_t attr;
+    int result;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    result = pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (result != 0) {
+        perror("pthread_mutex_init");
+        return false;
+    }
+    return true;
+}
+
+static void mutex_lock(union any_lock* lock, struct lock_node* node)
+{
+    pthread_mutex_lock(&lock->mutex);
+}
+
+static void mutex_unlock(union any_lock* lock, struct lock_node* node)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static void mutex_destroy(union any_lock* lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static bool ticket_init(union any_lock* lock)
+{
+    atomic_init(&lock->ticket.next, 0);
+    atomic_init(&lock->ticket.serving, 0);
+    return true;
+}
+
+// strictly first come first served
+static void ticket_lock(union any_lock* lock, struct lock_node* node)
+{
+    unsigned int ticket = atomic_fetch_add_explicit(&lock->ticket.next, 1, memory_order_relaxed);
+    unsigned int spins = 0;
+
+    while (atomic_load_explicit(&lock->ticket.serving, memory_order_acquire) != ticket) {
+        spin_wait(&spins);
+    }
+}
+
+static void ticket_unlock(union any_lock* lock, struct lock_node* node)
+{
+    unsigned int serving = atomic_load_explicit(&lock->ticket.serving, memory_order_relaxed);
+    atomic_store_explicit(&lock->ticket.serving, serving + 1, memory_order_release);
+}
+
+static bool mcs_init(union any_lock* lock)
+{
+    atomic_init(&lock->mcs.tail, NULL);
+    return true;
+}
+
+// FIFO like the ticket lock, but every waiter spins on its own node's cache line
+static void mcs_lock(union any_lock* lock, struct lock_node* node)
+{
+    struct lock_node* prev;
+    unsigned int spins = 0;
+
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+
+    prev = atomic_exchange_explicit(&lock->mcs.tail, node, memory_order_acq_rel);
+    if (prev == NULL) {
+        return;
+    }
+
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+    while (atomic_load_explicit(&node->locked, memory_order_acquire)) {
+        spin_wait(&spins);
+    }
+}
+
+static void mcs_unlock(union any_lock* lock, struct lock_node* node)
+{
+    struct lock_node* next = atomic_load_explicit(&node->next, memory_order_acquire);
+    struct lock_node* expected = node;
+    unsigned int spins = 0;
+
+    if (next == NULL) {
+        // nobody queued behind us
+        if (atomic_compare_exchange_strong_explicit(&lock->mcs.tail, &expected, NULL,
+                                                    memory_order_acq_rel, memory_order_relaxed)) {
+            return;
+        }
+        // a waiter swapped the tail but has not linked itself yet
+        while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL) {
+            spin_wait(&spins);
+        }
+    }
+    atomic_store_explicit(&next->locked, false, memory_order_release);
+}
+
+static bool futex_init(union any_lock* lock)
+{
+    atomic_init(&lock->futex.state, 0);
+    return true;
+}
+
+static long futex(atomic_int* addr, int op, int val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static void futex_lock(union any_lock* lock, struct lock_node* node)
+{
+    int state = 0;
+
+    // uncontended case never enters the kernel
+    if (atomic_compare_exchange_strong(&lock->futex.state, &state, 1)) {
+        return;
+    }
+
+    if (state != 2) {
+        state = atomic_exchange(&lock->futex.state, 2);
+    }
+    while (state != 0) {
+        futex(&lock->futex.state, FUTEX_WAIT_PRIVATE, 2);
+        state = atomic_exchange(&lock->futex.state, 2);
+    }
+}
+
+static void futex_unlock(union any_lock* lock, struct lock_node* node)
+{
+    // only wake someone if there may be waiters
+    if (atomic_fetch_sub(&lock->futex.state, 1) != 1) {
+        atomic_store(&lock->futex.state, 0);
+        futex(&lock->futex.state, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static void nothing_destroy(union any_lock* lock)
+{
+}
+
+const struct lock_ops lock_implementations[] = {
+    { "mutex", mutex_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "adaptive", adaptive_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "ticket", ticket_init, ticket_lock, ticket_unlock, nothing_destroy },
+    { "mcs", mcs_init, mcs_lock, mcs_unlock, nothing_destroy },
+    { "futex", futex_init, futex_lock, futex_unlock, nothing_destroy },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+const struct lock_ops* find_lock(const char* name)
+{
+    const struct lock_ops* ops;
+
+    for (ops = lock_implementations; ops->name != NULL; ops++) {
+        if (strcmp(ops->name, name) == 0) {
+            return ops;
+        }
+    }
+    return NULL;
+}
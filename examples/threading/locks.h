@@ -0,0 +1,57 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * Lock implementations compared by lockbench.  Every lock is used through
+ * struct lock_ops so that the benchmark loop is the same for all of them.
+ * Each thread passes its own struct lock_node to lock and unlock, only the
+ * MCS lock needs it, the others ignore it.
+ */
+
+struct lock_node {
+    _Atomic(struct lock_node*) next;
+    atomic_bool locked;
+} __attribute__((aligned(64)));
+
+struct ticket_lock {
+    atomic_uint next;
+    atomic_uint serving;
+};
+
+struct mcs_lock {
+    _Atomic(struct lock_node*) tail;
+};
+
+/* 0 unlocked, 1 locked, 2 locked with waiters (Drepper, "Futexes Are Tricky") */
+struct futex_lock {
+    atomic_int state;
+};
+
+union any_lock {
+    pthread_mutex_t mutex;
+    struct ticket_lock ticket;
+    struct mcs_lock mcs;
+    struct futex_lock futex;
+};
+
+struct lock_ops {
+    const char* name;
+    bool (*init)(union any_lock* lock);
+    void (*lock)(union any_lock* lock, struct lock_node* node);
+    void (*unlock)(union any_lock* lock, struct lock_node* node);
+    void (*destroy)(union any_lock* lock);
+};
+
+/**
+ * All implementations, terminated by an entry with a NULL name:
+ * "mutex" (default pthread mutex), "adaptive" (PTHREAD_MUTEX_ADAPTIVE_NP),
+ * "ticket", "mcs" and "futex".
+ */
+extern const struct lock_ops lock_implementations[];
+
+/**
+* @return the implementation called @param name, or NULL if there is none
+*/
+const struct lock_ops* find_lock(const char* name);
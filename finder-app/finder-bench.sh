@@ -0,0 +1,70 @@
+#!/bin/sh
+# Compares finder.sh with the native finder on a generated tree
+# Author: Bjorn Nelson
+#
+# Usage: finder-bench.sh [num_dirs] [files_per_dir] [lines_per_file]
+
+set -e
+set -u
+
+NUMDIRS=${1:-100}
+NUMFILES=${2:-100}
+NUMLINES=${3:-50}
+SEARCHSTR=AELD_IS_FUN
+BENCHDIR=/tmp/aeld-finder-bench
+SCRIPTDIR=$(dirname "$0")
+
+# milliseconds since boot, busybox date has no %N
+now_ms() {
+	awk '{ printf "%d\n", $1 * 1000 }' /proc/uptime
+}
+
+if [ ! -x "${SCRIPTDIR}/finder" ]
+then
+	echo "ERROR: build ${SCRIPTDIR}/finder first"
+	exit 1
+fi
+
+echo "Creating ${NUMDIRS} directories of ${NUMFILES} files with ${NUMLINES} lines in ${BENCHDIR}"
+rm -rf "${BENCHDIR}"
+mkdir -p "${BENCHDIR}"
+
+# one line in ten matches
+awk -v lines="${NUMLINES}" -v str="${SEARCHSTR}" 'BEGIN {
+	for (i = 0; i < lines; i++)
+		if (i % 10 == 0) print "line " i " " str; else print "line " i " nothing to see here"
+}' > "${BENCHDIR}/template"
+
+for d in $(seq 1 "${NUMDIRS}")
+do
+	mkdir -p "${BENCHDIR}/dir$d/sub"
+	for f in $(seq 1 "${NUMFILES}")
+	do
+		cp "${BENCHDIR}/template" "${BENCHDIR}/dir$d/sub/file$f.txt"
+	done
+done
+rm "${BENCHDIR}/template"
+
+# page cache warm for both runs
+"${SCRIPTDIR}/finder" "${BENCHDIR}" "${SEARCHSTR}" > /dev/null
+
+start=$(now_ms)
+script_output=$(sh "${SCRIPTDIR}/finder.sh" "${BENCHDIR}" "${SEARCHSTR}")
+script_ms=$(( $(now_ms) - start ))
+
+start=$(now_ms)
+native_output=$("${SCRIPTDIR}/finder" "${BENCHDIR}" "${SEARCHSTR}")
+native_ms=$(( $(now_ms) - start ))
+
+echo "finder.sh: ${script_ms} ms"
+echo "finder:    ${native_ms} ms"
+echo "${native_output}"
+
+rm -rf "${BENCHDIR}"
+
+if [ "${script_output}" != "${native_output}" ]
+then
+	echo "failed: finder.sh printed ${script_output}"
+	exit 1
+fi
+echo "success"
@@ -0,0 +1,339 @@
+// Author: Bjorn Nelson
+//
+// Native version of finder.sh: counts the regular files under a directory and
+// the lines in them containing a search string, in one pass over the tree.
+// Directories are walked by a pool of threads (FINDER_THREADS, default one
+// per CPU), each with its own queue of directories that idle threads steal
+// from. Large files are mapped, small ones read, and both are scanned with
+// the SIMD search from common/aesd-grep.c. As with grep, a search string
+// with regex characters is matched as a basic regular expression. A binary
+// file (one with a NUL byte) that matches is reported on stderr and adds no
+// lines, as GNU grep does, so the count matches finder.sh on the host.
+
+#define _GNU_SOURCE // strndup, O_CLOEXEC
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "aesd-grep.h"
+
+#define MAX_THREADS 64
+#define MMAP_MIN (256 * 1024) // smaller files are read into the worker's buffer, mapping them costs more
+#define BRE_SPECIAL ".[]*^$\\" // characters that make grep's pattern more than a string
+
+// one cache line each at least, the counters are bumped per file
+struct worker {
+    _Alignas(64) pthread_mutex_t lock;
+    char** dirs; // dirs[head..count) still to walk
+    size_t head;
+    size_t count;
+    size_t size;
+    uint64_t num_files;
+    uint64_t num_matches;
+    char* read_buf; // MMAP_MIN bytes
+    unsigned int id;
+    pthread_t thread_id;
+};
+
+static struct worker workers[MAX_THREADS];
+static unsigned int num_workers;
+static atomic_size_t pending; // directories queued or being walked
+
+static const char* searchstr;
+static size_t searchstr_len;
+static bool use_regex;
+static regex_t regex;
+
+static void push_dir(struct worker* worker, char* path) {
+    atomic_fetch_add(&pending, 1);
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count == worker->size) {
+        worker->size = (worker->size == 0) ? 64 : worker->size * 2;
+        worker->dirs = realloc(worker->dirs, worker->size * sizeof(char*));
+        if (worker->dirs == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    worker->dirs[worker->count++] = path;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// own work is taken newest first for locality, stolen work oldest first since it is the biggest
+static char* take_dir(struct worker* worker, bool steal) {
+    char* path = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > worker->head) {
+        path = steal ? worker->dirs[worker->head++] : worker->dirs[--worker->count];
+        if (worker->head == worker->count) {
+            worker->head = 0;
+            worker->count = 0;
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return path;
+}
+
+// counts the lines of [buf, buf + len) that contain the search string, as grep would, up to max
+static uint64_t count_matches(const char* buf, size_t len, uint64_t max) {
+    const char* end = buf + len;
+    const char* pos = buf;
+    const char* match;
+    const char* line_end;
+    uint64_t matches = 0;
+    char* line;
+    size_t line_len;
+
+    while (pos < end && matches < max) {
+        if (use_regex) {
+            line_end = memchr(pos, '\n', end - pos);
+            line_len = (line_end == NULL) ? (size_t) (end - pos) : (size_t) (line_end - pos);
+            line = strndup(pos, line_len);
+            if (line == NULL) {
+                perror("strndup");
+                exit(EXIT_FAILURE);
+            }
+            if (regexec(&regex, line, 0, NULL, 0) == 0) {
+                matches++;
+            }
+            free(line);
+            pos += line_len + 1;
+            continue;
+        }
+
+        match = grep_find(pos, end - pos, searchstr, searchstr_len);
+        if (match == NULL) {
+            break;
+        }
+        matches++;
+
+        // one count per line however often it matches
+        line_end = memchr(match, '\n', end - match);
+        pos = (line_end == NULL) ? end : line_end + 1;
+    }
+    return matches;
+}
+
+// grep prints one note on stderr for a matching binary file instead of its lines
+static uint64_t scan_buf(const char* dir_path, const char* name, const char* buf, size_t len) {
+    if (memchr(buf, '\0', len) == NULL) {
+        return count_matches(buf, len, UINT64_MAX);
+    }
+    if (count_matches(buf, len, 1) > 0) {
+        fprintf(stderr, "finder: %s/%s: binary file matches\n", dir_path, name);
+    }
+    return 0;
+}
+
+static void scan_file(struct worker* worker, const char* dir_path, int dir_fd, const char* name) {
+    struct stat st;
+    char* buf;
+    ssize_t num_bytes;
+    size_t len = 0;
+    int fd;
+
+    worker->num_files++;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1) {
+        return; // counted as a file like find does, without matches like grep
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    if (st.st_size < MMAP_MIN) {
+        while (len < MMAP_MIN && (num_bytes = read(fd, worker->read_buf + len, MMAP_MIN - len)) != 0) {
+            if (num_bytes == -1) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            len += num_bytes;
+        }
+        close(fd);
+        worker->num_matches += scan_buf(dir_path, name, worker->read_buf, len);
+        return;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        return;
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+    worker->num_matches += scan_buf(dir_path, name, buf, st.st_size);
+
+    munmap(buf, st.st_size);
+}
+
+static void walk_dir(struct worker* worker, char* path) {
+    struct dirent* entry;
+    struct stat st;
+    unsigned char type;
+    size_t path_len = strlen(path);
+    char* child;
+    DIR* dir;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        // like find and grep -r, symbolic links are not followed
+        type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+        }
+
+        if (type == DT_REG) {
+            scan_file(worker, path, dirfd(dir), entry->d_name);
+        }
+        else if (type == DT_DIR) {
+            child = malloc(path_len + strlen(entry->d_name) + 2);
+            if (child == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            sprintf(child, "%s/%s", path, entry->d_name);
+            push_dir(worker, child);
+        }
+    }
+    closedir(dir);
+}
+
+static void* worker_function(void* arg) {
+    struct worker* worker = arg;
+    unsigned int victim;
+    unsigned int i;
+    char* path;
+
+    for (;;) {
+        path = take_dir(worker, false);
+
+        // out of work, steal from the others starting with the next worker
+        for (i = 1; path == NULL && i < num_workers; i++) {
+            victim = (worker->id + i) % num_workers;
+            path = take_dir(&workers[victim], true);
+        }
+
+        if (path == NULL) {
+            if (atomic_load(&pending) == 0) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        walk_dir(worker, path);
+        free(path);
+        atomic_fetch_sub(&pending, 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    struct stat st;
+    uint64_t num_files = 0;
+    uint64_t num_matches = 0;
+    const char* threads_env;
+    long num_cpus;
+    char* root;
+    unsigned int i;
+
+    // check command line arguments
+    if (argc != 3) {
+        printf("ERROR: invalid number of arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // verify that the path is valid
+    if (stat(argv[1], &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("ERROR: invalid search path\n");
+        exit(EXIT_FAILURE);
+    }
+
+    searchstr = argv[2];
+    searchstr_len = strlen(searchstr);
+    if (strpbrk(searchstr, BRE_SPECIAL) != NULL) {
+        if (regcomp(&regex, searchstr, REG_NOSUB) != 0) {
+            printf("ERROR: invalid search string\n");
+            exit(EXIT_FAILURE);
+        }
+        use_regex = true;
+    }
+
+    threads_env = getenv("FINDER_THREADS");
+    num_cpus = (threads_env != NULL) ? atol(threads_env) : sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = (num_cpus < 1) ? 1 : (num_cpus > MAX_THREADS ? MAX_THREADS : num_cpus);
+
+    for (i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].id = i;
+        workers[i].read_buf = malloc(MMAP_MIN);
+        if (workers[i].read_buf == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    root = strdup(argv[1]);
+    if (root == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    push_dir(&workers[0], root);
+
+    // the main thread is worker 0
+    for (i = 1; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread_id, NULL, worker_function, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    worker_function(&workers[0]);
+
+    for (i = 0; i < num_workers; i++) {
+        if (i > 0) {
+            pthread_join(workers[i].thread_id, NULL);
+        }
+        num_files += workers[i].num_files;
+        num_matches += workers[i].num_matches;
+        free(workers[i].dirs);
+        free(workers[i].read_buf);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+
+    if (use_regex) {
+        regfree(&regex);
+    }
+
+    // print the results
+    printf("The number of files are %llu and the number of matching lines are %llu\n",
+           (unsigned long long) num_files, (unsigned long long) num_matches);
+    return 0;
+}
@@ -1,40 +1,262 @@
 // Author: Bjorn Nelson
 
+#define _GNU_SOURCE // fallocate, sync_file_range
 #include <stdlib.h>
 #include <stdio.h>
 #include <syslog.h>
 #include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <libgen.h>
 #include <unistd.h>
 
 #define EXIT_FAILURE 1
+#define MANIFEST_BUF_SIZE (1024 * 1024) // stdio buffer for the record stream
+#define MAX_SYNC_BATCH 1024
+
+/* Batch mode options, see usage() */
+struct batch_options {
+    bool fallocate_flag;
+    int sync_batch; // fdatasync every this many files, 0 never
+};
+
+static void usage(const char* name) {
+    syslog(LOG_ERR, "Usage: %s <file> <string>\n", name);
+    syslog(LOG_ERR, "       %s -b [-f] [-s batch] [manifest]\n", name);
+    syslog(LOG_ERR, "  -b  write every \"<file>\\t<string>\" line of manifest (default stdin),\n");
+    syslog(LOG_ERR, "      \\n, \\t and \\\\ in the string are unescaped\n");
+    syslog(LOG_ERR, "  -f  fallocate each file to its size before writing\n");
+    syslog(LOG_ERR, "  -s  fdatasync the files every batch files and at the end\n");
+}
+
+// decodes \n, \t and \\ in place, returns the new length
+static size_t unescape(char* str, size_t len) {
+    size_t in;
+    size_t out = 0;
+
+    for (in = 0; in < len; in++) {
+        if (str[in] == '\\' && in + 1 < len) {
+            switch (str[in + 1]) {
+            case 'n':
+                str[out++] = '\n';
+                in++;
+                continue;
+            case 't':
+                str[out++] = '\t';
+                in++;
+                continue;
+            case '\\':
+                str[out++] = '\\';
+                in++;
+                continue;
+            }
+        }
+        str[out++] = str[in];
+    }
+    return out;
+}
+
+// write all of buf, retrying short writes
+static int write_all(int fd, const char* buf, size_t len) {
+    ssize_t num_bytes;
+
+    while (len > 0) {
+        num_bytes = write(fd, buf, len);
+        if (num_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += num_bytes;
+        len -= num_bytes;
+    }
+    return 0;
+}
+
+// fdatasync and close the files written since the last batch, returns the number that failed
+static int sync_batch(int* fds, int* num_fds) {
+    int errors = 0;
+    int i;
+
+    for (i = 0; i < *num_fds; i++) {
+        if (fdatasync(fds[i]) != 0) {
+            syslog(LOG_ERR, "ERROR: file could not be synced: %s\n", strerror(errno));
+            errors++;
+        }
+        close(fds[i]);
+    }
+    *num_fds = 0;
+    return errors;
+}
+
+/* Writes every record of the manifest from one process. Files are written
+   with a single write each; with -s, writeback is started right after the
+   write and the fdatasync for a whole batch is deferred, so the disk sees
+   the batch at once. */
+static int write_batch(FILE* manifest, const struct batch_options* options) {
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    char* tab;
+    char* content;
+    size_t content_len;
+    int fds[MAX_SYNC_BATCH];
+    int num_fds = 0;
+    long num_files = 0;
+    long num_bytes = 0;
+    int errors = 0;
+    int fd;
+
+    while ((line_len = getline(&line, &line_size, manifest)) != -1) {
+        if (line_len > 0 && line[line_len - 1] == '\n') {
+            line[--line_len] = '\0';
+        }
+        if (line_len == 0) {
+            continue;
+        }
+
+        tab = memchr(line, '\t', line_len);
+        if (tab == NULL) {
+            syslog(LOG_ERR, "ERROR: record without a tab: %s\n", line);
+            errors++;
+            continue;
+        }
+        *tab = '\0';
+        content = tab + 1;
+        content_len = unescape(content, line + line_len - content);
+
+        fd = open(line, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            syslog(LOG_ERR, "ERROR: %s could not be opened: %s\n", line, strerror(errno));
+            errors++;
+            continue;
+        }
+
+        // only a hint, filesystems without fallocate still get the write
+        if (options->fallocate_flag && content_len > 0 &&
+            fallocate(fd, 0, 0, content_len) != 0 && errno != EOPNOTSUPP) {
+            syslog(LOG_ERR, "ERROR: %s could not be allocated: %s\n", line, strerror(errno));
+        }
+
+        if (write_all(fd, content, content_len) != 0) {
+            syslog(LOG_ERR, "ERROR: %s could not be written to: %s\n", line, strerror(errno));
+            errors++;
+            close(fd);
+            continue;
+        }
+        num_files++;
+        num_bytes += content_len;
+
+        if (options->sync_batch == 0) {
+            if (close(fd) != 0) {
+                syslog(LOG_ERR, "ERROR: %s could not be closed\n", line);
+                errors++;
+            }
+            continue;
+        }
+
+        // start writeback now, wait for it once per batch
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        fds[num_fds++] = fd;
+        if (num_fds == options->sync_batch) {
+            errors += sync_batch(fds, &num_fds);
+        }
+    }
+    errors += sync_batch(fds, &num_fds);
+    free(line);
+
+    // one summary instead of a syslog call per file
+    syslog(LOG_DEBUG, "Wrote %ld files, %ld bytes, %d errors\n", num_files, num_bytes, errors);
+    return errors;
+}
 
 int main(int argc, char* argv[]) {
-    char path[100];
+    char* path;
+    char* path_copy;
     char* writestr;
     char* directory_name;
     FILE* fp;
+    FILE* manifest;
     struct stat st;
+    struct batch_options options = { false, 0 };
+    bool batch_flag = false;
     int status;
+    int opt;
 
     openlog(NULL, LOG_PERROR, LOG_USER);
 
+    // options only in batch mode, the string of a single write may start with '-'
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        batch_flag = true;
+        optind = 2;
+    }
+
+    while (batch_flag && (opt = getopt(argc, argv, "+fs:")) != -1) {
+        switch (opt) {
+        case 'f':
+            options.fallocate_flag = true;
+            break;
+        case 's':
+            options.sync_batch = atoi(optarg);
+            if (options.sync_batch < 0 || options.sync_batch > MAX_SYNC_BATCH) {
+                syslog(LOG_ERR, "ERROR: sync batch must be 0 to %d\n", MAX_SYNC_BATCH);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (batch_flag) {
+        if (argc - optind > 1) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+
+        manifest = stdin;
+        if (optind < argc && strcmp(argv[optind], "-") != 0) {
+            manifest = fopen(argv[optind], "r");
+            if (manifest == NULL) {
+                syslog(LOG_ERR, "ERROR: manifest could not be opened\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        setvbuf(manifest, NULL, _IOFBF, MANIFEST_BUF_SIZE);
+
+        status = write_batch(manifest, &options);
+
+        if (manifest != stdin) {
+            fclose(manifest);
+        }
+        closelog();
+        return (status == 0) ? 0 : EXIT_FAILURE;
+    }
+
     // check command line arguments
     if (argc != 3) {
         syslog(LOG_ERR, "ERROR: invalid number of arguments\n");
         exit(EXIT_FAILURE);
     }
+    path = argv[1];
 
-    // get directory path without filename appended
-    strcpy(path, argv[1]);
-    directory_name = dirname(argv[1]);
+    // get directory path without filename appended, dirname may modify its argument
+    path_copy = strdup(path);
+    if (path_copy == NULL) {
+        syslog(LOG_ERR, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    directory_name = dirname(path_copy);
 
     // verify that directory path exists
     if (stat(directory_name, &st) != 0) {
         syslog(LOG_ERR, "ERROR: path does not exist\n");
         exit(EXIT_FAILURE);
     }
+    free(path_copy);
 
     // open the file
     fp = fopen(path, "w");
@@ -65,4 +287,3 @@ int main(int argc, char* argv[]) {
     return 0;
 
 }
-
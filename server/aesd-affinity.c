@@ -0,0 +1,241 @@
+#define _GNU_SOURCE // sched_setaffinity, pthread_attr_setaffinity_np
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/socket.h>
+
+#include "aesd-affinity.h"
+
+#define NODE_PATH "/sys/devices/system/node"
+
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+static int num_nodes; // highest node number + 1, 1 on machines without NUMA info
+
+static bool acceptor_enabled;
+static cpu_set_t acceptor_set;
+static bool worker_enabled;
+static cpu_set_t worker_set;
+static cpu_set_t worker_node_sets[AFFINITY_MAX_NODES]; // worker_set split by node, empty for nodes outside it
+static int next_node; // round robin, only the acceptor uses it
+static bool steer_flag;
+static cpu_set_t process_set; // mask we started with, for threads that are not pinned
+
+// parses "0-3,8" into set, false on a malformed list
+static bool parse_cpulist(const char* list, cpu_set_t* set) {
+    const char* pos = list;
+    char* end;
+    long first;
+    long last;
+    long cpu;
+
+    CPU_ZERO(set);
+    while (*pos != '\0' && *pos != '\n') {
+        first = strtol(pos, &end, 10);
+        if (end == pos || first < 0 || first >= CPU_SETSIZE) {
+            return false;
+        }
+        last = first;
+        pos = end;
+        if (*pos == '-') {
+            last = strtol(pos + 1, &end, 10);
+            if (end == pos + 1 || last < first || last >= CPU_SETSIZE) {
+                return false;
+            }
+            pos = end;
+        }
+        for (cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*pos == ',') {
+            pos++;
+        }
+        else if (*pos != '\0' && *pos != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// fills node_cpus from sysfs, everything is node 0 when that is missing
+static void read_topology(void) {
+    struct dirent* entry;
+    char path[512];
+    char list[4096];
+    FILE* fp;
+    DIR* dir;
+    int node;
+
+    num_nodes = 0;
+    dir = opendir(NODE_PATH);
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) != 0 || !isdigit((unsigned char) entry->d_name[4])) {
+            continue;
+        }
+        node = atoi(entry->d_name + 4);
+        if (node >= AFFINITY_MAX_NODES) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), NODE_PATH "/%s/cpulist", entry->d_name);
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), fp) != NULL && parse_cpulist(list, &node_cpus[node]) && node >= num_nodes) {
+            num_nodes = node + 1;
+        }
+        fclose(fp);
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    if (num_nodes == 0) {
+        num_nodes = 1;
+        CPU_ZERO(&node_cpus[0]);
+        sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[0]);
+    }
+}
+
+// a cpulist, or "nodeN" for all CPUs of node N, only CPUs we may run on
+static bool parse_cpus(const char* spec, cpu_set_t* set) {
+    cpu_set_t allowed;
+    int node;
+
+    if (strncmp(spec, "node", 4) == 0) {
+        node = atoi(spec + 4);
+        if (!isdigit((unsigned char) spec[4]) || node >= num_nodes || CPU_COUNT(&node_cpus[node]) == 0) {
+            return false;
+        }
+        *set = node_cpus[node];
+    }
+    else if (!parse_cpulist(spec, set) || CPU_COUNT(set) == 0) {
+        return false;
+    }
+
+    // offline or outside our cpuset, pthread_create would fail with EINVAL later
+    CPU_AND(&allowed, set, &process_set);
+    return CPU_EQUAL(&allowed, set);
+}
+
+/**
+ * Reads the node layout and the -a @param acceptor_cpus and -c
+ * @param worker_cpus sets, either may be NULL for no pinning.
+ * @param steer picks connection CPUs by SO_INCOMING_CPU.
+ * @return 0 on success, -1 for a set that cannot be parsed or is not allowed
+ */
+int affinity_init(const char* acceptor_cpus, const char* worker_cpus, bool steer) {
+    int node;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &process_set) == -1) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    read_topology();
+
+    if (acceptor_cpus != NULL) {
+        if (!parse_cpus(acceptor_cpus, &acceptor_set)) {
+            printf("Invalid CPU set %s, or CPUs this process may not use\n", acceptor_cpus);
+            return -1;
+        }
+        acceptor_enabled = true;
+    }
+
+    steer_flag = steer;
+    if (worker_cpus == NULL && steer) {
+        // steering alone may use every CPU we are allowed on
+        worker_set = process_set;
+        worker_enabled = true;
+    }
+    else if (worker_cpus != NULL) {
+        if (!parse_cpus(worker_cpus, &worker_set)) {
+            printf("Invalid CPU set %s, or CPUs this process may not use\n", worker_cpus);
+            return -1;
+        }
+        worker_enabled = true;
+    }
+
+    for (node = 0; node < num_nodes; node++) {
+        CPU_AND(&worker_node_sets[node], &worker_set, &node_cpus[node]);
+    }
+    return 0;
+}
+
+/* Pins the calling thread to the acceptor set, threads it creates inherit it. */
+int affinity_pin_acceptor(void) {
+    if (!acceptor_enabled) {
+        return 0;
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &acceptor_set) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+/* Sets the acceptor set on @param attr, for the timer threads. */
+bool affinity_acceptor_attr(pthread_attr_t* attr) {
+    if (!acceptor_enabled) {
+        return false;
+    }
+    return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &acceptor_set) == 0;
+}
+
+static int node_of_cpu(int cpu) {
+    int node;
+
+    for (node = 0; node < num_nodes; node++) {
+        if (CPU_ISSET(cpu, &node_cpus[node])) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Picks the CPUs for the thread of the connection on @param fd and sets them
+ * on @param attr.  Without -c and -s that is the mask the process started
+ * with, so connections do not inherit the acceptor's.
+ * @return false if there is nothing to set or it could not be set
+ */
+bool affinity_worker_attr(pthread_attr_t* attr, int fd) {
+    cpu_set_t set;
+    socklen_t len = sizeof(int);
+    int cpu = -1;
+    int node = -1;
+    int i;
+
+    if (!worker_enabled) {
+        if (!acceptor_enabled) {
+            return false;
+        }
+        return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &process_set) == 0;
+    }
+
+    // the CPU that took the connection's packets, -1 for Unix sockets
+    if (steer_flag && getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0 && cpu < CPU_SETSIZE) {
+        if (CPU_ISSET(cpu, &worker_set)) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set) == 0;
+        }
+        node = node_of_cpu(cpu);
+        if (node != -1 && CPU_COUNT(&worker_node_sets[node]) == 0) {
+            node = -1;
+        }
+    }
+
+    // otherwise spread the connections over the nodes of the worker set
+    for (i = 0; node == -1 && i < num_nodes; i++) {
+        if (CPU_COUNT(&worker_node_sets[next_node]) > 0) {
+            node = next_node;
+        }
+        next_node = (next_node + 1) % num_nodes;
+    }
+    if (node == -1) {
+        return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &worker_set) == 0;
+    }
+    return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &worker_node_sets[node]) == 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * aesd-affinity.h
+ *
+ * CPU and NUMA placement for aesdsocket threads.  CPU sets are given as
+ * lists like "0-3,8" or by node, "node1", and the node layout is read from
+ * /sys/devices/system/node.
+ *   -a cpus  the acceptor (main) and the background threads: logger, timer,
+ *            snapshot and follower; connection threads keep the mask the
+ *            process started with
+ *   -c cpus  connection threads, each new one is pinned to the CPUs of one
+ *            node in turn
+ *   -s       steer instead: a TCP connection's thread is pinned to the CPU
+ *            that received the connection (SO_INCOMING_CPU) when that CPU
+ *            is in the -c set, else to the -c CPUs of its node
+ * A connection thread is pinned before it starts, so everything it
+ * allocates is first touched, and with the kernel's default policy placed,
+ * on its own node.  Users need _GNU_SOURCE for cpu_set_t.
+ */
+
+#ifndef AESD_AFFINITY_H
+#define AESD_AFFINITY_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define AFFINITY_MAX_NODES 64
+
+int affinity_init(const char* acceptor_cpus, const char* worker_cpus, bool steer);
+
+int affinity_pin_acceptor(void);
+
+bool affinity_acceptor_attr(pthread_attr_t* attr);
+
+bool affinity_worker_attr(pthread_attr_t* attr, int fd);
+
+#endif /* AESD_AFFINITY_H */
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "aesd-fair.h"
+#include "aesd-log.h"
+
+// guards every fair_client and the gate
+static pthread_mutex_t fair_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(fair_client_head, fair_client) clients = LIST_HEAD_INITIALIZER(clients);
+static TAILQ_HEAD(fair_active_head, fair_client) active = TAILQ_HEAD_INITIALIZER(active);
+static bool gate_held; // someone is between fair_enter and fair_exit
+static double fair_rate; // tokens per second, 0 for no limit
+static double fair_burst;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Sets the per-client limit to @param rate requests per second with bursts
+ * of @param burst (at least 1), before any client connects.  0 disables it.
+ */
+void fair_init(unsigned int rate, unsigned int burst) {
+    fair_rate = rate;
+    fair_burst = (burst == 0) ? 1 : burst;
+}
+
+// tops up the bucket for the time since the last refill, fair_mutex held
+static void fair_refill(struct fair_client* client) {
+    uint64_t now = now_ns();
+
+    client->tokens += (now - client->refill_ns) * fair_rate / 1e9;
+    if (client->tokens > fair_burst) {
+        client->tokens = fair_burst;
+    }
+    client->refill_ns = now;
+}
+
+/**
+ * Finds or creates the entry for @param addr and takes a reference on it,
+ * once per connection.  Entries without connections are dropped here once
+ * their bucket is full again, a new one would start out the same.
+ * @return the entry, NULL if it could not be allocated
+ */
+struct fair_client* fair_client_get(struct in_addr addr) {
+    struct fair_client* client;
+    struct fair_client* found = NULL;
+    struct fair_client* next;
+
+    pthread_mutex_lock(&fair_mutex);
+    for (client = LIST_FIRST(&clients); client != NULL; client = next) {
+        next = LIST_NEXT(client, entries);
+        if (client->addr.s_addr == addr.s_addr) {
+            found = client;
+            continue;
+        }
+        if (client->refs == 0) {
+            fair_refill(client);
+            if (client->tokens >= fair_burst) {
+                LIST_REMOVE(client, entries);
+                free(client);
+            }
+        }
+    }
+    client = found;
+
+    if (client == NULL) {
+        client = calloc(1, sizeof(struct fair_client));
+        if (client == NULL) {
+            perror("calloc");
+            pthread_mutex_unlock(&fair_mutex);
+            return NULL;
+        }
+        client->addr = addr;
+        client->tokens = fair_burst;
+        client->refill_ns = now_ns();
+        STAILQ_INIT(&client->waiters);
+        LIST_INSERT_HEAD(&clients, client, entries);
+    }
+    client->refs++;
+    pthread_mutex_unlock(&fair_mutex);
+    return client;
+}
+
+/* Drops a connection's reference, the entry outlives the last one until its bucket refilled. */
+void fair_client_put(struct fair_client* client) {
+    pthread_mutex_lock(&fair_mutex);
+    client->refs--;
+    pthread_mutex_unlock(&fair_mutex);
+}
+
+/**
+ * Waits for the turn of @param client in front of the storage mutex.  With
+ * nobody queued the turn is taken right away, otherwise fair_exit() hands it
+ * over directly, so a thread that just left cannot barge back in.
+ */
+void fair_enter(struct fair_client* client) {
+    struct fair_waiter waiter;
+
+    pthread_mutex_lock(&fair_mutex);
+    if (!gate_held) {
+        gate_held = true;
+        pthread_mutex_unlock(&fair_mutex);
+        return;
+    }
+
+    pthread_cond_init(&waiter.cond, NULL);
+    waiter.granted = false;
+    STAILQ_INSERT_TAIL(&client->waiters, &waiter, entries);
+    if (!client->active) {
+        client->active = true;
+        TAILQ_INSERT_TAIL(&active, client, active_entries);
+    }
+
+    while (!waiter.granted) {
+        pthread_cond_wait(&waiter.cond, &fair_mutex);
+    }
+    pthread_mutex_unlock(&fair_mutex);
+    pthread_cond_destroy(&waiter.cond);
+}
+
+/* Passes the turn to the next client in the round robin, or frees the gate. */
+void fair_exit(void) {
+    struct fair_client* client;
+    struct fair_waiter* waiter;
+
+    pthread_mutex_lock(&fair_mutex);
+    client = TAILQ_FIRST(&active);
+    if (client == NULL) {
+        gate_held = false;
+        pthread_mutex_unlock(&fair_mutex);
+        return;
+    }
+
+    waiter = STAILQ_FIRST(&client->waiters);
+    STAILQ_REMOVE_HEAD(&client->waiters, entries);
+
+    // a client with more waiters goes to the back of the round
+    TAILQ_REMOVE(&active, client, active_entries);
+    if (STAILQ_EMPTY(&client->waiters)) {
+        client->active = false;
+    }
+    else {
+        TAILQ_INSERT_TAIL(&active, client, active_entries);
+    }
+
+    waiter->granted = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&fair_mutex);
+}
+
+/* Takes one token per request for @param count requests of @param client that just arrived. */
+void fair_charge(struct fair_client* client, unsigned int count) {
+    pthread_mutex_lock(&fair_mutex);
+    client->requests += count;
+    if (fair_rate > 0) {
+        fair_refill(client);
+        client->tokens -= count;
+        if (client->tokens < 1) {
+            client->throttled++;
+        }
+    }
+    pthread_mutex_unlock(&fair_mutex);
+}
+
+/**
+ * @return how long @param client's connections should stop reading before
+ * its bucket holds a token again, 0 if they may read now
+ */
+int fair_wait_ms(struct fair_client* client) {
+    double missing;
+
+    if (fair_rate == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&fair_mutex);
+    fair_refill(client);
+    missing = 1 - client->tokens;
+    pthread_mutex_unlock(&fair_mutex);
+
+    if (missing <= 0) {
+        return 0;
+    }
+    return (int) (missing * 1000 / fair_rate) + 1;
+}
+
+/* Logs the counters of every client still tracked, on SIGUSR1. */
+void fair_log_stats(void) {
+    struct fair_client* client;
+    char addr[INET_ADDRSTRLEN];
+
+    pthread_mutex_lock(&fair_mutex);
+    LIST_FOREACH(client, &clients, entries) {
+        inet_ntop(AF_INET, &client->addr, addr, sizeof(addr));
+        log_msg(LOG_DEBUG, "Client %s: %u connections, %llu requests, %llu throttled\n", addr, client->refs,
+                (unsigned long long) client->requests, (unsigned long long) client->throttled);
+    }
+    pthread_mutex_unlock(&fair_mutex);
+}
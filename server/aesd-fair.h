@@ -0,0 +1,62 @@
+/*
+ * aesd-fair.h
+ *
+ * Per-client fairness for aesdsocket.  Connections are grouped by source
+ * IPv4 address (local shared memory clients count as 127.0.0.1), and each
+ * group has:
+ *   - a token bucket, refilled at -r requests per second up to -B, that
+ *     pauses reading from all of the group's connections while it is empty;
+ *     every packet or record costs a token, a burst puts the bucket in debt
+ *     and reconnecting does not reset it
+ *   - a queue in front of the storage mutex; the mutex is handed to the
+ *     groups with waiters in round robin, so a client with many connections
+ *     or pipelined requests gets one turn per round like everyone else
+ * Rate limiting is off until fair_init() is given a non-zero rate, the fair
+ * queue is always used.
+ */
+
+#ifndef AESD_FAIR_H
+#define AESD_FAIR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/queue.h>
+
+struct fair_waiter {
+    pthread_cond_t cond;
+    bool granted;
+    STAILQ_ENTRY(fair_waiter) entries;
+};
+
+struct fair_client {
+    struct in_addr addr;
+    unsigned int refs; // connections from addr, the entry stays at 0 until the bucket is full
+    double tokens; // may go below 0, requests are charged after they arrived
+    uint64_t refill_ns; // last time tokens were topped up
+    uint64_t requests;
+    uint64_t throttled; // requests that emptied the bucket, pausing the client
+    STAILQ_HEAD(fair_waiter_head, fair_waiter) waiters;
+    bool active; // has waiters, in the round robin
+    TAILQ_ENTRY(fair_client) active_entries;
+    LIST_ENTRY(fair_client) entries;
+};
+
+void fair_init(unsigned int rate, unsigned int burst);
+
+struct fair_client* fair_client_get(struct in_addr addr);
+
+void fair_client_put(struct fair_client* client);
+
+void fair_enter(struct fair_client* client);
+
+void fair_exit(void);
+
+void fair_charge(struct fair_client* client, unsigned int count);
+
+int fair_wait_ms(struct fair_client* client);
+
+void fair_log_stats(void);
+
+#endif /* AESD_FAIR_H */
@@ -0,0 +1,57 @@
+/*
+ * aesd-frame.h
+ *
+ * Length-prefixed binary framing for aesdsocket, an alternative to the
+ * newline-terminated text protocol.  A client opts in by sending
+ * FRAME_MAGIC as the very first byte of the connection (TCP or shared
+ * memory), which no text packet starts with.  After that both directions
+ * are a sequence of records:
+ *
+ *   1 byte   type
+ *   4 bytes  payload length, big endian, at most FRAME_MAX_PAYLOAD
+ *   payload
+ *
+ * Client records:
+ *   FRAME_APPEND - payload is one packet, newlines allowed; a newline is
+ *                  added when it does not end with one.  Answered with the
+ *                  full history.
+ *   FRAME_GREP   - payload is a search pattern, answered with the matching
+ *                  lines like the text "GREP <pattern>\n" command.
+ * Server records:
+ *   FRAME_REPLY  - one per client record, in order.  A reply that does not
+ *                  fit the length field, a history over 4 GiB, closes the
+ *                  connection instead.
+ *
+ * Knowing the length up front, the server reads large payloads straight into
+ * their buffer, which grows as they arrive rather than to the claimed length
+ * at once, and clients read replies without scanning for the end.
+ */
+
+#ifndef AESD_FRAME_H
+#define AESD_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_MAGIC 0xAE
+#define FRAME_HEADER_LEN 5
+#define FRAME_MAX_PAYLOAD (64 * 1024 * 1024)
+
+#define FRAME_APPEND 'A'
+#define FRAME_GREP 'G'
+#define FRAME_REPLY 'R'
+
+static inline void frame_encode_header(char* header, char type, uint32_t len) {
+    header[0] = type;
+    header[1] = (char) (len >> 24);
+    header[2] = (char) (len >> 16);
+    header[3] = (char) (len >> 8);
+    header[4] = (char) len;
+}
+
+static inline uint32_t frame_decode_len(const char* header) {
+    const unsigned char* bytes = (const unsigned char*) header;
+    return ((uint32_t) bytes[1] << 24) | ((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 8) | bytes[4];
+}
+
+#endif /* AESD_FRAME_H */
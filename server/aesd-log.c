@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "aesd-log.h"
+
+struct log_record {
+    struct timespec ts; // CLOCK_REALTIME at log_msg()
+    int level;
+    char msg[LOG_MSG_MAX];
+};
+
+// written by one thread, read by the logger thread
+struct log_ring {
+    struct log_record records[LOG_RING_SIZE];
+    _Atomic size_t head; // next slot to write, owned by the producer
+    _Atomic size_t tail; // next slot to read, owned by the logger
+    atomic_bool retired; // producer exited, free once drained
+    struct log_ring* next;
+};
+
+static struct log_ring* rings; // every registered ring, guarded by rings_mutex
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring* thread_ring;
+
+static pthread_t logger_thread;
+static atomic_bool logger_running;
+static FILE* log_file; // NULL logs to syslog
+static unsigned int log_rate;
+
+static atomic_ulong dropped_full; // ring was full, counted by producers
+static unsigned long dropped_rate; // over the rate limit, counted by the logger
+
+static void ring_retire(void* arg) {
+    struct log_ring* ring = arg;
+    atomic_store_explicit(&ring->retired, true, memory_order_release);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_retire);
+}
+
+// first log_msg() of a thread, the only place producers take a lock
+static struct log_ring* ring_register(void) {
+    struct log_ring* ring;
+
+    pthread_once(&ring_key_once, ring_key_create);
+
+    ring = calloc(1, sizeof(struct log_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * Queues one message at syslog @param level for the logger thread.
+ * Messages are dropped, and counted, when this thread's ring is full.
+ */
+void log_msg(int level, const char* format, ...) {
+    struct log_ring* ring = thread_ring;
+    struct log_record* record;
+    size_t head;
+    size_t tail;
+    va_list args;
+
+    if (ring == NULL && (ring = ring_register()) == NULL) {
+        atomic_fetch_add_explicit(&dropped_full, 1, memory_order_relaxed);
+        return;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped_full, 1, memory_order_relaxed);
+        return;
+    }
+
+    record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &record->ts);
+    record->level = level;
+    va_start(args, format);
+    vsnprintf(record->msg, LOG_MSG_MAX, format, args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void log_emit(int level, const struct timespec* ts, const char* msg) {
+    struct tm info;
+    char time_buf[32];
+    size_t len = strlen(msg);
+
+    // callers used to pass syslog style messages, with or without a newline
+    if (len > 0 && msg[len - 1] == '\n') {
+        len--;
+    }
+
+    if (log_file == NULL) {
+        syslog(level, "%.*s", (int) len, msg);
+        return;
+    }
+
+    localtime_r(&ts->tv_sec, &info);
+    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", &info);
+    fprintf(log_file, "%s.%03ld <%d> %.*s\n", time_buf, ts->tv_nsec / 1000000, level, (int) len, msg);
+}
+
+// token bucket refilled once per drain pass, burst of one second worth
+static bool rate_allow(double* tokens, const struct timespec* last, const struct timespec* now) {
+    if (log_rate == 0) {
+        return true;
+    }
+
+    *tokens += ((now->tv_sec - last->tv_sec) + (now->tv_nsec - last->tv_nsec) / 1e9) * log_rate;
+    if (*tokens > log_rate) {
+        *tokens = log_rate;
+    }
+    if (*tokens < 1) {
+        return false;
+    }
+    *tokens -= 1;
+    return true;
+}
+
+static void log_drain(double* tokens, struct timespec* last) {
+    struct log_ring** link;
+    struct log_ring* ring;
+    struct log_record* record;
+    struct timespec now;
+    size_t head;
+    size_t tail;
+    bool retired;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&rings_mutex);
+    link = &rings;
+    while ((ring = *link) != NULL) {
+        // read retired first so nothing pushed before the thread exited is missed
+        retired = atomic_load_explicit(&ring->retired, memory_order_acquire);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        for (; tail != head; tail++) {
+            record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+            if (rate_allow(tokens, last, &now)) {
+                log_emit(record->level, &record->ts, record->msg);
+            }
+            else {
+                dropped_rate++;
+            }
+            *last = now;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if (retired) {
+            *link = ring->next;
+            free(ring);
+        }
+        else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    *last = now;
+}
+
+static void log_report_drops(void) {
+    static unsigned long reported_full;
+    static unsigned long reported_rate;
+    unsigned long full = atomic_load_explicit(&dropped_full, memory_order_relaxed);
+    struct timespec now;
+    char msg[LOG_MSG_MAX];
+
+    if (full == reported_full && dropped_rate == reported_rate) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(msg, sizeof(msg), "log: dropped %lu records (ring full %lu, rate limited %lu)",
+             (full - reported_full) + (dropped_rate - reported_rate), full - reported_full, dropped_rate - reported_rate);
+    log_emit(LOG_WARNING, &now, msg);
+
+    reported_full = full;
+    reported_rate = dropped_rate;
+}
+
+static void* logger_function(void* arg) {
+    struct timespec interval = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+    struct timespec last;
+    double tokens = log_rate;
+    int passes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    while (atomic_load(&logger_running)) {
+        nanosleep(&interval, NULL);
+        log_drain(&tokens, &last);
+
+        // one drop summary per second at most
+        if (++passes * LOG_DRAIN_INTERVAL_MS >= 1000) {
+            log_report_drops();
+            passes = 0;
+        }
+        if (log_file != NULL) {
+            fflush(log_file);
+        }
+    }
+
+    // whatever was queued before log_stop() is written regardless of the limit
+    log_rate = 0;
+    log_drain(&tokens, &last);
+    log_report_drops();
+    return NULL;
+}
+
+/**
+ * Starts the logger thread, writing to the file at @param path or to syslog if NULL,
+ * at most @param rate records per second (0 for no limit).
+ * Messages logged before this are kept in their rings and written once it runs.
+ * @return 0 on success, -1 on error
+ */
+int log_start(const char* path, unsigned int rate) {
+    sigset_t all_signals;
+    sigset_t prev_signals;
+    int status;
+
+    if (path != NULL) {
+        log_file = fopen(path, "a");
+        if (log_file == NULL) {
+            perror("fopen");
+            return -1;
+        }
+    }
+    log_rate = rate;
+
+    // the logger thread must never run signal handlers, it inherits this mask
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &prev_signals);
+
+    atomic_store(&logger_running, true);
+    status = pthread_create(&logger_thread, NULL, logger_function, NULL);
+
+    pthread_sigmask(SIG_SETMASK, &prev_signals, NULL);
+
+    if (status != 0) {
+        printf("logger pthread_create error\n");
+        atomic_store(&logger_running, false);
+        if (log_file != NULL) {
+            fclose(log_file);
+            log_file = NULL;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes out everything queued so far and stops the logger thread. */
+void log_stop(void) {
+    if (!atomic_exchange(&logger_running, false)) {
+        return;
+    }
+    pthread_join(logger_thread, NULL);
+
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+}
@@ -0,0 +1,29 @@
+/*
+ * aesd-log.h
+ *
+ * Asynchronous logging for aesdsocket.  log_msg() formats into a fixed size
+ * record and pushes it onto the calling thread's own single producer ring,
+ * no lock and no syscall.  A background thread drains every ring and emits
+ * the records to syslog or to a file, rate limited, and reports how many
+ * records were dropped because a ring was full or the rate limit was hit.
+ *
+ * log_msg() is not async-signal-safe, signal handlers must not call it.
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <syslog.h>
+
+#define LOG_MSG_MAX 120 // longer messages are truncated
+#define LOG_RING_SIZE 256 // records per thread, must be a power of 2
+#define LOG_DRAIN_INTERVAL_MS 10
+#define DEFAULT_LOG_RATE 1000 // records per second, 0 disables the limit
+
+int log_start(const char* path, unsigned int rate);
+
+void log_stop(void);
+
+void log_msg(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* AESD_LOG_H */
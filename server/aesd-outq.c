@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "aesd-outq.h"
+
+static void outq_update_watermark(struct aesd_outq* q) {
+    if (q->queued >= q->high_watermark) {
+        q->over_high = true;
+    }
+    else if (q->queued <= q->low_watermark) {
+        q->over_high = false;
+    }
+}
+
+void outq_init(struct aesd_outq* q, size_t high_watermark, size_t low_watermark) {
+    STAILQ_INIT(&q->chunks);
+    q->queued = 0;
+    q->high_watermark = high_watermark;
+    q->low_watermark = low_watermark;
+    q->over_high = false;
+    q->completed = 0;
+}
+
+/**
+ * Queues @param len bytes of @param buf behind anything not yet sent.
+ * The queue takes ownership of buf (allocated with malloc) in every case.
+ * @return 0 on success, -1 if the chunk could not be allocated
+ */
+int outq_push(struct aesd_outq* q, char* buf, size_t len) {
+    return outq_push_prefixed(q, NULL, 0, buf, len);
+}
+
+/**
+ * Like outq_push(), with the @param prefix_len (at most OUTQ_PREFIX_MAX)
+ * bytes of @param prefix copied into the chunk and sent first.
+ */
+int outq_push_prefixed(struct aesd_outq* q, const char* prefix, size_t prefix_len, char* buf, size_t len) {
+    struct outq_chunk* chunk;
+
+    // nothing to send, but the reply is complete
+    if (prefix_len + len == 0) {
+        free(buf);
+        q->completed++;
+        return 0;
+    }
+
+    chunk = malloc(sizeof(struct outq_chunk));
+    if (chunk == NULL) {
+        perror("malloc");
+        free(buf);
+        return -1;
+    }
+    chunk->buf = buf;
+    chunk->len = prefix_len + len;
+    chunk->sent = 0;
+    chunk->prefix_len = prefix_len;
+    if (prefix_len > 0) {
+        memcpy(chunk->prefix, prefix, prefix_len);
+    }
+    STAILQ_INSERT_TAIL(&q->chunks, chunk, entries);
+
+    q->queued += chunk->len;
+    outq_update_watermark(q);
+    return 0;
+}
+
+// the unsent part of the prefix, or of buf once the prefix is out
+static void chunk_piece(const struct outq_chunk* chunk, const char** piece, size_t* piece_len) {
+    if (chunk->sent < chunk->prefix_len) {
+        *piece = chunk->prefix + chunk->sent;
+        *piece_len = chunk->prefix_len - chunk->sent;
+    }
+    else {
+        *piece = chunk->buf + (chunk->sent - chunk->prefix_len);
+        *piece_len = chunk->len - chunk->sent;
+    }
+}
+
+// accounts num_bytes written from the head of the queue, freeing finished chunks
+static void outq_consume(struct aesd_outq* q, size_t num_bytes) {
+    struct outq_chunk* chunk;
+    size_t step;
+
+    q->queued -= num_bytes;
+    while (num_bytes > 0 && (chunk = STAILQ_FIRST(&q->chunks)) != NULL) {
+        step = chunk->len - chunk->sent;
+        if (step > num_bytes) {
+            step = num_bytes;
+        }
+        chunk->sent += step;
+        num_bytes -= step;
+
+        if (chunk->sent == chunk->len) {
+            STAILQ_REMOVE_HEAD(&q->chunks, entries);
+            free(chunk->buf);
+            free(chunk);
+            q->completed++;
+        }
+    }
+}
+
+/**
+ * Sends as much of the queue to @param fd as the socket accepts without blocking,
+ * picking up partial sends where the previous call stopped.  Prefixes, their
+ * buffers and several queued replies go out in one sendmsg, so a record
+ * header never ends up in a segment of its own.
+ * @return bytes sent (0 if the socket buffer is full), or -1 on a socket error
+ */
+ssize_t outq_flush(struct aesd_outq* q, int fd) {
+    struct iovec iov[OUTQ_IOV_MAX];
+    struct msghdr msg;
+    struct outq_chunk* chunk;
+    const char* piece;
+    size_t piece_len;
+    size_t offset;
+    ssize_t total = 0;
+    ssize_t num_bytes;
+    int num_iov;
+
+    while (!STAILQ_EMPTY(&q->chunks)) {
+        num_iov = 0;
+        STAILQ_FOREACH(chunk, &q->chunks, entries) {
+            if (num_iov + 2 > OUTQ_IOV_MAX) {
+                break;
+            }
+            chunk_piece(chunk, &piece, &piece_len);
+            iov[num_iov].iov_base = (void*) piece;
+            iov[num_iov].iov_len = piece_len;
+            num_iov++;
+
+            // the buffer behind a prefix that is still unsent
+            offset = chunk->sent + piece_len;
+            if (offset < chunk->len) {
+                iov[num_iov].iov_base = chunk->buf;
+                iov[num_iov].iov_len = chunk->len - offset;
+                num_iov++;
+            }
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = num_iov;
+
+        num_bytes = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (num_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("send");
+            return -1;
+        }
+
+        outq_consume(q, num_bytes);
+        total += num_bytes;
+    }
+
+    outq_update_watermark(q);
+    return total;
+}
+
+/**
+ * Like outq_flush() for any destination: @param write_fn takes what it can of
+ * the bytes it is given and returns how many, 0 when it is full, or -1 on error.
+ */
+ssize_t outq_drain(struct aesd_outq* q, ssize_t (*write_fn)(void* ctx, const char* buf, size_t len), void* ctx) {
+    struct outq_chunk* chunk;
+    const char* piece;
+    size_t piece_len;
+    ssize_t total = 0;
+    ssize_t num_bytes;
+
+    while ((chunk = STAILQ_FIRST(&q->chunks)) != NULL) {
+        chunk_piece(chunk, &piece, &piece_len);
+        num_bytes = write_fn(ctx, piece, piece_len);
+        if (num_bytes == -1) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+
+        outq_consume(q, num_bytes);
+        total += num_bytes;
+    }
+
+    outq_update_watermark(q);
+    return total;
+}
+
+void outq_free(struct aesd_outq* q) {
+    struct outq_chunk* chunk;
+
+    while ((chunk = STAILQ_FIRST(&q->chunks)) != NULL) {
+        STAILQ_REMOVE_HEAD(&q->chunks, entries);
+        free(chunk->buf);
+        free(chunk);
+    }
+    q->queued = 0;
+    q->over_high = false;
+}
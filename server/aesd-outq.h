@@ -0,0 +1,62 @@
+/*
+ * aesd-outq.h
+ *
+ * Per-connection output queue for aesdsocket replies.  Replies are queued as
+ * malloc'd chunks and written with non-blocking sends, so a slow reader only
+ * grows its own queue.  High/low watermarks (with hysteresis) tell the
+ * connection loop when to throttle or drop the client.  A chunk can carry a
+ * short prefix (a record header) that is sent in front of its buffer without
+ * copying the buffer.
+ */
+
+#ifndef AESD_OUTQ_H
+#define AESD_OUTQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#define OUTQ_PREFIX_MAX 8
+#define OUTQ_IOV_MAX 16 // pieces handed to one sendmsg
+
+struct outq_chunk {
+    char* buf;
+    size_t len; // prefix_len plus the bytes of buf
+    size_t sent; // bytes of prefix and buf already written to the socket
+    size_t prefix_len;
+    char prefix[OUTQ_PREFIX_MAX];
+    STAILQ_ENTRY(outq_chunk) entries;
+};
+
+struct aesd_outq {
+    STAILQ_HEAD(outq_head, outq_chunk) chunks;
+    size_t queued; // unsent bytes over all chunks
+    size_t high_watermark;
+    size_t low_watermark;
+    bool over_high; // set at high_watermark, cleared at low_watermark
+    uint64_t completed; // chunks fully written out since outq_init
+};
+
+void outq_init(struct aesd_outq* q, size_t high_watermark, size_t low_watermark);
+
+int outq_push(struct aesd_outq* q, char* buf, size_t len);
+
+int outq_push_prefixed(struct aesd_outq* q, const char* prefix, size_t prefix_len, char* buf, size_t len);
+
+ssize_t outq_flush(struct aesd_outq* q, int fd);
+
+ssize_t outq_drain(struct aesd_outq* q, ssize_t (*write_fn)(void* ctx, const char* buf, size_t len), void* ctx);
+
+void outq_free(struct aesd_outq* q);
+
+static inline bool outq_empty(const struct aesd_outq* q) {
+    return q->queued == 0;
+}
+
+static inline bool outq_over_high(const struct aesd_outq* q) {
+    return q->over_high;
+}
+
+#endif /* AESD_OUTQ_H */
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "aesd-repl.h"
+#include "aesd-shm.h"
+
+// primary: the followers and their queues
+static pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(repl_follower_head, repl_follower) followers = LIST_HEAD_INITIALIZER(followers);
+
+// follower: the connection to the primary and the forwarded writes waiting for their ack
+static pthread_mutex_t forward_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER; // one record on the socket at a time
+static pthread_cond_t forward_cond = PTHREAD_COND_INITIALIZER;
+static int primary_fd = -1;
+static uint64_t next_id;
+static uint64_t acked_id; // acks arrive in id order, one primary thread handles our writes
+static uint64_t generation; // bumped on every detach, fails the writes of the old connection
+
+/* Same Unix socket setup as the shared memory transport. */
+int repl_listen(const char* path) {
+    return shm_listen(path);
+}
+
+/**
+ * Connects to the primary's replication socket at @param path.
+ * @return the socket, or -1 if the primary is not there
+ */
+int repl_connect(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void repl_reader_reset(struct repl_reader* reader) {
+    free(reader->buf);
+    reader->buf = NULL;
+    reader->header_pos = 0;
+    reader->len = 0;
+    reader->pos = 0;
+}
+
+// reads what is there of [buf, buf + len), -1 at EOF or on error
+static ssize_t repl_recv(int fd, char* buf, size_t len) {
+    ssize_t num_bytes;
+
+    while ((num_bytes = recv(fd, buf, len, MSG_DONTWAIT)) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        perror("recv");
+        return -1;
+    }
+    return (num_bytes == 0) ? -1 : num_bytes;
+}
+
+/**
+ * Continues the record in @param reader with what @param fd has, without blocking.
+ * @return 1 once the record is complete (header[0] is its type, buf and len
+ * its payload, call repl_reader_reset() after using it), 0 if more bytes are
+ * needed, -1 when the peer closed or sent garbage
+ */
+int repl_read(int fd, struct repl_reader* reader) {
+    ssize_t num_bytes;
+
+    while (reader->header_pos < FRAME_HEADER_LEN) {
+        num_bytes = repl_recv(fd, reader->header + reader->header_pos, FRAME_HEADER_LEN - reader->header_pos);
+        if (num_bytes <= 0) {
+            return num_bytes;
+        }
+        reader->header_pos += num_bytes;
+    }
+
+    if (reader->buf == NULL) {
+        reader->len = frame_decode_len(reader->header);
+        if (reader->len > REPL_MAX_QUEUED) {
+            printf("Replication record of %zu bytes\n", reader->len);
+            return -1;
+        }
+        // +1 so an empty record still has a buffer
+        reader->buf = malloc(reader->len + 1);
+        if (reader->buf == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        reader->pos = 0;
+    }
+
+    while (reader->pos < reader->len) {
+        num_bytes = repl_recv(fd, reader->buf + reader->pos, reader->len - reader->pos);
+        if (num_bytes <= 0) {
+            return num_bytes;
+        }
+        reader->pos += num_bytes;
+    }
+    return 1;
+}
+
+// queues one record on q and wakes the follower's thread, repl_mutex held
+static int repl_queue_on(struct repl_follower* follower, struct aesd_outq* q, char type, char* buf, size_t len) {
+    char header[FRAME_HEADER_LEN];
+    uint64_t one = 1;
+
+    frame_encode_header(header, type, len);
+    if (outq_push_prefixed(q, header, FRAME_HEADER_LEN, buf, len) != 0) {
+        return -1;
+    }
+    if (outq_over_high(&follower->outq)) {
+        follower->overflow = true;
+    }
+    if (write(follower->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("eventfd write");
+    }
+    return 0;
+}
+
+static int repl_queue(struct repl_follower* follower, char type, char* buf, size_t len) {
+    return repl_queue_on(follower, &follower->outq, type, buf, len);
+}
+
+// queues the next snapshot record, or the end of the snapshot, repl_mutex held
+static int repl_queue_snapshot(struct repl_follower* follower) {
+    size_t len = follower->snapshot_len - follower->snapshot_pos;
+    char* piece;
+
+    if (len == 0) {
+        free(follower->snapshot);
+        follower->snapshot = NULL;
+        return repl_queue_on(follower, &follower->sync_outq, REPL_SNAPSHOT_END, NULL, 0);
+    }
+
+    if (len > REPL_SNAPSHOT_CHUNK) {
+        len = REPL_SNAPSHOT_CHUNK;
+    }
+    piece = malloc(len);
+    if (piece == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(piece, follower->snapshot + follower->snapshot_pos, len);
+    follower->snapshot_pos += len;
+    return repl_queue_on(follower, &follower->sync_outq, REPL_SNAPSHOT, piece, len);
+}
+
+/**
+ * Registers @param follower on @param fd and queues the name of the
+ * @param backend its copy uses.  @param snapshot (@param len bytes, taken
+ * over like outq_push() does) follows piece by piece as the socket takes
+ * it, appends are queued behind it.  The caller holds the storage mutex, so
+ * no append can fall between the snapshot and the stream.
+ * @return 0 on success, -1 on error
+ */
+int repl_follower_add(struct repl_follower* follower, int fd, const char* backend, char* snapshot, size_t len) {
+    char* name;
+
+    memset(follower, 0, sizeof(*follower));
+    follower->fd = fd;
+    outq_init(&follower->outq, REPL_MAX_QUEUED, REPL_MAX_QUEUED);
+    outq_init(&follower->sync_outq, SIZE_MAX, SIZE_MAX);
+
+    follower->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (follower->wake_fd == -1) {
+        perror("eventfd");
+        free(snapshot);
+        return -1;
+    }
+
+    name = strdup(backend);
+    if (name == NULL) {
+        perror("strdup");
+        free(snapshot);
+        close(follower->wake_fd);
+        return -1;
+    }
+
+    follower->snapshot = snapshot;
+    follower->snapshot_len = len;
+
+    pthread_mutex_lock(&repl_mutex);
+    if (repl_queue_on(follower, &follower->sync_outq, REPL_HELLO, name, strlen(name)) != 0) {
+        pthread_mutex_unlock(&repl_mutex);
+        free(snapshot);
+        outq_free(&follower->sync_outq);
+        close(follower->wake_fd);
+        return -1;
+    }
+    LIST_INSERT_HEAD(&followers, follower, entries);
+    pthread_mutex_unlock(&repl_mutex);
+    return 0;
+}
+
+void repl_follower_remove(struct repl_follower* follower) {
+    pthread_mutex_lock(&repl_mutex);
+    LIST_REMOVE(follower, entries);
+    pthread_mutex_unlock(&repl_mutex);
+
+    outq_free(&follower->sync_outq);
+    outq_free(&follower->outq);
+    free(follower->snapshot);
+    close(follower->wake_fd);
+}
+
+/**
+ * Streams @param len bytes just appended to storage to every follower.  The
+ * caller holds the storage mutex, which keeps the stream in storage order.
+ */
+void repl_publish(const char* buf, size_t len) {
+    struct repl_follower* follower;
+    char* copy;
+
+    if (len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&repl_mutex);
+    LIST_FOREACH(follower, &followers, entries) {
+        // it gets dropped and starts over from a snapshot
+        if (follower->overflow) {
+            continue;
+        }
+        copy = malloc(len);
+        if (copy == NULL) {
+            perror("malloc");
+            follower->overflow = true;
+            continue;
+        }
+        memcpy(copy, buf, len);
+        if (repl_queue(follower, REPL_APPEND, copy, len) != 0) {
+            follower->overflow = true;
+        }
+    }
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+/* Tells @param follower its write @param id is in, after the append it caused. */
+int repl_ack(struct repl_follower* follower, uint64_t id) {
+    char* buf;
+    int status;
+
+    buf = malloc(REPL_ID_LEN);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(buf, &id, REPL_ID_LEN);
+
+    pthread_mutex_lock(&repl_mutex);
+    status = repl_queue(follower, REPL_ACK, buf, REPL_ID_LEN);
+    pthread_mutex_unlock(&repl_mutex);
+    return status;
+}
+
+/**
+ * Sends what the follower's socket takes without blocking.
+ * @return bytes sent, or -1 on a socket error or when the follower fell too far behind
+ */
+ssize_t repl_flush(struct repl_follower* follower) {
+    ssize_t total = 0;
+    ssize_t num_bytes;
+
+    pthread_mutex_lock(&repl_mutex);
+    if (follower->overflow) {
+        goto error;
+    }
+
+    // the snapshot one record at a time, only once it is out do the appends follow
+    for (;;) {
+        num_bytes = outq_flush(&follower->sync_outq, follower->fd);
+        if (num_bytes == -1) {
+            goto error;
+        }
+        total += num_bytes;
+        if (!outq_empty(&follower->sync_outq)) {
+            goto exit;
+        }
+        if (follower->snapshot == NULL) {
+            break;
+        }
+        if (repl_queue_snapshot(follower) != 0) {
+            goto error;
+        }
+    }
+
+    num_bytes = outq_flush(&follower->outq, follower->fd);
+    if (num_bytes == -1) {
+        goto error;
+    }
+    total += num_bytes;
+
+ exit:
+    pthread_mutex_unlock(&repl_mutex);
+    return total;
+
+ error:
+    pthread_mutex_unlock(&repl_mutex);
+    return -1;
+}
+
+bool repl_pending(struct repl_follower* follower) {
+    bool pending;
+
+    pthread_mutex_lock(&repl_mutex);
+    pending = !outq_empty(&follower->sync_outq) || follower->snapshot != NULL || !outq_empty(&follower->outq);
+    pthread_mutex_unlock(&repl_mutex);
+    return pending;
+}
+
+/* Follower: writes go to the primary on @param fd from now on. */
+void repl_attach(int fd) {
+    pthread_mutex_lock(&forward_mutex);
+    primary_fd = fd;
+    acked_id = next_id;
+    pthread_mutex_unlock(&forward_mutex);
+}
+
+/* Follower: the primary is gone, fails every write still waiting for it. */
+void repl_detach(void) {
+    // no send in flight once the socket is closed by the caller
+    pthread_mutex_lock(&send_mutex);
+    pthread_mutex_lock(&forward_mutex);
+    primary_fd = -1;
+    generation++;
+    pthread_cond_broadcast(&forward_cond);
+    pthread_mutex_unlock(&forward_mutex);
+    pthread_mutex_unlock(&send_mutex);
+}
+
+/* Follower: ack for every forwarded write up to @param id. */
+void repl_acked(uint64_t id) {
+    pthread_mutex_lock(&forward_mutex);
+    if (id > acked_id) {
+        acked_id = id;
+    }
+    pthread_cond_broadcast(&forward_cond);
+    pthread_mutex_unlock(&forward_mutex);
+}
+
+// the whole record or nothing usable, blocking
+static int repl_send(int fd, const struct iovec* parts, int num_parts) {
+    struct iovec iov[3];
+    struct msghdr msg;
+    ssize_t num_bytes;
+    int i;
+
+    memcpy(iov, parts, num_parts * sizeof(struct iovec));
+    i = 0;
+    while (i < num_parts) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov + i;
+        msg.msg_iovlen = num_parts - i;
+
+        num_bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (num_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            return -1;
+        }
+
+        while (i < num_parts && (size_t) num_bytes >= iov[i].iov_len) {
+            num_bytes -= iov[i].iov_len;
+            i++;
+        }
+        if (i < num_parts) {
+            iov[i].iov_base = (char*) iov[i].iov_base + num_bytes;
+            iov[i].iov_len -= num_bytes;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Follower: has the primary append @param len bytes of packets and waits
+ * until the append came back on the stream, so a read of the local copy
+ * right after includes it.
+ * @return 0 once applied, -1 without a primary or if it went away
+ */
+int repl_forward(const char* buf, size_t len) {
+    char header[FRAME_HEADER_LEN];
+    struct iovec parts[3];
+    uint64_t id;
+    uint64_t my_generation;
+    int status = 0;
+    int fd;
+
+    pthread_mutex_lock(&send_mutex);
+    pthread_mutex_lock(&forward_mutex);
+    fd = primary_fd;
+    id = ++next_id;
+    my_generation = generation;
+    pthread_mutex_unlock(&forward_mutex);
+
+    if (fd == -1) {
+        pthread_mutex_unlock(&send_mutex);
+        return -1;
+    }
+
+    frame_encode_header(header, REPL_WRITE, REPL_ID_LEN + len);
+    parts[0].iov_base = header;
+    parts[0].iov_len = FRAME_HEADER_LEN;
+    parts[1].iov_base = &id;
+    parts[1].iov_len = REPL_ID_LEN;
+    parts[2].iov_base = (void*) buf;
+    parts[2].iov_len = len;
+    status = repl_send(fd, parts, 3);
+    pthread_mutex_unlock(&send_mutex);
+
+    if (status != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&forward_mutex);
+    while (acked_id < id && generation == my_generation) {
+        pthread_cond_wait(&forward_cond, &forward_mutex);
+    }
+    status = (acked_id >= id && generation == my_generation) ? 0 : -1;
+    pthread_mutex_unlock(&forward_mutex);
+    return status;
+}
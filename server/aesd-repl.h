@@ -0,0 +1,103 @@
+/*
+ * aesd-repl.h
+ *
+ * Read replicas for aesdsocket on the same host.  The primary (-S path)
+ * listens on a Unix socket for followers; a follower (-F path) connects,
+ * keeps its own in-memory copy of the history, in the in-process backend
+ * with the primary's semantics (storage ops replica), and answers clients on its
+ * own port (-p).  Queries and the history sent back in replies come from
+ * the follower's copy, so reply generation scales with the number of
+ * followers, while every append is still made, in order, by the primary.
+ *
+ * The stream uses the record header of aesd-frame.h (type, big endian
+ * length).  Primary to follower:
+ *   REPL_HELLO    - name of the backend the follower's copy has to use,
+ *                   starts a new copy next to the one clients read
+ *   REPL_SNAPSHOT - the next piece of the history, at most
+ *                   REPL_SNAPSHOT_CHUNK bytes, appended to the new copy
+ *   REPL_SNAPSHOT_END - the new copy is complete and replaces the old one
+ *   REPL_APPEND   - bytes appended to storage, in storage order
+ *   REPL_ACK      - 8 byte id of a forwarded write; sent after the append
+ *                   it caused, so the follower's copy already has it
+ * Follower to primary:
+ *   REPL_WRITE    - 8 byte id then packets a follower's client sent
+ * Ids are in host byte order, both ends are on one host.  The snapshot is
+ * cut into records as the socket takes them and does not count against
+ * REPL_MAX_QUEUED, which only bounds what queued up behind it.
+ */
+
+#ifndef AESD_REPL_H
+#define AESD_REPL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "aesd-outq.h"
+#include "aesd-frame.h"
+
+#define REPL_HELLO 'H'
+#define REPL_SNAPSHOT 'S'
+#define REPL_SNAPSHOT_END 'E'
+#define REPL_APPEND 'A'
+#define REPL_ACK 'K'
+#define REPL_WRITE 'W'
+#define REPL_ID_LEN 8
+#define REPL_MAX_QUEUED (64 * 1024 * 1024) // a follower further behind is dropped and resyncs
+#define REPL_RETRY_MS 1000 // follower reconnect interval
+#define REPL_SNAPSHOT_CHUNK (1024 * 1024) // bytes of history per REPL_SNAPSHOT record
+
+/* Primary side state of one follower, its queue is guarded by the repl lock */
+struct repl_follower {
+    int fd;
+    int wake_fd; // eventfd, written when records were queued
+    struct aesd_outq sync_outq; // hello and snapshot records, sent before outq
+    char* snapshot; // history still to be cut into sync_outq, NULL once it is all queued
+    size_t snapshot_len;
+    size_t snapshot_pos;
+    struct aesd_outq outq; // appends and acks
+    bool overflow; // fell more than REPL_MAX_QUEUED behind
+    LIST_ENTRY(repl_follower) entries;
+};
+
+/* Reassembles records from a stream */
+struct repl_reader {
+    char header[FRAME_HEADER_LEN];
+    size_t header_pos;
+    char* buf; // payload, NULL while the header is incomplete
+    size_t len;
+    size_t pos;
+};
+
+int repl_listen(const char* path);
+
+int repl_connect(const char* path);
+
+int repl_read(int fd, struct repl_reader* reader);
+
+void repl_reader_reset(struct repl_reader* reader);
+
+// primary
+int repl_follower_add(struct repl_follower* follower, int fd, const char* backend, char* snapshot, size_t len);
+
+void repl_follower_remove(struct repl_follower* follower);
+
+void repl_publish(const char* buf, size_t len);
+
+int repl_ack(struct repl_follower* follower, uint64_t id);
+
+ssize_t repl_flush(struct repl_follower* follower);
+
+bool repl_pending(struct repl_follower* follower);
+
+// follower
+void repl_attach(int fd);
+
+void repl_detach(void);
+
+int repl_forward(const char* buf, size_t len);
+
+void repl_acked(uint64_t id);
+
+#endif /* AESD_REPL_H */
@@ -0,0 +1,190 @@
+/*
+ * aesd-shm-client.c
+ *
+ * Local aesdsocket client over the shared memory transport (aesdsocket -u).
+ * Sends each argument, or each line of stdin, as one packet and prints the
+ * reply, which is the full history just like over TCP.  With -n the packets
+ * are sent count times and only the request rate is printed.
+ *
+ * Usage: aesd-shm-client [-u socket_path] [-n count] [packet...]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "aesd-shm.h"
+
+#define READ_CHUNK 4096
+
+static uint64_t awaited_reply; // number of the reply read_reply() is waiting for
+
+// sleep until the server wakes us or goes away, false if it went away
+static bool client_wait(struct aesd_shm_conn* conn, bool (*ready)(struct aesd_shm_conn* conn)) {
+    struct aesd_shm_header* header = conn->header;
+    struct pollfd pfds[2];
+    int status;
+
+    shm_begin_wait(&header->client_waiting);
+    if (ready(conn)) {
+        shm_end_wait(&header->client_waiting, conn->client_efd);
+        return true;
+    }
+
+    pfds[0].fd = conn->client_efd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = conn->sock_fd;
+    pfds[1].events = POLLIN;
+    status = poll(pfds, 2, -1);
+    shm_end_wait(&header->client_waiting, conn->client_efd);
+
+    if (status == -1 && errno != EINTR) {
+        perror("poll");
+        return false;
+    }
+    return !(status > 0 && pfds[1].revents != 0);
+}
+
+static bool req_space(struct aesd_shm_conn* conn) {
+    return shm_ring_used(&conn->req) != conn->req.size;
+}
+
+// the count matters too, the last bytes may have been read before it was published
+static bool resp_ready(struct aesd_shm_conn* conn) {
+    return shm_ring_used(&conn->resp) > 0 ||
+           atomic_load_explicit(&conn->header->replies, memory_order_acquire) >= awaited_reply;
+}
+
+static int send_packet(struct aesd_shm_conn* conn, const char* buf, size_t len) {
+    struct aesd_shm_header* header = conn->header;
+    ssize_t num_bytes;
+
+    while (len > 0) {
+        num_bytes = shm_ring_write(conn, &conn->req, buf, len);
+        if (num_bytes == -1) {
+            printf("Server corrupted the request ring\n");
+            return -1;
+        }
+        if (num_bytes > 0) {
+            shm_notify(&header->server_waiting, conn->server_efd);
+            buf += num_bytes;
+            len -= num_bytes;
+        }
+        else if (!client_wait(conn, req_space)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// reads reply bytes until reply number expected is complete
+static int read_reply(struct aesd_shm_conn* conn, uint64_t expected, bool print) {
+    struct aesd_shm_header* header = conn->header;
+    char buf[READ_CHUNK];
+    uint64_t replies;
+    ssize_t num_bytes;
+
+    awaited_reply = expected;
+    for (;;) {
+        // bytes of every reply counted here are already in the ring
+        replies = atomic_load_explicit(&header->replies, memory_order_acquire);
+
+        while ((num_bytes = shm_ring_read(conn, &conn->resp, buf, sizeof(buf))) > 0) {
+            shm_notify(&header->server_waiting, conn->server_efd);
+            if (print) {
+                fwrite(buf, 1, num_bytes, stdout);
+            }
+        }
+        if (num_bytes == -1) {
+            printf("Server corrupted the reply ring\n");
+            return -1;
+        }
+
+        if (replies >= expected) {
+            return 0;
+        }
+        if (!client_wait(conn, resp_ready)) {
+            return -1;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* path = DEFAULT_SHM_SOCKET_PATH;
+    struct aesd_shm_conn conn;
+    struct timespec start;
+    struct timespec end;
+    uint64_t sent = 0;
+    long count = 0;
+    long i;
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    char packet[READ_CHUNK];
+    int opt;
+    int arg;
+
+    while ((opt = getopt(argc, argv, "u:n:")) != -1) {
+        switch (opt) {
+        case 'u':
+            path = optarg;
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        default:
+            printf("Usage: %s [-u socket_path] [-n count] [packet...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (shm_connect(path, &conn) != 0) {
+        return 1;
+    }
+
+    if (count > 0) {
+        if (optind == argc) {
+            printf("-n needs a packet to send\n");
+            shm_close(&conn);
+            return 1;
+        }
+        snprintf(packet, sizeof(packet), "%s\n", argv[optind]);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < count; i++) {
+            if (send_packet(&conn, packet, strlen(packet)) != 0 || read_reply(&conn, ++sent, false) != 0) {
+                break;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        printf("%ld requests in %.3f s\n", i,
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    else if (optind < argc) {
+        for (arg = optind; arg < argc; arg++) {
+            snprintf(packet, sizeof(packet), "%s\n", argv[arg]);
+            if (send_packet(&conn, packet, strlen(packet)) != 0 || read_reply(&conn, ++sent, true) != 0) {
+                break;
+            }
+        }
+    }
+    else {
+        while ((line_len = getline(&line, &line_size, stdin)) != -1) {
+            if (line[line_len - 1] != '\n') {
+                continue; // the server only answers complete packets
+            }
+            if (send_packet(&conn, line, line_len) != 0 || read_reply(&conn, ++sent, true) != 0) {
+                break;
+            }
+        }
+        free(line);
+    }
+
+    shm_close(&conn);
+    return 0;
+}
@@ -0,0 +1,371 @@
+#define _GNU_SOURCE // memfd_create, F_ADD_SEALS
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "aesd-shm.h"
+
+#define SHM_FDS 3 // memfd, server eventfd, client eventfd
+
+static size_t shm_map_size(void) {
+    // each ring's data starts on its own page
+    long page_size = sysconf(_SC_PAGESIZE);
+    return page_size + 2 * AESD_SHM_RING_SIZE;
+}
+
+// fixed layout, both sides derive it instead of trusting the header
+static void shm_init_views(struct aesd_shm_conn* conn, bool server) {
+    conn->req.ring = &conn->header->req;
+    conn->req.offset = conn->map_size - 2 * AESD_SHM_RING_SIZE;
+    conn->req.size = AESD_SHM_RING_SIZE;
+    conn->req.pos = 0;
+    conn->req.producer = !server;
+
+    conn->resp.ring = &conn->header->resp;
+    conn->resp.offset = conn->map_size - AESD_SHM_RING_SIZE;
+    conn->resp.size = AESD_SHM_RING_SIZE;
+    conn->resp.pos = 0;
+    conn->resp.producer = server;
+}
+
+/**
+ * Creates the Unix socket local clients connect to at @param path,
+ * replacing a stale socket file left behind by a previous run.  Only our
+ * own user may connect.
+ * @return listening fd, or -1 on error
+ */
+int shm_listen(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    // before listen, nobody can have connected yet
+    if (chmod(path, S_IRUSR | S_IWUSR) == -1) {
+        perror("chmod");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    if (listen(fd, 10) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Accepts one client on @param listen_fd, sets up the shared rings and hands
+ * the client the memfd and both eventfds.
+ * @return 0 on success, -1 on error (conn is left closed)
+ */
+int shm_accept(int listen_fd, struct aesd_shm_conn* conn) {
+    struct aesd_shm_header* header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char cmsg_buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    char version = AESD_SHM_VERSION;
+    int fds[SHM_FDS];
+    int mem_fd;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->server_efd = -1;
+    conn->client_efd = -1;
+    conn->map_size = shm_map_size();
+
+    conn->sock_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn->sock_fd == -1) {
+        return -1;
+    }
+
+    mem_fd = memfd_create("aesdsocket", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mem_fd == -1) {
+        perror("memfd_create");
+        goto error;
+    }
+    if (ftruncate(mem_fd, conn->map_size) == -1) {
+        perror("ftruncate");
+        goto error;
+    }
+    // a client shrinking the memfd would fault the server on its next ring access
+    if (fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        perror("fcntl");
+        goto error;
+    }
+
+    header = mmap(NULL, conn->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        goto error;
+    }
+    conn->header = header;
+    shm_init_views(conn, true);
+
+    // the memfd starts zeroed, only the layout needs filling in, for the client's information
+    header->magic = AESD_SHM_MAGIC;
+    header->version = AESD_SHM_VERSION;
+    header->req.size = conn->req.size;
+    header->req.offset = conn->req.offset;
+    header->resp.size = conn->resp.size;
+    header->resp.offset = conn->resp.offset;
+
+    conn->server_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    conn->client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (conn->server_efd == -1 || conn->client_efd == -1) {
+        perror("eventfd");
+        goto error;
+    }
+
+    // one byte of payload carrying the three fds
+    fds[0] = mem_fd;
+    fds[1] = conn->server_efd;
+    fds[2] = conn->client_efd;
+
+    iov.iov_base = &version;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(conn->sock_fd, &msg, MSG_NOSIGNAL) != 1) {
+        perror("sendmsg");
+        goto error;
+    }
+
+    // the mapping keeps the memory alive
+    close(mem_fd);
+    return 0;
+
+ error:
+    if (mem_fd != -1) {
+        close(mem_fd);
+    }
+    shm_close(conn);
+    return -1;
+}
+
+/**
+ * Connects to the server's Unix socket at @param path and maps the rings it hands out.
+ * @return 0 on success, -1 on error
+ */
+int shm_connect(const char* path, struct aesd_shm_conn* conn) {
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char cmsg_buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    char version;
+    int fds[SHM_FDS];
+
+    memset(conn, 0, sizeof(*conn));
+    conn->server_efd = -1;
+    conn->client_efd = -1;
+    conn->map_size = shm_map_size();
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s too long\n", path);
+        return -1;
+    }
+
+    conn->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->sock_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(conn->sock_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        goto error;
+    }
+
+    iov.iov_base = &version;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    if (recvmsg(conn->sock_fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        perror("recvmsg");
+        goto error;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (version != AESD_SHM_VERSION || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        printf("Unexpected handshake from %s\n", path);
+        goto error;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    conn->server_efd = fds[1];
+    conn->client_efd = fds[2];
+
+    conn->header = mmap(NULL, conn->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (conn->header == MAP_FAILED) {
+        perror("mmap");
+        conn->header = NULL;
+        goto error;
+    }
+    if (conn->header->magic != AESD_SHM_MAGIC) {
+        printf("Bad shared memory header from %s\n", path);
+        goto error;
+    }
+    shm_init_views(conn, false);
+    return 0;
+
+ error:
+    shm_close(conn);
+    return -1;
+}
+
+void shm_close(struct aesd_shm_conn* conn) {
+    if (conn->header != NULL) {
+        munmap(conn->header, conn->map_size);
+        conn->header = NULL;
+    }
+    if (conn->server_efd != -1) {
+        close(conn->server_efd);
+        conn->server_efd = -1;
+    }
+    if (conn->client_efd != -1) {
+        close(conn->client_efd);
+        conn->client_efd = -1;
+    }
+    if (conn->sock_fd != -1) {
+        close(conn->sock_fd);
+        conn->sock_fd = -1;
+    }
+}
+
+/**
+ * Copies as much of @param buf as fits into the ring of @param view, the caller must be its producer.
+ * @return bytes copied, or -1 if the peer corrupted the ring
+ */
+ssize_t shm_ring_write(struct aesd_shm_conn* conn, struct aesd_shm_view* view, const char* buf, size_t len) {
+    char* data = (char*) conn->header + view->offset;
+    uint64_t head = view->pos;
+    uint64_t tail = atomic_load_explicit(&view->ring->tail, memory_order_acquire);
+    size_t used = head - tail;
+    size_t pos = head & (view->size - 1);
+    size_t first;
+
+    // also catches a tail past the head, the difference wraps around
+    if (used > view->size) {
+        return -1;
+    }
+    if (len > view->size - used) {
+        len = view->size - used;
+    }
+
+    // at most two copies, around the end of the ring
+    first = view->size - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(data + pos, buf, first);
+    memcpy(data, buf + first, len - first);
+
+    view->pos = head + len;
+    atomic_store_explicit(&view->ring->head, view->pos, memory_order_release);
+    return len;
+}
+
+/**
+ * Copies up to @param len bytes out of the ring of @param view, the caller must be its consumer.
+ * @return bytes copied, or -1 if the peer corrupted the ring
+ */
+ssize_t shm_ring_read(struct aesd_shm_conn* conn, struct aesd_shm_view* view, char* buf, size_t len) {
+    const char* data = (const char*) conn->header + view->offset;
+    uint64_t tail = view->pos;
+    uint64_t head = atomic_load_explicit(&view->ring->head, memory_order_acquire);
+    size_t used = head - tail;
+    size_t pos = tail & (view->size - 1);
+    size_t first;
+
+    if (used > view->size) {
+        return -1;
+    }
+    if (len > used) {
+        len = used;
+    }
+
+    first = view->size - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(buf, data + pos, first);
+    memcpy(buf + first, data, len - first);
+
+    view->pos = tail + len;
+    atomic_store_explicit(&view->ring->tail, view->pos, memory_order_release);
+    return len;
+}
+
+/* Wakes the peer through @param efd, only if it announced a sleep in @param waiting. */
+void shm_notify(_Atomic uint32_t* waiting, int efd) {
+    uint64_t one = 1;
+
+    // pairs with the fence in shm_begin_wait, either the peer sees our ring update or we see its flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed)) {
+        if (write(efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("eventfd write");
+        }
+    }
+}
+
+/* Announces a sleep, the caller must re-check the rings before actually polling its eventfd. */
+void shm_begin_wait(_Atomic uint32_t* waiting) {
+    atomic_store_explicit(waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void shm_end_wait(_Atomic uint32_t* waiting, int efd) {
+    uint64_t count;
+
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+    // clear the counter so the next poll does not return early
+    if (read(efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ * aesd-shm.h
+ *
+ * Shared memory transport for aesdsocket clients on the same host.  A client
+ * connects to the server's Unix socket and receives, via SCM_RIGHTS, a memfd
+ * holding two byte rings plus one eventfd per side:
+ *   req  - packets, client to server, same byte stream as the TCP protocol
+ *   resp - replies, server to client, each one the full history as over TCP
+ * Each side writes the other's eventfd only when the other side said it is
+ * about to sleep, so a busy connection moves data without syscalls.  The
+ * Unix socket stays open for the life of the connection, closing it
+ * disconnects.
+ *
+ * The peer can write anything into the mapping, so each side keeps the ring
+ * layout and its own index in a private struct aesd_shm_view and treats the
+ * shared copies as untrusted.  The Unix socket is only accessible to the
+ * server's user.
+ */
+
+#ifndef AESD_SHM_H
+#define AESD_SHM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define AESD_SHM_MAGIC 0x41455344 // "AESD"
+#define AESD_SHM_VERSION 1
+#define AESD_SHM_RING_SIZE (1024 * 1024) // bytes per direction, power of 2
+#define DEFAULT_SHM_SOCKET_PATH "/tmp/aesdsocket.sock"
+
+struct aesd_shm_ring {
+    _Alignas(64) _Atomic uint64_t head; // bytes written, owned by the producer
+    _Alignas(64) _Atomic uint64_t tail; // bytes read, owned by the consumer
+    uint32_t size;
+    uint32_t offset; // of the data from the start of the mapping
+};
+
+struct aesd_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    struct aesd_shm_ring req;
+    struct aesd_shm_ring resp;
+    _Alignas(64) _Atomic uint64_t replies; // replies completely written to resp
+    _Atomic uint32_t server_waiting; // server is about to sleep on its eventfd
+    _Atomic uint32_t client_waiting; // client is about to sleep on its eventfd
+};
+
+/* One side's private view of a ring */
+struct aesd_shm_view {
+    struct aesd_shm_ring* ring;
+    size_t offset; // of the data from the start of the mapping
+    size_t size;
+    uint64_t pos; // our index: head if we produce, tail if we consume
+    bool producer;
+};
+
+struct aesd_shm_conn {
+    int sock_fd; // Unix socket, hangup means the peer is gone
+    int server_efd; // written by the client to wake the server
+    int client_efd; // written by the server to wake the client
+    struct aesd_shm_header* header;
+    size_t map_size;
+    struct aesd_shm_view req;
+    struct aesd_shm_view resp;
+};
+
+int shm_listen(const char* path);
+
+int shm_accept(int listen_fd, struct aesd_shm_conn* conn);
+
+int shm_connect(const char* path, struct aesd_shm_conn* conn);
+
+void shm_close(struct aesd_shm_conn* conn);
+
+ssize_t shm_ring_write(struct aesd_shm_conn* conn, struct aesd_shm_view* view, const char* buf, size_t len);
+
+ssize_t shm_ring_read(struct aesd_shm_conn* conn, struct aesd_shm_view* view, char* buf, size_t len);
+
+void shm_notify(_Atomic uint32_t* waiting, int efd);
+
+void shm_begin_wait(_Atomic uint32_t* waiting);
+
+void shm_end_wait(_Atomic uint32_t* waiting, int efd);
+
+// more than view->size when the peer corrupted its index, the next read or write fails then
+static inline size_t shm_ring_used(struct aesd_shm_view* view) {
+    if (view->producer) {
+        return view->pos - atomic_load_explicit(&view->ring->tail, memory_order_acquire);
+    }
+    return atomic_load_explicit(&view->ring->head, memory_order_acquire) - view->pos;
+}
+
+#endif /* AESD_SHM_H */
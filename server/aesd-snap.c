@@ -0,0 +1,488 @@
+#define _GNU_SOURCE // memmem
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include "aesd-snap.h"
+
+#define COPY_CHUNK (64 * 1024)
+#define CRC_POLY 0xEDB88320 // CRC-32 as in zlib, reflected
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    uint32_t crc;
+    int i;
+    int bit;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+// continues crc (0 to start) over len bytes of buf
+static uint32_t crc_update(uint32_t crc, const void* buf, size_t len) {
+    const unsigned char* pos = buf;
+
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    while (len-- > 0) {
+        crc = crc_table[(crc ^ *pos++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static int write_all(int fd, const void* buf, size_t len) {
+    const char* pos = buf;
+    ssize_t num_bytes;
+
+    while (len > 0) {
+        num_bytes = write(fd, pos, len);
+        if (num_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += num_bytes;
+        len -= num_bytes;
+    }
+    return 0;
+}
+
+// the chunk header at pos if there is one and all of its data, into header
+static bool chunk_valid(const char* addr, size_t size, size_t pos, struct snap_chunk_header* header) {
+    uint32_t crc;
+
+    if (size - pos < sizeof(*header)) {
+        return false;
+    }
+    memcpy(header, addr + pos, sizeof(*header));
+    if (memcmp(header->magic, SNAP_MAGIC, SNAP_MAGIC_LEN) != 0) {
+        return false;
+    }
+    crc = header->header_crc;
+    header->header_crc = 0;
+    if (crc_update(0, header, sizeof(*header)) != crc) {
+        return false;
+    }
+    header->header_crc = crc;
+    return header->offset == pos && header->data_len <= size - pos - sizeof(*header);
+}
+
+/*
+ * Whether a chunk found past damage can be taken as the next one.  The
+ * damaged chunk's data is client data that may hold anything, including a
+ * well formed header, but not the file's id, which clients never see.
+ */
+static bool resync_valid(const char* addr, const struct snap_map* map, size_t pos, const struct snap_chunk_header* header) {
+    if (header->file_id != map->file_id || header->seq <= map->seq) {
+        return false;
+    }
+    return crc_update(0, addr + pos + sizeof(*header), header->data_len) == header->data_crc;
+}
+
+static int add_chunk(struct snap_map* map, const struct snap_chunk* chunk) {
+    struct snap_chunk* chunks;
+
+    // grows by powers of 2
+    if ((map->num_chunks & (map->num_chunks - 1)) == 0) {
+        chunks = realloc(map->chunks, (map->num_chunks == 0 ? 1 : map->num_chunks * 2) * sizeof(struct snap_chunk));
+        if (chunks == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        map->chunks = chunks;
+    }
+
+    map->chunks[map->num_chunks++] = *chunk;
+    map->data_len += chunk->data_len;
+    if (chunk->seq > map->seq) {
+        map->seq = chunk->seq;
+    }
+    return 0;
+}
+
+// walks the chunks of the mapping in map, returns where the good part ends
+static size_t walk_chunks(const char* path, struct snap_map* map, size_t size) {
+    struct snap_chunk_header header;
+    struct snap_chunk chunk;
+    const char* addr = map->addr;
+    const char* found;
+    size_t pos = 0;
+    size_t next;
+
+    while (pos < size) {
+        if (chunk_valid(addr, size, pos, &header) && (pos == 0 || header.file_id == map->file_id)) {
+            map->file_id = header.file_id;
+            chunk.data = addr + pos + sizeof(header);
+            chunk.data_len = header.data_len;
+            chunk.data_crc = header.data_crc;
+            chunk.seq = header.seq;
+            if (add_chunk(map, &chunk) != 0) {
+                return (size_t) -1;
+            }
+            pos += sizeof(header) + header.data_len;
+            continue;
+        }
+
+        // without the file's id nothing past the damage can be trusted
+        if (pos == 0) {
+            printf("Snapshot %s is damaged at its start\n", path);
+            return (size_t) -1;
+        }
+
+        // the next good chunk, with none this is the torn end of an append
+        found = NULL;
+        next = pos + 1;
+        while (next < size && (found = memmem(addr + next, size - next, SNAP_MAGIC, SNAP_MAGIC_LEN)) != NULL) {
+            next = found - addr;
+            if (chunk_valid(addr, size, next, &header) && resync_valid(addr, map, next, &header)) {
+                break;
+            }
+            found = NULL;
+            next++;
+        }
+        if (found == NULL) {
+            break;
+        }
+        printf("Skipping %zu damaged bytes of snapshot %s\n", next - pos, path);
+        pos = next;
+    }
+    return pos;
+}
+
+/**
+ * Maps the snapshot at @param path into @param map, checking the chunk
+ * headers and cutting off a torn last chunk.  A missing snapshot loads as an
+ * empty one.
+ * @return 0 on success, -1 if the snapshot cannot be read
+ */
+int snap_load(const char* path, struct snap_map* map) {
+    struct stat st;
+    size_t valid_len;
+    int fd;
+
+    memset(map, 0, sizeof(*map));
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("open");
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        goto error;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    map->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->addr == MAP_FAILED) {
+        perror("mmap");
+        map->addr = NULL;
+        goto error;
+    }
+    map->map_len = st.st_size;
+
+    valid_len = walk_chunks(path, map, st.st_size);
+    if (valid_len == (size_t) -1) {
+        goto error;
+    }
+
+    // the torn chunk's segment is still on disk, shrinking in place keeps the chunks valid
+    if (valid_len < (size_t) st.st_size) {
+        printf("Cutting %zu bytes of a torn chunk from snapshot %s\n", st.st_size - valid_len, path);
+        if (ftruncate(fd, valid_len) == -1) {
+            perror("ftruncate");
+            goto error;
+        }
+        if (valid_len == 0) {
+            snap_unload(map);
+        } else if (mremap(map->addr, map->map_len, valid_len, 0) == MAP_FAILED) {
+            perror("mremap");
+            goto error;
+        } else {
+            map->map_len = valid_len;
+        }
+    }
+
+    close(fd);
+    return 0;
+
+error:
+    close(fd);
+    snap_unload(map);
+    return -1;
+}
+
+void snap_unload(struct snap_map* map) {
+    if (map->addr != NULL) {
+        munmap(map->addr, map->map_len);
+    }
+    free(map->chunks);
+    memset(map, 0, sizeof(*map));
+}
+
+// copies len bytes of fd to out_fd, continuing *crc over them
+static int copy_segment(int fd, size_t len, int out_fd, uint32_t* crc) {
+    char* buf;
+    size_t pos = 0;
+    ssize_t num_bytes;
+    int status = 0;
+
+    buf = malloc(COPY_CHUNK);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    while (status == 0 && pos < len) {
+        num_bytes = pread(fd, buf, (len - pos < COPY_CHUNK) ? len - pos : COPY_CHUNK, pos);
+        if (num_bytes == -1 && errno == EINTR)
+            continue;
+        if (num_bytes <= 0) {
+            perror("pread");
+            status = -1;
+            break;
+        }
+        *crc = crc_update(*crc, buf, num_bytes);
+        status = write_all(out_fd, buf, num_bytes);
+        if (status == -1) {
+            perror("write");
+        }
+        pos += num_bytes;
+    }
+
+    free(buf);
+    return status;
+}
+
+// makes a rename in path's directory durable
+static int sync_dir(const char* path) {
+    char dir_path[PATH_MAX];
+    int fd;
+    int status;
+
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    status = fsync(fd);
+    if (status == -1) {
+        perror("fsync");
+    }
+    close(fd);
+    return status;
+}
+
+// maps fd again as base plus one chunk, base was checked already so the file is not walked again
+static int extend_map(int fd, const struct snap_map* base, const struct snap_chunk_header* header, struct snap_map* map) {
+    struct snap_chunk chunk;
+    size_t i;
+
+    memset(map, 0, sizeof(*map));
+    map->file_id = header->file_id;
+    map->map_len = base->map_len + sizeof(*header) + header->data_len;
+    map->addr = mmap(NULL, map->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->addr == MAP_FAILED) {
+        perror("mmap");
+        map->addr = NULL;
+        return -1;
+    }
+
+    for (i = 0; i < base->num_chunks; i++) {
+        chunk = base->chunks[i];
+        chunk.data = (const char*) map->addr + (chunk.data - (const char*) base->addr);
+        if (add_chunk(map, &chunk) != 0) {
+            goto error;
+        }
+    }
+    chunk.data = (const char*) map->addr + base->map_len + sizeof(*header);
+    chunk.data_len = header->data_len;
+    chunk.data_crc = header->data_crc;
+    chunk.seq = header->seq;
+    if (add_chunk(map, &chunk) != 0) {
+        goto error;
+    }
+    return 0;
+
+error:
+    snap_unload(map);
+    return -1;
+}
+
+/**
+ * Appends the first @param segment_len bytes of the log segment
+ * @param segment_fd, number @param seq, as a chunk after @param base and maps
+ * the result into @param map_rtn.  @param base stays valid, its part of the
+ * file is not touched.
+ * @return 0 on success, -1 on error
+ */
+int snap_append(const char* path, const struct snap_map* base, int segment_fd, size_t segment_len, uint64_t seq, struct snap_map* map_rtn) {
+    struct snap_chunk_header header;
+    uint32_t crc = 0;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    // drops what a failed append left, the header goes in once the data is written
+    if (ftruncate(fd, base->map_len) == -1 || lseek(fd, base->map_len + sizeof(header), SEEK_SET) == -1) {
+        perror("ftruncate");
+        goto error;
+    }
+    if (copy_segment(segment_fd, segment_len, fd, &crc) != 0) {
+        goto error;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAP_MAGIC, SNAP_MAGIC_LEN);
+    header.data_crc = crc;
+    header.seq = seq;
+    header.offset = base->map_len;
+    header.file_id = base->file_id;
+    if (base->map_len == 0 && getrandom(&header.file_id, sizeof(header.file_id), 0) != sizeof(header.file_id)) {
+        perror("getrandom");
+        goto error;
+    }
+    header.data_len = segment_len;
+    header.header_crc = crc_update(0, &header, sizeof(header));
+    if (pwrite(fd, &header, sizeof(header), base->map_len) != sizeof(header)) {
+        perror("pwrite");
+        goto error;
+    }
+
+    if (fsync(fd) == -1) {
+        perror("fsync");
+        goto error;
+    }
+    // a new file needs its directory entry on disk too
+    if (base->map_len == 0 && sync_dir(path) != 0) {
+        goto error;
+    }
+    if (extend_map(fd, base, &header, map_rtn) != 0) {
+        goto error;
+    }
+    close(fd);
+    return 0;
+
+error:
+    close(fd);
+    return -1;
+}
+
+/**
+ * Rewrites the chunks of @param base as one, checking their data on the way,
+ * and maps the result into @param map_rtn.  A chunk with bad data is dropped.
+ * The new file is mapped before it is renamed over @param path, so once the
+ * rename is done nothing can fail and @param base is not needed any more.
+ * @return 0 on success, -1 on error with @param path left as it was and
+ * @param base still valid
+ */
+int snap_compact(const char* path, const struct snap_map* base, struct snap_map* map_rtn) {
+    char tmp_path[PATH_MAX];
+    struct snap_chunk_header header;
+    const struct snap_chunk* chunk;
+    struct snap_map empty;
+    uint32_t crc = 0;
+    size_t data_len = 0;
+    size_t i;
+    int fd;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        printf("Snapshot path %s too long\n", path);
+        return -1;
+    }
+
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (lseek(fd, sizeof(header), SEEK_SET) == -1) {
+        perror("lseek");
+        goto error;
+    }
+
+    for (i = 0; i < base->num_chunks; i++) {
+        chunk = &base->chunks[i];
+        if (crc_update(0, chunk->data, chunk->data_len) != chunk->data_crc) {
+            printf("Dropping %zu damaged bytes of segment %llu from snapshot %s\n", chunk->data_len,
+                   (unsigned long long) chunk->seq, path);
+            continue;
+        }
+        if (write_all(fd, chunk->data, chunk->data_len) == -1) {
+            perror("write");
+            goto error;
+        }
+        crc = crc_update(crc, chunk->data, chunk->data_len);
+        data_len += chunk->data_len;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAP_MAGIC, SNAP_MAGIC_LEN);
+    header.data_crc = crc;
+    header.seq = base->seq;
+    header.offset = 0;
+    header.file_id = base->file_id;
+    header.data_len = data_len;
+    header.header_crc = crc_update(0, &header, sizeof(header));
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("pwrite");
+        goto error;
+    }
+
+    if (fsync(fd) == -1) {
+        perror("fsync");
+        goto error;
+    }
+    // the file was just written, it is mapped as it is rather than walked
+    memset(&empty, 0, sizeof(empty));
+    if (extend_map(fd, &empty, &header, map_rtn) != 0) {
+        goto error;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) == -1) {
+        perror("rename");
+        snap_unload(map_rtn);
+        unlink(tmp_path);
+        return -1;
+    }
+    // the new file is in place either way, a lost rename only brings back the old one
+    if (sync_dir(path) != 0) {
+        printf("Compacted snapshot %s may not survive a crash\n", path);
+    }
+    return 0;
+
+error:
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+}
@@ -0,0 +1,76 @@
+/*
+ * aesd-snap.h
+ *
+ * Snapshots of the file backend's history, for keeping it across restarts
+ * (aesdsocket -k).  A snapshot file is a run of chunks, one per log segment
+ * it took in:
+ *   header - magic, header and data checksums, sequence number, offset,
+ *            file id, length
+ *   data   - the segment's records
+ * Taking in a segment appends and syncs one chunk, so it costs the size of
+ * the segment, not of the history.  Once SNAP_COMPACT_CHUNKS chunks piled
+ * up they are rewritten as one into a new file renamed over the old one,
+ * which is also when their data checksums are checked; a chunk that fails
+ * is dropped with an error rather than stopping later snapshots.
+ *
+ * On startup the file is mapped, not read, and only the chunk headers are
+ * checked, so loading does not depend on the size of the history.  A torn
+ * last chunk from a crash is cut off, its segment is still on disk.  A
+ * damaged header elsewhere is skipped up to the next chunk that sits at its
+ * own offset, carries the file's random id, follows the last good one and
+ * whose data checksum matches, so a header forged inside client data is not
+ * taken for one.  A damaged first header leaves no id to check against and
+ * fails the load instead.
+ *
+ * There is no record index, nothing in the server reads single records.
+ * Everything is in host byte order, snapshots are not meant to move hosts.
+ */
+
+#ifndef AESD_SNAP_H
+#define AESD_SNAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAP_MAGIC "AESDSNP3"
+#define SNAP_MAGIC_LEN 8
+#define SNAP_COMPACT_CHUNKS 32
+#define DEFAULT_SNAPSHOT_INTERVAL_S 60
+
+struct snap_chunk_header {
+    char magic[SNAP_MAGIC_LEN];
+    uint32_t header_crc; // covers the header with this field 0
+    uint32_t data_crc;
+    uint64_t seq; // of the log segment in the chunk
+    uint64_t offset; // of the header in the file
+    uint64_t file_id; // random, the same in all chunks of a file
+    uint64_t data_len;
+};
+
+struct snap_chunk {
+    const char* data;
+    size_t data_len;
+    uint32_t data_crc;
+    uint64_t seq;
+};
+
+/* A loaded snapshot, all zero when there is none */
+struct snap_map {
+    void* addr;
+    size_t map_len; // valid part of the file, the next chunk goes here
+    uint64_t seq; // log segments up to seq are in the snapshot
+    uint64_t file_id;
+    struct snap_chunk* chunks;
+    size_t num_chunks;
+    size_t data_len; // of all chunks
+};
+
+int snap_load(const char* path, struct snap_map* map);
+
+void snap_unload(struct snap_map* map);
+
+int snap_append(const char* path, const struct snap_map* base, int segment_fd, size_t segment_len, uint64_t seq, struct snap_map* map_rtn);
+
+int snap_compact(const char* path, const struct snap_map* base, struct snap_map* map_rtn);
+
+#endif /* AESD_SNAP_H */
@@ -0,0 +1,598 @@
+#define _GNU_SOURCE // memrchr
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "aesd-storage.h"
+
+#define READ_CHUNK 4096
+
+// write all of buf, retrying short writes
+static int write_all(int fd, const char* buf, size_t len) {
+    ssize_t num_bytes;
+
+    while (len > 0) {
+        num_bytes = write(fd, buf, len);
+        if (num_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += num_bytes;
+        len -= num_bytes;
+    }
+    return 0;
+}
+
+// read len bytes at offset, retrying short reads
+static int pread_all(int fd, char* buf, size_t len, off_t offset) {
+    ssize_t num_bytes;
+
+    while (len > 0) {
+        num_bytes = pread(fd, buf, len, offset);
+        if (num_bytes == -1 && errno == EINTR)
+            continue;
+        if (num_bytes <= 0) {
+            return -1;
+        }
+        buf += num_bytes;
+        len -= num_bytes;
+        offset += num_bytes;
+    }
+    return 0;
+}
+
+/* char device backend: one open per operation, like a client of the driver */
+
+static int chardev_open(struct aesd_storage* storage) {
+    // the driver is loaded separately, just make sure it is there
+    if (access(storage->path, R_OK | W_OK) == -1) {
+        perror("access");
+        return -1;
+    }
+    return 0;
+}
+
+static int chardev_append(struct aesd_storage* storage, const char* buf, size_t len) {
+    int status;
+    int fd = open(storage->path, O_WRONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    status = write_all(fd, buf, len);
+    if (status == -1) {
+        perror("write");
+    }
+    close(fd);
+    return status;
+}
+
+static ssize_t chardev_read_all(struct aesd_storage* storage, char** buf_rtn) {
+    size_t buf_size = READ_CHUNK;
+    size_t buf_pos = 0;
+    ssize_t num_bytes;
+    char* new_buf;
+    char* buf;
+    int fd;
+
+    fd = open(storage->path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    buf = malloc(buf_size);
+    if (buf == NULL) {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+
+    // the device size is not known up front, read until end of buffer
+    while ((num_bytes = read(fd, buf + buf_pos, buf_size - buf_pos)) != 0) {
+        if (num_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            free(buf);
+            close(fd);
+            return -1;
+        }
+        buf_pos += num_bytes;
+
+        if (buf_pos == buf_size) {
+            buf_size *= 2;
+            new_buf = realloc(buf, buf_size);
+            if (new_buf == NULL) {
+                perror("realloc");
+                free(buf);
+                close(fd);
+                return -1;
+            }
+            buf = new_buf;
+        }
+    }
+
+    close(fd);
+    *buf_rtn = buf;
+    return buf_pos;
+}
+
+static void chardev_close(struct aesd_storage* storage) {
+    // nothing held open
+}
+
+/* regular file backend: one fd for the lifetime of the server */
+
+static void segment_name(struct aesd_storage* storage, uint64_t seq, char* buf, size_t size) {
+    snprintf(buf, size, "%s.%llu", storage->path, (unsigned long long) seq);
+}
+
+// drops a record cut short by a crash, returns the length of the complete ones or -1
+static off_t log_repair(int fd) {
+    char buf[READ_CHUNK];
+    struct stat st;
+    const char* newline;
+    size_t chunk;
+    off_t end;
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    // appends are whole packets, so anything after the last newline is torn
+    end = st.st_size;
+    while (end > 0) {
+        chunk = (end < READ_CHUNK) ? end : READ_CHUNK;
+        if (pread_all(fd, buf, chunk, end - chunk) == -1) {
+            perror("pread");
+            return -1;
+        }
+        newline = memrchr(buf, '\n', chunk);
+        if (newline != NULL) {
+            end = end - chunk + (newline - buf) + 1;
+            break;
+        }
+        end -= chunk;
+    }
+
+    if (end != st.st_size) {
+        printf("Dropping %lld bytes of a torn record\n", (long long) (st.st_size - end));
+        if (ftruncate(fd, end) == -1) {
+            perror("ftruncate");
+            return -1;
+        }
+    }
+    return end;
+}
+
+static int file_open(struct aesd_storage* storage) {
+    char segment_path[PATH_MAX];
+    off_t segment_len;
+
+    if (storage->snap_path == NULL) {
+        storage->fd = open(storage->path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0666);
+        if (storage->fd == -1) {
+            perror("open");
+            return -1;
+        }
+        return 0;
+    }
+
+    // only the header and index are checked, the data is paged in as it is read
+    if (snap_load(storage->snap_path, &storage->snap) != 0) {
+        return -1;
+    }
+
+    // the snapshot already has the segment it was made from, if that is still around
+    segment_name(storage, storage->snap.seq, segment_path, sizeof(segment_path));
+    if (unlink(segment_path) == -1 && errno != ENOENT) {
+        perror("unlink");
+    }
+
+    // a segment whose snapshot did not finish comes between the snapshot and the log
+    segment_name(storage, storage->snap.seq + 1, segment_path, sizeof(segment_path));
+    storage->segment_fd = open(segment_path, O_RDWR | O_CLOEXEC);
+    if (storage->segment_fd == -1 && errno != ENOENT) {
+        perror("open");
+        goto error;
+    }
+    if (storage->segment_fd != -1) {
+        segment_len = log_repair(storage->segment_fd);
+        if (segment_len == -1) {
+            goto error;
+        }
+        storage->segment_len = segment_len;
+    }
+
+    storage->fd = open(storage->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (storage->fd == -1) {
+        perror("open");
+        goto error;
+    }
+    if (log_repair(storage->fd) == -1) {
+        goto error;
+    }
+    return 0;
+
+error:
+    if (storage->fd != -1) {
+        close(storage->fd);
+        storage->fd = -1;
+    }
+    if (storage->segment_fd != -1) {
+        close(storage->segment_fd);
+        storage->segment_fd = -1;
+    }
+    storage->segment_len = 0;
+    snap_unload(&storage->snap);
+    return -1;
+}
+
+static int file_append(struct aesd_storage* storage, const char* buf, size_t len) {
+    if (write_all(storage->fd, buf, len) == -1) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t file_read_all(struct aesd_storage* storage, char** buf_rtn) {
+    struct stat st;
+    size_t buf_pos;
+    size_t i;
+    char* buf;
+
+    if (fstat(storage->fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    // +1 so an empty file still gets a valid buffer
+    buf = malloc(storage->snap.data_len + storage->segment_len + st.st_size + 1);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    // snapshot, then a segment waiting for the next one, then the log
+    buf_pos = 0;
+    for (i = 0; i < storage->snap.num_chunks; i++) {
+        memcpy(buf + buf_pos, storage->snap.chunks[i].data, storage->snap.chunks[i].data_len);
+        buf_pos += storage->snap.chunks[i].data_len;
+    }
+    if (storage->segment_fd != -1 && pread_all(storage->segment_fd, buf + buf_pos, storage->segment_len, 0) == -1) {
+        perror("pread");
+        free(buf);
+        return -1;
+    }
+    buf_pos += storage->segment_len;
+    if (pread_all(storage->fd, buf + buf_pos, st.st_size, 0) == -1) {
+        perror("pread");
+        free(buf);
+        return -1;
+    }
+    buf_pos += st.st_size;
+
+    *buf_rtn = buf;
+    return buf_pos;
+}
+
+static void file_close(struct aesd_storage* storage) {
+    close(storage->fd);
+    storage->fd = -1;
+    if (storage->segment_fd != -1) {
+        close(storage->segment_fd);
+        storage->segment_fd = -1;
+        storage->segment_len = 0;
+    }
+    snap_unload(&storage->snap);
+
+    // a persistent history stays for the next start
+    if (storage->snap_path == NULL && remove(storage->path) == -1) {
+        perror("remove");
+    }
+}
+
+/* in-process backend: aesd-circular-buffer.c with the driver's write semantics */
+
+static int memory_open(struct aesd_storage* storage) {
+    aesd_circular_buffer_init(&storage->buffer);
+    storage->partial.buffptr = NULL;
+    storage->partial.size = 0;
+    return 0;
+}
+
+// store one command, freeing whatever it displaces
+static void memory_commit(struct aesd_storage* storage, const struct aesd_buffer_entry* cmd) {
+    const char* overwrite_ptr;
+
+    while ((overwrite_ptr = aesd_circular_buffer_make_room(&storage->buffer, cmd->size)) != NULL) {
+        free((char*) overwrite_ptr);
+    }
+    overwrite_ptr = aesd_circular_buffer_add_entry(&storage->buffer, cmd);
+    free((char*) overwrite_ptr);
+}
+
+static int memory_append(struct aesd_storage* storage, const char* buf, size_t len) {
+    struct aesd_buffer_entry cmd;
+    const char* newline;
+    size_t cmd_len;
+    char* cmd_buf;
+
+    // one entry per newline terminated command, the tail waits for the next append
+    while (len > 0) {
+        newline = memchr(buf, '\n', len);
+        cmd_len = (newline == NULL) ? len : (size_t) (newline - buf) + 1;
+
+        cmd_buf = realloc((char*) storage->partial.buffptr, storage->partial.size + cmd_len);
+        if (cmd_buf == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        memcpy(cmd_buf + storage->partial.size, buf, cmd_len);
+        storage->partial.buffptr = cmd_buf;
+        storage->partial.size += cmd_len;
+
+        if (newline != NULL) {
+            cmd = storage->partial;
+            memory_commit(storage, &cmd);
+            storage->partial.buffptr = NULL;
+            storage->partial.size = 0;
+        }
+
+        buf += cmd_len;
+        len -= cmd_len;
+    }
+    return 0;
+}
+
+static ssize_t memory_read_all(struct aesd_storage* storage, char** buf_rtn) {
+    struct aesd_buffer_entry* entry;
+    size_t entry_offset;
+    size_t buf_pos = 0;
+    char* buf;
+
+    buf = malloc(storage->buffer.total_size + 1);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    // walk the entries oldest first, the same way the driver's read does
+    while ((entry = aesd_circular_buffer_find_entry_offset_for_fpos(&storage->buffer, buf_pos, &entry_offset)) != NULL) {
+        memcpy(buf + buf_pos, entry->buffptr + entry_offset, entry->size - entry_offset);
+        buf_pos += entry->size - entry_offset;
+    }
+
+    *buf_rtn = buf;
+    return buf_pos;
+}
+
+static void memory_close(struct aesd_storage* storage) {
+    aesd_circular_buffer_free(&storage->buffer);
+    free((char*) storage->partial.buffptr);
+    storage->partial.buffptr = NULL;
+    storage->partial.size = 0;
+}
+
+/* unbounded in-process backend: one growing buffer */
+
+static int memlog_open(struct aesd_storage* storage) {
+    storage->log_buf = NULL;
+    storage->log_len = 0;
+    storage->log_size = 0;
+    return 0;
+}
+
+static int memlog_append(struct aesd_storage* storage, const char* buf, size_t len) {
+    size_t new_size = (storage->log_size == 0) ? READ_CHUNK : storage->log_size;
+    char* new_buf;
+
+    while (new_size - storage->log_len < len) {
+        new_size *= 2;
+    }
+    if (new_size != storage->log_size) {
+        new_buf = realloc(storage->log_buf, new_size);
+        if (new_buf == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        storage->log_buf = new_buf;
+        storage->log_size = new_size;
+    }
+
+    memcpy(storage->log_buf + storage->log_len, buf, len);
+    storage->log_len += len;
+    return 0;
+}
+
+static ssize_t memlog_read_all(struct aesd_storage* storage, char** buf_rtn) {
+    char* buf;
+
+    buf = malloc(storage->log_len + 1);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (storage->log_len > 0) {
+        memcpy(buf, storage->log_buf, storage->log_len);
+    }
+
+    *buf_rtn = buf;
+    return storage->log_len;
+}
+
+static void memlog_close(struct aesd_storage* storage) {
+    free(storage->log_buf);
+    storage->log_buf = NULL;
+    storage->log_len = 0;
+    storage->log_size = 0;
+}
+
+static const struct aesd_storage_ops storage_backends[] = {
+    {
+        .name = "chardev",
+        .default_path = CHARDEV_STORAGE_PATH,
+        .timestamps = false,
+        .replica = "memory",
+        .open = chardev_open,
+        .append = chardev_append,
+        .read_all = chardev_read_all,
+        .close = chardev_close,
+    },
+    {
+        .name = "file",
+        .default_path = FILE_STORAGE_PATH,
+        .timestamps = true,
+        .replica = "memlog",
+        .open = file_open,
+        .append = file_append,
+        .read_all = file_read_all,
+        .close = file_close,
+    },
+    {
+        .name = "memory",
+        .default_path = NULL,
+        .timestamps = false,
+        .replica = "memory",
+        .open = memory_open,
+        .append = memory_append,
+        .read_all = memory_read_all,
+        .close = memory_close,
+    },
+    {
+        .name = "memlog",
+        .default_path = NULL,
+        .timestamps = false,
+        .replica = "memlog",
+        .open = memlog_open,
+        .append = memlog_append,
+        .read_all = memlog_read_all,
+        .close = memlog_close,
+    },
+};
+
+/**
+ * Selects the backend called @param backend_name for @param storage, without opening it.
+ * @return 0 on success, -1 for an unknown backend
+ */
+int storage_init(struct aesd_storage* storage, const char* backend_name) {
+    size_t i;
+
+    memset(storage, 0, sizeof(*storage));
+    storage->fd = -1;
+    storage->segment_fd = -1;
+
+    for (i = 0; i < sizeof(storage_backends) / sizeof(storage_backends[0]); i++) {
+        if (strcmp(storage_backends[i].name, backend_name) == 0) {
+            storage->ops = &storage_backends[i];
+            storage->path = storage_backends[i].default_path;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Makes the file backend of @param storage keep its history across restarts,
+ * with snapshots at @param snap_path.  Call before storage_open().
+ * @return 0 on success, -1 for the other backends
+ */
+int storage_set_snapshot(struct aesd_storage* storage, const char* snap_path) {
+    if (storage->ops->open != file_open) {
+        return -1;
+    }
+    storage->snap_path = snap_path;
+    return 0;
+}
+
+/**
+ * Moves the log aside as the segment for the next snapshot, the caller holds
+ * the storage lock.  A segment left by a crash or a failed snapshot is used
+ * as it is.
+ * @return 1 if there is something to snapshot, 0 if not, -1 on error
+ */
+int storage_snapshot_begin(struct aesd_storage* storage) {
+    char segment_path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    if (storage->snap_path == NULL) {
+        return 0;
+    }
+    if (storage->segment_fd != -1) {
+        return 1;
+    }
+
+    if (fstat(storage->fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+
+    segment_name(storage, storage->snap.seq + 1, segment_path, sizeof(segment_path));
+    if (rename(storage->path, segment_path) == -1) {
+        perror("rename");
+        return -1;
+    }
+    fd = open(storage->path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        perror("open");
+        rename(segment_path, storage->path);
+        return -1;
+    }
+
+    storage->segment_fd = storage->fd;
+    storage->segment_len = st.st_size;
+    storage->fd = fd;
+    return 1;
+}
+
+/* Writes the next snapshot into @param map_rtn, without the storage lock. */
+int storage_snapshot_write(struct aesd_storage* storage, struct snap_map* map_rtn) {
+    struct snap_map appended;
+
+    if (snap_append(storage->snap_path, &storage->snap, storage->segment_fd, storage->segment_len,
+                    storage->snap.seq + 1, &appended) != 0) {
+        return -1;
+    }
+    if (appended.num_chunks < SNAP_COMPACT_CHUNKS) {
+        *map_rtn = appended;
+        return 0;
+    }
+
+    // the segment is in either way, a compaction that failed left the file alone and is tried again next time
+    if (snap_compact(storage->snap_path, &appended, map_rtn) != 0) {
+        *map_rtn = appended;
+        return 0;
+    }
+    snap_unload(&appended);
+    return 0;
+}
+
+/* Switches to the snapshot @param map, the caller holds the storage lock. */
+void storage_snapshot_end(struct aesd_storage* storage, struct snap_map* map) {
+    char segment_path[PATH_MAX];
+
+    snap_unload(&storage->snap);
+    storage->snap = *map;
+
+    close(storage->segment_fd);
+    storage->segment_fd = -1;
+    storage->segment_len = 0;
+    segment_name(storage, storage->snap.seq, segment_path, sizeof(segment_path));
+    if (unlink(segment_path) == -1) {
+        perror("unlink");
+    }
+}
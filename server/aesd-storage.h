@@ -0,0 +1,96 @@
+/*
+ * aesd-storage.h
+ *
+ * Backing store for aesdsocket packets.  The backend is picked at runtime:
+ *   chardev - the aesdchar kernel driver (/dev/aesdchar)
+ *   file    - a regular file (/var/tmp/aesdsocketdata), emptied at startup
+ *             unless storage_set_snapshot() made it persistent
+ *   memory  - aesd-circular-buffer.c linked into the process, same semantics
+ *             as the driver without a syscall per packet
+ *   memlog  - unbounded in-process log, the file backend's semantics without
+ *             the file; replication followers of a file primary use it
+ *
+ * None of the functions lock, callers serialize access to one storage.
+ *
+ * A persistent file backend keeps its history as a snapshot (aesd-snap.h)
+ * plus the log of what was appended since.  A snapshot is taken in three
+ * steps so the lock is only held for the quick ones:
+ *   storage_snapshot_begin() - locked, moves the log aside as segment
+ *                              <path>.<seq> and starts a new one
+ *   storage_snapshot_write() - unlocked, appends the segment to the
+ *                              snapshot, compacting it now and then
+ *   storage_snapshot_end()   - locked, switches to it and drops the segment
+ * Only one thread may take snapshots.  After a crash, startup picks up a
+ * segment whose snapshot was not finished, the next snapshot takes it in.
+ */
+
+#ifndef AESD_STORAGE_H
+#define AESD_STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-snap.h"
+
+#define CHARDEV_STORAGE_PATH "/dev/aesdchar"
+#define FILE_STORAGE_PATH "/var/tmp/aesdsocketdata"
+
+struct aesd_storage;
+
+struct aesd_storage_ops {
+    const char* name;
+    const char* default_path; // NULL when the backend has no path
+    bool timestamps; // whether the timer thread appends timestamps
+    const char* replica; // in-process backend with the same history, for followers
+    int (*open)(struct aesd_storage* storage);
+    // store len bytes of one or more newline terminated packets
+    int (*append)(struct aesd_storage* storage, const char* buf, size_t len);
+    // malloc a buffer holding the whole history, returns its size or -1
+    ssize_t (*read_all)(struct aesd_storage* storage, char** buf_rtn);
+    void (*close)(struct aesd_storage* storage);
+};
+
+struct aesd_storage {
+    const struct aesd_storage_ops* ops;
+    const char* path;
+    int fd; // file backend, the log
+    const char* snap_path; // file backend, keeps the history across restarts when set
+    struct snap_map snap; // history before segment_fd and fd
+    int segment_fd; // log moved aside for a snapshot, -1 if none
+    size_t segment_len;
+    struct aesd_circular_buffer buffer; // memory backend
+    struct aesd_buffer_entry partial; // memory backend, command without newline yet
+    char* log_buf; // memlog backend
+    size_t log_len;
+    size_t log_size;
+};
+
+int storage_init(struct aesd_storage* storage, const char* backend_name);
+
+int storage_set_snapshot(struct aesd_storage* storage, const char* snap_path);
+
+int storage_snapshot_begin(struct aesd_storage* storage);
+
+int storage_snapshot_write(struct aesd_storage* storage, struct snap_map* map_rtn);
+
+void storage_snapshot_end(struct aesd_storage* storage, struct snap_map* map);
+
+static inline int storage_open(struct aesd_storage* storage) {
+    return storage->ops->open(storage);
+}
+
+static inline int storage_append(struct aesd_storage* storage, const char* buf, size_t len) {
+    return storage->ops->append(storage, buf, len);
+}
+
+static inline ssize_t storage_read_all(struct aesd_storage* storage, char** buf_rtn) {
+    return storage->ops->read_all(storage, buf_rtn);
+}
+
+static inline void storage_close(struct aesd_storage* storage) {
+    storage->ops->close(storage);
+}
+
+#endif /* AESD_STORAGE_H */
@@ -0,0 +1,128 @@
+/*
+ * aesd-trace-report.c
+ *
+ * Reads an aesdsocket trace dump (kill -USR1 a server started with -t) and
+ * prints latency percentiles per request phase, in microseconds.
+ *
+ * Usage: aesd-trace-report [trace_file]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "aesd-trace.h"
+
+static int u32_compare(const void* a, const void* b) {
+    uint32_t val_a = *(const uint32_t*) a;
+    uint32_t val_b = *(const uint32_t*) b;
+    return (val_a > val_b) - (val_a < val_b);
+}
+
+// nearest rank percentile of sorted values
+static double percentile_us(const uint32_t* values, size_t count, double pct) {
+    size_t rank = (size_t) (pct / 100.0 * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return values[rank - 1] / 1000.0;
+}
+
+static void print_row(const char* name, uint32_t* values, size_t count) {
+    double sum = 0;
+    size_t i;
+
+    qsort(values, count, sizeof(uint32_t), u32_compare);
+    for (i = 0; i < count; i++) {
+        sum += values[i];
+    }
+
+    printf("%-10s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+           sum / count / 1000.0,
+           percentile_us(values, count, 50),
+           percentile_us(values, count, 90),
+           percentile_us(values, count, 99),
+           percentile_us(values, count, 99.9),
+           values[count - 1] / 1000.0);
+}
+
+int main(int argc, char** argv) {
+    const char* path = (argc > 1) ? argv[1] : TRACE_DUMP_PATH;
+    struct trace_header header;
+    struct trace_record* records;
+    uint32_t* values;
+    uint64_t total;
+    size_t cut = 0;
+    size_t i;
+    int phase;
+    FILE* file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen");
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.phases != TRACE_PHASES) {
+        printf("%s is not a version %d aesdsocket trace\n", path, TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    if (header.count == 0) {
+        printf("no requests traced\n");
+        fclose(file);
+        return 0;
+    }
+
+    records = malloc(header.count * sizeof(struct trace_record));
+    values = malloc(header.count * sizeof(uint32_t));
+    if (records == NULL || values == NULL) {
+        perror("malloc");
+        fclose(file);
+        return 1;
+    }
+
+    if (fread(records, sizeof(struct trace_record), header.count, file) != header.count) {
+        printf("%s is truncated\n", path);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    printf("%llu requests, latency in us\n", (unsigned long long) header.count);
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "phase", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+    for (phase = 0; phase < TRACE_PHASES; phase++) {
+        for (i = 0; i < header.count; i++) {
+            values[i] = records[i].phase_ns[phase];
+        }
+        print_row(trace_phase_names[phase], values, header.count);
+    }
+
+    for (i = 0; i < header.count; i++) {
+        total = 0;
+        for (phase = 0; phase < TRACE_PHASES; phase++) {
+            total += records[i].phase_ns[phase];
+        }
+        values[i] = total > UINT32_MAX ? UINT32_MAX : (uint32_t) total;
+        if (records[i].flags & TRACE_FLAG_SEND_CUT) {
+            cut++;
+        }
+    }
+    print_row("total", values, header.count);
+
+    if (cut > 0) {
+        printf("%zu requests pipelined behind an unsent reply, their send phase is cut short\n", cut);
+    }
+
+    free(values);
+    free(records);
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "aesd-trace.h"
+
+bool trace_enabled;
+
+static struct trace_record* ring;
+static _Atomic uint64_t next_seq; // seq of the last claimed slot
+
+/**
+ * Allocates the trace ring and turns tracing on.
+ * @return 0 on success, -1 on error
+ */
+int trace_init(void) {
+    ring = calloc(TRACE_RING_SIZE, sizeof(struct trace_record));
+    if (ring == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    trace_enabled = true;
+    return 0;
+}
+
+/* Copies @param record into the next slot of the ring, from any thread. */
+void trace_commit(const struct trace_record* record) {
+    uint64_t seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed) + 1;
+    struct trace_record* slot = &ring[(seq - 1) & (TRACE_RING_SIZE - 1)];
+    _Atomic uint64_t* slot_seq = (_Atomic uint64_t*) &slot->seq;
+
+    // readers skip the slot while seq is 0
+    atomic_store_explicit(slot_seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&slot->start_ns, &record->start_ns, sizeof(*slot) - offsetof(struct trace_record, start_ns));
+    atomic_store_explicit(slot_seq, seq, memory_order_release);
+}
+
+static int record_compare(const void* a, const void* b) {
+    uint64_t seq_a = ((const struct trace_record*) a)->seq;
+    uint64_t seq_b = ((const struct trace_record*) b)->seq;
+    return (seq_a > seq_b) - (seq_a < seq_b);
+}
+
+/**
+ * Writes every complete record in the ring to @param path, oldest first.
+ * Requests still being committed while this runs are left out.
+ * @return number of records written, or -1 on error
+ */
+int trace_dump(const char* path) {
+    struct trace_header header;
+    struct trace_record* records;
+    _Atomic uint64_t* slot_seq;
+    uint64_t seq;
+    size_t count = 0;
+    size_t i;
+    FILE* file;
+
+    if (!trace_enabled) {
+        return 0;
+    }
+
+    records = malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+    if (records == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    // seqlock style copy, a slot rewritten during the copy is dropped
+    for (i = 0; i < TRACE_RING_SIZE; i++) {
+        slot_seq = (_Atomic uint64_t*) &ring[i].seq;
+        seq = atomic_load_explicit(slot_seq, memory_order_acquire);
+        if (seq == 0) {
+            continue;
+        }
+        memcpy(&records[count], &ring[i], sizeof(struct trace_record));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(slot_seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        records[count].seq = seq;
+        count++;
+    }
+    qsort(records, count, sizeof(struct trace_record), record_compare);
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        perror("fopen");
+        free(records);
+        return -1;
+    }
+
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.phases = TRACE_PHASES;
+    header.count = count;
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(records, sizeof(struct trace_record), count, file) != count) {
+        perror("fwrite");
+        fclose(file);
+        free(records);
+        return -1;
+    }
+
+    fclose(file);
+    free(records);
+    return count;
+}
@@ -0,0 +1,77 @@
+/*
+ * aesd-trace.h
+ *
+ * Per-request phase tracing for aesdsocket.  Each request's phase durations
+ * are recorded into a fixed size in-memory ring, overwriting the oldest
+ * records.  On SIGUSR1 the ring is dumped in binary to TRACE_DUMP_PATH;
+ * aesd-trace-report turns a dump into per-phase latency percentiles.
+ *
+ * Tracing is off unless trace_init() was called (aesdsocket -t).
+ */
+
+#ifndef AESD_TRACE_H
+#define AESD_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_MAGIC "AESDTRC1"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 65536 // records kept, must be a power of 2
+#define TRACE_DUMP_PATH "/var/tmp/aesdsocket.trace"
+
+enum trace_phase {
+    TRACE_RECV, // first byte of the request to its last newline
+    TRACE_LOCK_WAIT, // waiting for the storage mutex
+    TRACE_APPEND, // storage_append
+    TRACE_READ_ALL, // storage_read_all
+    TRACE_SEND, // reply queued to the last byte accepted by the socket
+    TRACE_PHASES,
+};
+
+static const char* const trace_phase_names[TRACE_PHASES] = {
+    "recv", "lock_wait", "append", "read_all", "send",
+};
+
+#define TRACE_FLAG_SEND_CUT 0x1 // next request arrived before the reply drained
+
+struct trace_record {
+    uint64_t seq; // 1 based commit order, 0 while the slot is written
+    uint64_t start_ns; // CLOCK_MONOTONIC at the first byte of the request
+    uint32_t phase_ns[TRACE_PHASES];
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint32_t flags;
+};
+
+// dump file layout: header followed by count records, oldest first
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t phases;
+    uint64_t count;
+};
+
+extern bool trace_enabled;
+
+int trace_init(void);
+
+void trace_commit(const struct trace_record* record);
+
+int trace_dump(const char* path);
+
+static inline uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// saturates instead of wrapping for phases over ~4s
+static inline uint32_t trace_elapsed(uint64_t start_ns, uint64_t end_ns) {
+    uint64_t elapsed = end_ns - start_ns;
+    return elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+}
+
+#endif /* AESD_TRACE_H */
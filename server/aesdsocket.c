@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // memrchr
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -16,34 +17,78 @@
 #include <time.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "aesd-storage.h"
+#include "aesd-outq.h"
+#include "aesd-log.h"
+#include "aesd-trace.h"
+#include "aesd-shm.h"
+#include "aesd-grep.h"
+#include "aesd-frame.h"
+#include "aesd-fair.h"
+#include "aesd-repl.h"
+#include "aesd-affinity.h"
 
 #define PORT_NUM "9000"
 #define MAX_BACKLOG 10
-#define MAX_BUF 100
+#define MAX_BUF 100 // initial receive buffer, and the least room offered to each recv
+#define POLL_INTERVAL_MS 500 // how often idle connections check run_flag
+#define SHM_READ_CHUNK (64 * 1024) // packet bytes taken off a shared memory ring at once
+#define FRAME_INITIAL_BUF (64 * 1024) // payload buffer before any of it arrived, grows as it does
+
+// per-connection reply queue limits, see -W/-L/-P/-T
+#define DEFAULT_HIGH_WATERMARK (1024 * 1024)
+#define DEFAULT_LOW_WATERMARK (256 * 1024)
+#define DEFAULT_STALL_TIMEOUT_MS 30000
 
 #define USE_AESD_CHAR_DEVICE 1
 
+// backend used when -b is not given
 #ifdef USE_AESD_CHAR_DEVICE
-#define OUTPUT_FILE_PATH "/dev/aesdchar"
+#define DEFAULT_STORAGE_BACKEND "chardev"
 #else
-#define OUTPUT_FILE_PATH "/var/tmp/aesdsocketdata"
+#define DEFAULT_STORAGE_BACKEND "file"
 #endif
 
 // global variables
 int socket_num; // fd for socket
+int shm_socket_num = -1; // Unix socket for shared memory clients, -1 when disabled
+const char* shm_socket_path = NULL;
+int repl_socket_num = -1; // Unix socket for followers (-S), -1 when disabled
+const char* repl_socket_path = NULL;
+const char* primary_path = NULL; // follower of the primary at this socket (-F)
+bool follower_flag = false; // appends go through the primary
+const char* port_num = PORT_NUM;
+const char* snapshot_path = NULL; // file backend history survives restarts (-k)
+unsigned int snapshot_interval_s = DEFAULT_SNAPSHOT_INTERVAL_S;
 int client_fd; // fd for most recent thread connection
-int file_fd; // fd for output file
+struct aesd_storage storage; // where packets are stored, guarded by mutex
 
-struct sockaddr_in client_addr; // needed for IP address
-bool run_flag = true; // flag for main loop
+volatile bool run_flag = true; // flag for main loop, also polled by connection threads
+volatile sig_atomic_t trace_dump_flag = false; // SIGUSR1 asked main for a trace dump
 pthread_mutex_t mutex; // used for synchronization
 
 sigset_t cur_set; // signal masking
 sigset_t prev_set; // signal masking
 
+enum slow_reader_policy {
+    SLOW_READER_THROTTLE, // stop reading the client's packets until its replies drain
+    SLOW_READER_DISCONNECT, // drop the client as soon as it crosses the high watermark
+};
+
+size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+size_t low_watermark = DEFAULT_LOW_WATERMARK;
+enum slow_reader_policy slow_reader_policy = SLOW_READER_THROTTLE;
+int stall_timeout_ms = DEFAULT_STALL_TIMEOUT_MS; // drop clients that accept no bytes for this long
+bool persistent_flag = false; // text clients may send more after a reply (-C), otherwise it ends the connection
+
 struct thread_data { // node structure for linked list
     pthread_t thread_id;
     int connection_fd;
+    struct sockaddr_in client_addr; // TCP clients only
+    struct aesd_shm_conn shm; // shared memory clients only
     bool complete_flag;
 };
 
@@ -52,17 +97,15 @@ struct list_data { // linked list data structure
     SLIST_ENTRY(list_data) entries;
 };
 
+// only async-signal-safe calls here, main logs the shutdown once accept returns
 void handle_signals(int sig_num) {
     if ((sig_num == SIGINT) || (sig_num == SIGTERM)) {
-        syslog(LOG_DEBUG, "Caught signal, exiting");
-        printf("** Entering signal handler\n");
-
-        if (shutdown(socket_num, SHUT_RDWR) == -1) {
-            perror("shutdown");
-        }
-
+        shutdown(socket_num, SHUT_RDWR);
         run_flag = false;
     }
+    else if (sig_num == SIGUSR1) {
+        trace_dump_flag = true;
+    }
 }
 
 static inline void timespec_add(struct timespec* result, const struct timespec* ts_1, const struct timespec* ts_2) {
@@ -75,13 +118,13 @@ static inline void timespec_add(struct timespec* result, const struct timespec*
 }
 
 void timer_thread() {
-    #ifndef USE_AESD_CHAR_DEVICE
     time_t rawtime;
     struct tm* info;
-    char* buf = malloc(sizeof(char) * MAX_BUF);
-    if (buf == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+    char buf[MAX_BUF];
+
+    // only the file backend records timestamps, a follower gets the primary's
+    if (!storage.ops->timestamps || follower_flag) {
+        return;
     }
 
     time(&rawtime);
@@ -92,201 +135,1136 @@ void timer_thread() {
 
     if (num_bytes == 0) {
         perror("strftime");
-        free(buf);
+        return;
     }
 
     if (pthread_mutex_lock(&mutex) != 0) {
         perror("mutex lock error");
-        free(buf);
+        return;
     }
 
-    int bytes_written = write(file_fd, buf, num_bytes);
-    if (bytes_written != num_bytes) {
+    if (storage_append(&storage, buf, num_bytes) != 0) {
         perror("writing timestamp error");
-        free(buf);
+    }
+    else {
+        repl_publish(buf, num_bytes);
     }
 
     if (pthread_mutex_unlock(&mutex) != 0) {
         perror("mutex unlock error");
+    }
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+enum connection_mode {
+    CONNECTION_NEW, // nothing received yet
+    CONNECTION_TEXT, // newline terminated packets
+    CONNECTION_FRAMED, // length-prefixed records, see aesd-frame.h
+};
+
+/* Per-connection state shared by the TCP and shared memory transports */
+struct connection {
+    struct aesd_outq outq; // replies not yet taken by the client
+    enum connection_mode mode;
+    char* recv_buf; // text: bytes received after the last newline, framed: bytes not parsed yet
+    size_t recv_buf_pos;
+    size_t recv_buf_size;
+    char frame_header[FRAME_HEADER_LEN]; // header of the record being received
+    size_t frame_header_pos;
+    char* frame_buf; // its payload, NULL while the header is incomplete
+    size_t frame_size; // allocated, at most frame_len + 1
+    size_t frame_len;
+    size_t frame_pos;
+    bool frame_direct; // the last connection_buffer() pointed into frame_buf
+    bool input_open; // client has not finished sending
+    unsigned int requests; // batches and records handled
+    uint64_t last_progress; // last time the client took reply bytes, or had none queued
+    struct trace_record trace;
+    bool trace_pending; // trace waits for its reply to drain
+    uint64_t recv_start_ns; // first byte of the request being received
+    uint64_t send_start_ns;
+    struct fair_client* client; // source address group, for rate limiting and the fair queue
+};
+
+// framed connections get every reply as one FRAME_REPLY record
+static int queue_reply(struct aesd_outq* outq, char* buf, size_t len, bool framed) {
+    char header[FRAME_HEADER_LEN];
+
+    if (!framed) {
+        return outq_push(outq, buf, len);
+    }
+    // the length field is 32 bits, a history that outgrew it cannot be sent
+    if (len > UINT32_MAX) {
+        log_msg(LOG_ERR, "Reply of %zu bytes too long for a record\n", len);
         free(buf);
+        return -1;
+    }
+    frame_encode_header(header, FRAME_REPLY, len);
+    return outq_push_prefixed(outq, header, FRAME_HEADER_LEN, buf, len);
+}
+
+/* Appends the complete packets at the start of recv_buf (packet_len bytes) to
+   storage and queues the full history as the reply. Fills in the lock, append
+   and read phases of trace when tracing is on. */
+static int handle_packets(struct connection* conn, const char* recv_buf, size_t packet_len, bool framed) {
+    char* send_buf = NULL;
+    ssize_t send_buf_size = -1;
+    uint64_t phase_start_ns = 0;
+    uint64_t phase_end_ns;
+    int status = 0;
+
+    if (trace_enabled) {
+        phase_start_ns = trace_now_ns();
+    }
+
+    // a follower has the primary append, it is applied here before the ack comes back
+    if (follower_flag) {
+        if (repl_forward(recv_buf, packet_len) != 0) {
+            log_msg(LOG_DEBUG, "No primary to take the write\n");
+            return -1;
+        }
+        if (trace_enabled) {
+            phase_end_ns = trace_now_ns();
+            conn->trace.phase_ns[TRACE_APPEND] += trace_elapsed(phase_start_ns, phase_end_ns);
+            phase_start_ns = phase_end_ns;
+        }
+    }
+
+    // the client's turn in the fair queue, then append and read back the full history in one critical section
+    fair_enter(conn->client);
+    if (pthread_mutex_lock(&mutex) != 0) {
+        perror("mutex lock error");
+        fair_exit();
+        return -1;
+    }
+
+    if (trace_enabled) {
+        phase_end_ns = trace_now_ns();
+        conn->trace.phase_ns[TRACE_LOCK_WAIT] += trace_elapsed(phase_start_ns, phase_end_ns);
+        phase_start_ns = phase_end_ns;
+    }
+
+    if (!follower_flag) {
+        status = storage_append(&storage, recv_buf, packet_len);
+        if (status == 0) {
+            repl_publish(recv_buf, packet_len);
+        }
+        if (trace_enabled) {
+            phase_end_ns = trace_now_ns();
+            conn->trace.phase_ns[TRACE_APPEND] += trace_elapsed(phase_start_ns, phase_end_ns);
+            phase_start_ns = phase_end_ns;
+        }
+    }
+
+    if (status == 0) {
+        send_buf_size = storage_read_all(&storage, &send_buf);
+
+        if (trace_enabled) {
+            conn->trace.phase_ns[TRACE_READ_ALL] += trace_elapsed(phase_start_ns, trace_now_ns());
+        }
+    }
+
+    if (pthread_mutex_unlock(&mutex) != 0) {
+        perror("mutex unlock error");
+    }
+    fair_exit();
+
+    if (send_buf_size == -1) {
+        return -1;
+    }
+    conn->trace.bytes_in += packet_len;
+    conn->trace.bytes_out += send_buf_size;
+
+    // the queue owns send_buf from here on
+    return queue_reply(&conn->outq, send_buf, send_buf_size, framed);
+}
+
+/* Answers "GREP <pattern>" with the stored lines containing pattern, without
+   storing anything. The history is copied under the mutex and searched after. */
+static int handle_query(struct connection* conn, const char* pattern, size_t pattern_len, bool framed) {
+    char* history = NULL;
+    ssize_t history_size = -1;
+    char* send_buf = NULL;
+    ssize_t send_buf_size;
+    uint64_t phase_start_ns = 0;
+    uint64_t phase_end_ns;
+
+    if (trace_enabled) {
+        phase_start_ns = trace_now_ns();
     }
 
-    free(buf);
-    #endif
+    // the client's turn in the fair queue, then the mutex
+    fair_enter(conn->client);
+    if (pthread_mutex_lock(&mutex) != 0) {
+        perror("mutex lock error");
+        fair_exit();
+        return -1;
+    }
+
+    if (trace_enabled) {
+        phase_end_ns = trace_now_ns();
+        conn->trace.phase_ns[TRACE_LOCK_WAIT] += trace_elapsed(phase_start_ns, phase_end_ns);
+        phase_start_ns = phase_end_ns;
+    }
+
+    history_size = storage_read_all(&storage, &history);
+
+    if (pthread_mutex_unlock(&mutex) != 0) {
+        perror("mutex unlock error");
+    }
+    fair_exit();
+
+    if (history_size == -1) {
+        return -1;
+    }
+
+    send_buf_size = grep_lines(history, history_size, pattern, pattern_len, &send_buf);
+    free(history);
+    if (send_buf_size == -1) {
+        return -1;
+    }
+
+    // the scan is the read side of a query
+    if (trace_enabled) {
+        conn->trace.phase_ns[TRACE_READ_ALL] += trace_elapsed(phase_start_ns, trace_now_ns());
+    }
+    conn->trace.bytes_in += pattern_len + (framed ? FRAME_HEADER_LEN : strlen(GREP_COMMAND) + 1);
+    conn->trace.bytes_out += send_buf_size;
+
+    // an empty reply still counts as one for shared memory clients
+    return queue_reply(&conn->outq, send_buf, send_buf_size, framed);
+}
+
+/* Handles the complete packets at the start of recv_buf (packet_len bytes).
+   Runs of plain packets are appended together, each query line is answered on its own. */
+static int handle_batch(struct connection* conn, const char* recv_buf, size_t packet_len) {
+    const char* batch_end = recv_buf + packet_len;
+    const char* run = recv_buf; // first packet not handled yet
+    const char* line;
+    const char* next;
+    size_t command_len = strlen(GREP_COMMAND);
+    unsigned int count = 0;
+
+    // one token per packet
+    for (line = recv_buf; line < batch_end; line = (const char*) memchr(line, '\n', batch_end - line) + 1) {
+        count++;
+    }
+    fair_charge(conn->client, count);
+
+    for (line = recv_buf; line < batch_end; line = next) {
+        next = (const char*) memchr(line, '\n', batch_end - line) + 1;
+
+        if ((size_t) (next - line) > command_len && memcmp(line, GREP_COMMAND, command_len) == 0) {
+            if (line > run && handle_packets(conn, run, line - run, false) != 0) {
+                return -1;
+            }
+            if (handle_query(conn, line + command_len, next - line - command_len - 1, false) != 0) {
+                return -1;
+            }
+            run = next;
+        }
+    }
+
+    if (batch_end > run) {
+        return handle_packets(conn, run, batch_end - run, false);
+    }
+    return 0;
+}
+
+static void connection_init(struct connection* conn, struct in_addr addr) {
+    memset(conn, 0, sizeof(*conn));
+
+    conn->client = fair_client_get(addr);
+    if (conn->client == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    // receive buffer setup
+    conn->recv_buf_size = MAX_BUF;
+    conn->recv_buf = malloc(conn->recv_buf_size * sizeof(char));
+    if (conn->recv_buf == NULL) {
+        perror("malloc failure");
+        exit(EXIT_FAILURE);
+    }
+
+    conn->input_open = true;
+    outq_init(&conn->outq, high_watermark, low_watermark);
+    conn->last_progress = now_ms();
+}
+
+static void connection_free(struct connection* conn) {
+    // reply never fully delivered, keep it in the trace as a cut send
+    if (conn->trace_pending) {
+        conn->trace.phase_ns[TRACE_SEND] = trace_elapsed(conn->send_start_ns, trace_now_ns());
+        conn->trace.flags |= TRACE_FLAG_SEND_CUT;
+        trace_commit(&conn->trace);
+    }
+
+    // free buffers
+    free(conn->recv_buf);
+    free(conn->frame_buf);
+    outq_free(&conn->outq);
+    fair_client_put(conn->client);
+}
+
+/* Makes room for len more payload bytes at frame_pos. The buffer doubles
+   rather than taking the length from the header, so a client has to send
+   the bytes it claims before the server holds memory for them. */
+static int frame_reserve(struct connection* conn, size_t len) {
+    size_t size = conn->frame_size;
+    char* buf;
+
+    if (conn->frame_pos + len <= size) {
+        return 0;
+    }
+    while (size < conn->frame_pos + len) {
+        size *= 2;
+    }
+    if (size > conn->frame_len + 1) {
+        size = conn->frame_len + 1;
+    }
+
+    buf = realloc(conn->frame_buf, size);
+    if (buf == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    conn->frame_buf = buf;
+    conn->frame_size = size;
+    return 0;
 }
 
-/* Activities per thread
+/* Where the transport puts the next bytes it receives, at least min_len of
+   them: straight into the payload of a large record, otherwise the free
+   part of recv_buf. Returns the room at *dest. */
+static size_t connection_buffer(struct connection* conn, size_t min_len, char** dest) {
+    size_t room;
+
+    conn->frame_direct = false;
+    if (conn->mode == CONNECTION_FRAMED && conn->frame_buf != NULL &&
+        conn->frame_len - conn->frame_pos >= min_len && frame_reserve(conn, min_len) == 0) {
+        conn->frame_direct = true;
+        *dest = conn->frame_buf + conn->frame_pos;
+        room = conn->frame_size - conn->frame_pos;
+        return (room < conn->frame_len - conn->frame_pos) ? room : conn->frame_len - conn->frame_pos;
+    }
+
+    // check if allocated buf size is sufficient
+    if (conn->recv_buf_pos + min_len > conn->recv_buf_size) {
+        while (conn->recv_buf_pos + min_len > conn->recv_buf_size) {
+            conn->recv_buf_size *= 2;
+        }
+        conn->recv_buf = realloc(conn->recv_buf, conn->recv_buf_size * sizeof(char));
+        if (conn->recv_buf == NULL) {
+            perror("realloc failure");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    *dest = conn->recv_buf + conn->recv_buf_pos;
+    return conn->recv_buf_size - conn->recv_buf_pos;
+}
+
+/* A complete request is in, start its trace record. */
+static void connection_request_begin(struct connection* conn) {
+    if (trace_enabled) {
+        // a pipelined request ends the previous one's send phase
+        if (conn->trace_pending) {
+            conn->trace.phase_ns[TRACE_SEND] = trace_elapsed(conn->send_start_ns, trace_now_ns());
+            conn->trace.flags |= TRACE_FLAG_SEND_CUT;
+            trace_commit(&conn->trace);
+        }
+        memset(&conn->trace, 0, sizeof(conn->trace));
+        conn->trace.start_ns = conn->recv_start_ns;
+        conn->trace.phase_ns[TRACE_RECV] = trace_elapsed(conn->recv_start_ns, trace_now_ns());
+    }
+}
+
+/* Its reply is queued, the send phase runs until the queue drains. */
+static void connection_request_end(struct connection* conn, bool more_input) {
+    conn->requests++;
+    if (trace_enabled) {
+        conn->send_start_ns = trace_now_ns();
+        conn->trace_pending = true;
+    }
+    conn->recv_start_ns = more_input ? conn->send_start_ns : 0;
+}
+
+/* Checks the header of the next record and allocates the start of its
+   payload, frame_reserve() grows it up to the room for the newline an
+   append may need. */
+static int frame_start(struct connection* conn) {
+    char type = conn->frame_header[0];
+
+    conn->frame_len = frame_decode_len(conn->frame_header);
+    if ((type != FRAME_APPEND && type != FRAME_GREP) || conn->frame_len > FRAME_MAX_PAYLOAD) {
+        log_msg(LOG_DEBUG, "Bad record header, type 0x%02x length %zu\n", (unsigned char) type, conn->frame_len);
+        return -1;
+    }
+
+    conn->frame_size = (conn->frame_len < FRAME_INITIAL_BUF) ? conn->frame_len + 1 : FRAME_INITIAL_BUF;
+    conn->frame_buf = malloc(conn->frame_size);
+    if (conn->frame_buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    conn->frame_pos = 0;
+    return 0;
+}
+
+/* Handles the record whose payload just completed. */
+static int frame_dispatch(struct connection* conn, bool more_input) {
+    int status;
+
+    fair_charge(conn->client, 1);
+    connection_request_begin(conn);
+
+    if (conn->frame_header[0] == FRAME_GREP) {
+        status = handle_query(conn, conn->frame_buf, conn->frame_len, true);
+    }
+    else {
+        // storage keeps newline terminated packets
+        if (conn->frame_len == 0 || conn->frame_buf[conn->frame_len - 1] != '\n') {
+            if (frame_reserve(conn, 1) != 0) {
+                status = -1;
+                goto exit;
+            }
+            conn->frame_buf[conn->frame_len++] = '\n';
+        }
+        status = handle_packets(conn, conn->frame_buf, conn->frame_len, true);
+    }
+
+exit:
+    free(conn->frame_buf);
+    conn->frame_buf = NULL;
+    conn->frame_size = 0;
+    conn->frame_header_pos = 0;
+
+    connection_request_end(conn, more_input);
+    return status;
+}
+
+/* Parses the recv_buf_pos bytes in recv_buf as records, copying payloads
+   into their buffers. */
+static int connection_receive_framed(struct connection* conn) {
+    const char* pos = conn->recv_buf;
+    const char* end = conn->recv_buf + conn->recv_buf_pos;
+    size_t len;
+
+    while (pos < end) {
+        if (conn->frame_buf == NULL) {
+            len = FRAME_HEADER_LEN - conn->frame_header_pos;
+            if (len > (size_t) (end - pos)) {
+                len = end - pos;
+            }
+            memcpy(conn->frame_header + conn->frame_header_pos, pos, len);
+            conn->frame_header_pos += len;
+            pos += len;
+
+            if (conn->frame_header_pos < FRAME_HEADER_LEN) {
+                break;
+            }
+            if (frame_start(conn) != 0) {
+                return -1;
+            }
+        }
+
+        len = conn->frame_len - conn->frame_pos;
+        if (len > (size_t) (end - pos)) {
+            len = end - pos;
+        }
+        if (frame_reserve(conn, len) != 0) {
+            return -1;
+        }
+        memcpy(conn->frame_buf + conn->frame_pos, pos, len);
+        conn->frame_pos += len;
+        pos += len;
+
+        if (conn->frame_pos == conn->frame_len && frame_dispatch(conn, pos < end) != 0) {
+            return -1;
+        }
+    }
+
+    conn->recv_buf_pos = 0;
+    return 0;
+}
+
+/* Takes num_bytes the transport received at the place connection_buffer()
+   gave it. Text connections get a reply once a newline completes one or
+   more packets, framed ones once per record. */
+static int connection_receive(struct connection* conn, size_t num_bytes) {
+    char* newline;
+    size_t packet_len;
+
+    if (trace_enabled && conn->recv_start_ns == 0) {
+        conn->recv_start_ns = trace_now_ns();
+    }
+
+    // payload of a large record, nothing to copy or scan
+    if (conn->frame_direct) {
+        conn->frame_pos += num_bytes;
+        if (conn->frame_pos == conn->frame_len) {
+            return frame_dispatch(conn, false);
+        }
+        return 0;
+    }
+
+    conn->recv_buf_pos += num_bytes;
+
+    // the first byte picks the protocol for the whole connection
+    if (conn->mode == CONNECTION_NEW) {
+        conn->mode = CONNECTION_TEXT;
+        if ((unsigned char) conn->recv_buf[0] == FRAME_MAGIC) {
+            conn->mode = CONNECTION_FRAMED;
+            conn->recv_buf_pos--;
+            memmove(conn->recv_buf, conn->recv_buf + 1, conn->recv_buf_pos);
+            num_bytes--;
+        }
+    }
+
+    if (conn->mode == CONNECTION_FRAMED) {
+        return connection_receive_framed(conn);
+    }
+
+    // reply once a new line character was received
+    newline = memrchr(conn->recv_buf + conn->recv_buf_pos - num_bytes, '\n', num_bytes);
+    if (newline == NULL) {
+        return 0;
+    }
+    packet_len = newline - conn->recv_buf + 1;
+
+    connection_request_begin(conn);
+
+    if (handle_batch(conn, conn->recv_buf, packet_len) != 0) {
+        return -1;
+    }
+
+    // keep the start of the next packet
+    conn->recv_buf_pos -= packet_len;
+    memmove(conn->recv_buf, conn->recv_buf + packet_len, conn->recv_buf_pos);
+    connection_request_end(conn, conn->recv_buf_pos > 0);
+    return 0;
+}
+
+/* Bookkeeping after the client took num_bytes of queued replies. */
+static void connection_sent(struct connection* conn, ssize_t num_bytes) {
+    if (num_bytes > 0) {
+        conn->last_progress = now_ms();
+    }
+    if (conn->trace_pending && outq_empty(&conn->outq)) {
+        conn->trace.phase_ns[TRACE_SEND] = trace_elapsed(conn->send_start_ns, trace_now_ns());
+        trace_commit(&conn->trace);
+        conn->trace_pending = false;
+    }
+}
+
+/* Slow reader handling, returns false when the client should be dropped. */
+static bool connection_check_reader(struct connection* conn, const char* peer) {
+    if (outq_empty(&conn->outq)) {
+        conn->last_progress = now_ms();
+    }
+    else if (slow_reader_policy == SLOW_READER_DISCONNECT && outq_over_high(&conn->outq)) {
+        log_msg(LOG_DEBUG, "Dropping slow reader %s with %zu bytes queued\n", peer, conn->outq.queued);
+        return false;
+    }
+    else if (now_ms() - conn->last_progress > (uint64_t) stall_timeout_ms) {
+        log_msg(LOG_DEBUG, "Dropping stalled reader %s with %zu bytes queued\n", peer, conn->outq.queued);
+        return false;
+    }
+    return true;
+}
+
+/* Activities per thread, repeated until the client closes its side
     1. receive data from client
-    2. write data to output file
-    3. read data from output file
-    4. send data back to client */
+    2. append each batch of complete packets to storage
+    3. read the full history from storage
+    4. queue it and send it back without blocking
+   Without -C a text connection is closed once its first reply went out. */
 void* thread_function(void* thread_data) {
 	struct thread_data* thread_info = (struct thread_data*) thread_data;
+    int fd = thread_info->connection_fd;
     int status;
     int num_bytes;
+    struct connection conn;
+    struct pollfd pfd;
+    char* recv_dest;
+    size_t recv_len;
+    int wait_ms;
 
-    // open file for writing
-    file_fd = open(OUTPUT_FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (file_fd == -1) {
-        perror("open");
-        return NULL;
+    // inet_ntoa's static buffer is shared by every thread
+    char ip_addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &thread_info->client_addr.sin_addr, ip_addr, sizeof(ip_addr));
+	log_msg(LOG_DEBUG, "Accepted connection from %s\n", ip_addr);
+
+    connection_init(&conn, thread_info->client_addr.sin_addr);
+
+    // mask signals, main handles SIGINT/SIGTERM and connections watch run_flag
+    status = pthread_sigmask(SIG_BLOCK, &cur_set, NULL);
+    if (status != 0) {
+        printf("signal masking failed\n");
+        goto exit;
     }
 
-    char buf[MAX_BUF]; // initialize static buffer
-    memset(buf, '\0', MAX_BUF); // clear buf
+    while (run_flag) {
+        // done once the client stopped sending and every reply was delivered
+        if (!conn.input_open && outq_empty(&conn.outq)) {
+            break;
+        }
 
-	char* ip_addr = inet_ntoa(client_addr.sin_addr);
-	syslog(LOG_DEBUG, "Accepted connection from %s\n", ip_addr);
+        // the client's address ran out of tokens, leave its packets in the socket
+        wait_ms = fair_wait_ms(conn.client);
 
-    // receive buffer setup
-    int recv_buf_pos = 0;
-    long recv_buf_size = MAX_BUF;
-    char* recv_buf = malloc(recv_buf_size * sizeof(char));
-    if (recv_buf == NULL) {
-        perror("malloc failure");
-        exit(EXIT_FAILURE);
+        pfd.fd = fd;
+        pfd.events = 0;
+        if (conn.input_open && !outq_over_high(&conn.outq) && wait_ms == 0) {
+            pfd.events |= POLLIN;
+        }
+        if (!outq_empty(&conn.outq)) {
+            pfd.events |= POLLOUT;
+        }
+
+        status = poll(&pfd, 1, (wait_ms > 0 && wait_ms < POLL_INTERVAL_MS) ? wait_ms : POLL_INTERVAL_MS);
+        if (status == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            break;
+        }
+
+        if ((pfd.revents & (POLLIN | POLLHUP)) && wait_ms == 0) {
+            recv_len = connection_buffer(&conn, MAX_BUF, &recv_dest);
+            num_bytes = recv(fd, recv_dest, recv_len, MSG_DONTWAIT);
+
+            if (num_bytes == -1) {
+                if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("recv");
+                    break;
+                }
+            }
+            else if (num_bytes == 0) {
+                // client finished sending, a trailing partial packet is dropped
+                conn.input_open = false;
+            }
+            else {
+                if (connection_receive(&conn, num_bytes) != 0) {
+                    break;
+                }
+
+                // a text client gets one reply and then the close it waits for
+                if (!persistent_flag && conn.mode == CONNECTION_TEXT && conn.requests > 0) {
+                    conn.input_open = false;
+                }
+
+                // most replies fit the socket buffer, try right away instead of waiting for POLLOUT
+                if (!outq_empty(&conn.outq)) {
+                    pfd.revents |= POLLOUT;
+                }
+            }
+        }
+
+        if (pfd.revents & POLLOUT) {
+            num_bytes = outq_flush(&conn.outq, fd);
+            if (num_bytes == -1) {
+                break;
+            }
+            connection_sent(&conn, num_bytes);
+        }
+
+        if (!connection_check_reader(&conn, ip_addr)) {
+            break;
+        }
     }
 
-    // mask signals
-    status = sigprocmask(SIG_BLOCK, &cur_set, &prev_set);
-    if (status == -1) {
+ exit:
+    connection_free(&conn);
+
+    close(fd);
+    log_msg(LOG_DEBUG, "Closed connection from %s\n", ip_addr);	   
+    thread_info->complete_flag = true;
+
+    return NULL;
+}
+
+static ssize_t shm_reply_write(void* ctx, const char* buf, size_t len) {
+    struct aesd_shm_conn* shm = ctx;
+    return shm_ring_write(shm, &shm->resp, buf, len);
+}
+
+/* Same activities as thread_function for a local client on the shared memory
+   rings. The connection ends when the client closes its Unix socket. */
+void* shm_thread_function(void* thread_data) {
+	struct thread_data* thread_info = (struct thread_data*) thread_data;
+    struct aesd_shm_conn* shm = &thread_info->shm;
+    struct aesd_shm_header* header = shm->header;
+    struct connection conn;
+    struct pollfd pfds[2];
+    ssize_t num_bytes;
+    bool progress;
+    bool ready;
+    int status;
+    char* recv_dest;
+    size_t recv_len;
+    int wait_ms;
+    struct in_addr local_addr = { htonl(INADDR_LOOPBACK) };
+
+	log_msg(LOG_DEBUG, "Accepted local connection\n");
+
+    connection_init(&conn, local_addr);
+
+    // mask signals, main handles SIGINT/SIGTERM and connections watch run_flag
+    status = pthread_sigmask(SIG_BLOCK, &cur_set, NULL);
+    if (status != 0) {
         printf("signal masking failed\n");
-        return NULL;
+        goto exit;
     }
 
-    // receive data from client
-    while (1) {
-        // save up to 100 bytes into buf
-        num_bytes = recv(thread_info->connection_fd, buf, MAX_BUF, 0);
+    while (run_flag) {
+        progress = false;
+        wait_ms = fair_wait_ms(conn.client);
+
+        // packets, the ring itself is the throttle while replies are over the high watermark or tokens ran out
+        if (!outq_over_high(&conn.outq) && wait_ms == 0) {
+            recv_len = connection_buffer(&conn, SHM_READ_CHUNK, &recv_dest);
+            num_bytes = shm_ring_read(shm, &shm->req, recv_dest, recv_len);
+            if (num_bytes == -1) {
+                log_msg(LOG_ERR, "Local client corrupted its ring, dropping it\n");
+                break;
+            }
+            if (num_bytes > 0) {
+                if (connection_receive(&conn, num_bytes) != 0) {
+                    break;
+                }
+                progress = true;
+            }
+        }
+
+        // replies
+        if (!outq_empty(&conn.outq)) {
+            num_bytes = outq_drain(&conn.outq, shm_reply_write, shm);
+            if (num_bytes == -1) {
+                log_msg(LOG_ERR, "Local client corrupted its ring, dropping it\n");
+                break;
+            }
+            connection_sent(&conn, num_bytes);
+            if (num_bytes > 0) {
+                progress = true;
+            }
+        }
 
-        // exit loop on error
-        if (num_bytes == -1) {
-            perror("recv");
-            return NULL;
+        // empty replies complete without writing a byte
+        if (atomic_load_explicit(&header->replies, memory_order_relaxed) != conn.outq.completed) {
+            atomic_store_explicit(&header->replies, conn.outq.completed, memory_order_release);
+            progress = true;
         }
 
-        // check if allocated buf size is sufficient
-        if(recv_buf_pos + num_bytes > recv_buf_size) {
-            recv_buf_size += num_bytes;
-            recv_buf = realloc(recv_buf, recv_buf_size * sizeof(char));
+        if (!connection_check_reader(&conn, "local client")) {
+            break;
+        }
+
+        if (progress) {
+            // the client may be waiting for packet space or for reply bytes
+            shm_notify(&header->client_waiting, shm->client_efd);
+            continue;
+        }
+
+        // nothing to do, sleep unless the client slipped something in before we announced it
+        shm_begin_wait(&header->server_waiting);
+        ready = (!outq_over_high(&conn.outq) && wait_ms == 0 && shm_ring_used(&shm->req) > 0) ||
+                (!outq_empty(&conn.outq) && shm_ring_used(&shm->resp) != shm->resp.size);
+        if (ready) {
+            shm_end_wait(&header->server_waiting, shm->server_efd);
+            continue;
+        }
+
+        pfds[0].fd = shm->server_efd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = shm->sock_fd;
+        pfds[1].events = POLLIN;
+        status = poll(pfds, 2, (wait_ms > 0 && wait_ms < POLL_INTERVAL_MS) ? wait_ms : POLL_INTERVAL_MS);
+        shm_end_wait(&header->server_waiting, shm->server_efd);
+        if (status == -1 && errno != EINTR) {
+            perror("poll");
+            break;
         }
-        
-        // copy buf to recv_buf
-        memcpy(recv_buf + recv_buf_pos, buf, num_bytes);
-        recv_buf_pos += num_bytes;
 
-        // exit loop if there was a new line character received
-        if(strchr(buf, '\n') != NULL)
+        // nothing is ever sent on the Unix socket after the handshake, readable means closed
+        if (status > 0 && pfds[1].revents != 0) {
             break;
+        }
     }
 
-    // unmask signals
-    status = sigprocmask(SIG_UNBLOCK, &prev_set, NULL);
-    if (status == -1) {
-        printf("signal unmasking failed\n");
-        return NULL;
+ exit:
+    connection_free(&conn);
+
+    shm_close(shm);
+    log_msg(LOG_DEBUG, "Closed local connection\n");
+    thread_info->complete_flag = true;
+
+    return NULL;
+}
+
+/* Primary side of one follower: sends it a snapshot and then every append,
+   and makes the appends it forwards for its own clients. */
+void* repl_thread_function(void* thread_data) {
+	struct thread_data* thread_info = (struct thread_data*) thread_data;
+    int fd = thread_info->connection_fd;
+    struct repl_follower follower;
+    struct repl_reader reader;
+    struct pollfd pfds[2];
+    char* snapshot = NULL;
+    ssize_t snapshot_size;
+    uint64_t id;
+    uint64_t count;
+    bool added = false;
+    int status;
+
+    memset(&reader, 0, sizeof(reader));
+
+    // mask signals, main handles SIGINT/SIGTERM and connections watch run_flag
+    status = pthread_sigmask(SIG_BLOCK, &cur_set, NULL);
+    if (status != 0) {
+        printf("signal masking failed\n");
+        goto exit;
     }
 
-    // write new bytes to file
+    // snapshot and registration in one critical section, no append can fall in between
     if (pthread_mutex_lock(&mutex) != 0) {
         perror("mutex lock error");
-        return NULL;
+        goto exit;
     }
-
-    num_bytes = write(file_fd, recv_buf, recv_buf_pos);
-    if (num_bytes == -1 || num_bytes != recv_buf_pos) {
-        perror("write");
-        return NULL;
+    snapshot_size = storage_read_all(&storage, &snapshot);
+    if (snapshot_size != -1 && repl_follower_add(&follower, fd, storage.ops->replica, snapshot, snapshot_size) == 0) {
+        added = true;
     }
-    int file_size = num_bytes;
-
     if (pthread_mutex_unlock(&mutex) != 0) {
         perror("mutex unlock error");
-        return NULL;
     }
+    if (!added) {
+        goto exit;
+    }
+    log_msg(LOG_DEBUG, "Follower connected\n");
 
-    // send buffer setup
-    long send_buf_size = file_size;
-    char* send_buf = malloc(send_buf_size * sizeof(char));
-    if (send_buf == NULL) {
-        perror("malloc failure");
-        exit(EXIT_FAILURE);
+    while (run_flag) {
+        pfds[0].fd = fd;
+        pfds[0].events = POLLIN;
+        if (repl_pending(&follower)) {
+            pfds[0].events |= POLLOUT;
+        }
+        pfds[1].fd = follower.wake_fd;
+        pfds[1].events = POLLIN;
+
+        status = poll(pfds, 2, POLL_INTERVAL_MS);
+        if (status == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            if (read(follower.wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("eventfd read");
+            }
+        }
+
+        if (pfds[0].revents & (POLLERR | POLLNVAL)) {
+            break;
+        }
+
+        // writes forwarded by the follower
+        if (pfds[0].revents & (POLLIN | POLLHUP)) {
+            while ((status = repl_read(fd, &reader)) == 1) {
+                if (reader.header[0] != REPL_WRITE || reader.len < REPL_ID_LEN) {
+                    status = -1;
+                    break;
+                }
+                memcpy(&id, reader.buf, REPL_ID_LEN);
+
+                if (pthread_mutex_lock(&mutex) != 0) {
+                    perror("mutex lock error");
+                    status = -1;
+                    break;
+                }
+                status = storage_append(&storage, reader.buf + REPL_ID_LEN, reader.len - REPL_ID_LEN);
+                if (status == 0) {
+                    repl_publish(reader.buf + REPL_ID_LEN, reader.len - REPL_ID_LEN);
+                }
+                if (pthread_mutex_unlock(&mutex) != 0) {
+                    perror("mutex unlock error");
+                }
+
+                // queued behind the append, the follower has applied it when the ack arrives
+                if (status != 0 || repl_ack(&follower, id) != 0) {
+                    status = -1;
+                    break;
+                }
+                repl_reader_reset(&reader);
+            }
+            if (status == -1) {
+                break;
+            }
+        }
+
+        if (repl_flush(&follower) == -1) {
+            log_msg(LOG_DEBUG, "Dropping follower, %zu bytes behind\n", follower.outq.queued);
+            break;
+        }
+    }
+
+ exit:
+    if (added) {
+        repl_follower_remove(&follower);
+    }
+    repl_reader_reset(&reader);
+
+    close(fd);
+    log_msg(LOG_DEBUG, "Follower disconnected\n");
+    thread_info->complete_flag = true;
+
+    return NULL;
+}
+
+// follower: the copy a snapshot is building, only the replication thread touches it
+static struct aesd_storage sync_storage;
+static bool sync_open;
+
+static void repl_sync_abort(void) {
+    if (sync_open) {
+        storage_close(&sync_storage);
+        sync_open = false;
+    }
+}
+
+// starts a new copy in the backend the primary asked for, the snapshot that follows fills it
+static int repl_sync_begin(const char* name, size_t len) {
+    char backend_name[16];
+
+    if (len >= sizeof(backend_name)) {
+        return -1;
+    }
+    memcpy(backend_name, name, len);
+    backend_name[len] = '\0';
+
+    repl_sync_abort();
+    if (storage_init(&sync_storage, backend_name) != 0 || sync_storage.ops->default_path != NULL) {
+        printf("Primary asked for backend %s\n", backend_name);
+        return -1;
+    }
+    if (storage_open(&sync_storage) != 0) {
+        return -1;
+    }
+    sync_open = true;
+    return 0;
+}
+
+// the new copy is complete, clients read it from now on
+static int repl_sync_end(void) {
+    if (!sync_open) {
+        return -1;
     }
 
-    // read the ENTIRE file
     if (pthread_mutex_lock(&mutex) != 0) {
         perror("mutex lock error");
-        return NULL;
+        return -1;
+    }
+    storage_close(&storage);
+    storage = sync_storage;
+    if (pthread_mutex_unlock(&mutex) != 0) {
+        perror("mutex unlock error");
     }
+    sync_open = false;
+    return 0;
+}
 
-    num_bytes = read(file_fd, send_buf, send_buf_size);
-    if (num_bytes == -1 || num_bytes != send_buf_size) {
-        perror("read");
-        return NULL;
+// applies one record from the primary to the local copy
+static int repl_apply(struct repl_reader* reader) {
+    uint64_t id;
+    int status = 0;
+
+    switch (reader->header[0]) {
+    case REPL_ACK:
+        if (reader->len != REPL_ID_LEN) {
+            return -1;
+        }
+        memcpy(&id, reader->buf, REPL_ID_LEN);
+        repl_acked(id);
+        return 0;
+    case REPL_HELLO:
+        return repl_sync_begin(reader->buf, reader->len);
+    case REPL_SNAPSHOT:
+        // the copy being built is not shared yet
+        if (!sync_open) {
+            return -1;
+        }
+        return storage_append(&sync_storage, reader->buf, reader->len);
+    case REPL_SNAPSHOT_END:
+        return repl_sync_end();
+    case REPL_APPEND:
+        break;
+    default:
+        return -1;
     }
 
+    if (pthread_mutex_lock(&mutex) != 0) {
+        perror("mutex lock error");
+        return -1;
+    }
+    if (reader->len > 0) {
+        status = storage_append(&storage, reader->buf, reader->len);
+    }
     if (pthread_mutex_unlock(&mutex) != 0) {
         perror("mutex unlock error");
-        return NULL;
     }
+    return status;
+}
 
-    // mask signals
-    status = sigprocmask(SIG_BLOCK, &cur_set, &prev_set);
-    if (status == -1) {
+/* Follower side: keeps the local copy in step with the primary, and
+   reconnects (starting from a fresh snapshot) whenever it goes away. */
+void* repl_client_function(void* arg) {
+    struct repl_reader reader;
+    struct pollfd pfd;
+    int status;
+    int fd;
+
+    memset(&reader, 0, sizeof(reader));
+
+    status = pthread_sigmask(SIG_BLOCK, &cur_set, NULL);
+    if (status != 0) {
         printf("signal masking failed\n");
         return NULL;
     }
 
-    // send data to the client
-    num_bytes = send(thread_info->connection_fd, send_buf, send_buf_size, 0);
-	if (num_bytes == -1 || num_bytes != send_buf_size) {
-		perror("send");
-		return NULL;
-	}
+    while (run_flag) {
+        fd = repl_connect(primary_path);
+        if (fd == -1) {
+            poll(NULL, 0, REPL_RETRY_MS);
+            continue;
+        }
+        log_msg(LOG_DEBUG, "Following %s\n", primary_path);
+        repl_attach(fd);
+
+        while (run_flag) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            status = poll(&pfd, 1, POLL_INTERVAL_MS);
+            if (status == -1 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            if (status <= 0) {
+                continue;
+            }
+
+            while ((status = repl_read(fd, &reader)) == 1) {
+                status = repl_apply(&reader);
+                repl_reader_reset(&reader);
+                if (status != 0) {
+                    status = -1;
+                    break;
+                }
+            }
+            if (status == -1) {
+                break;
+            }
+        }
 
-    // unmask signals
-    status = sigprocmask(SIG_UNBLOCK, &prev_set, NULL);
-    if (status == -1) {
-        printf("signal unmasking failed\n");
+        // writes waiting for this primary fail, reads go on from the last complete copy
+        repl_detach();
+        close(fd);
+        repl_reader_reset(&reader);
+        repl_sync_abort();
+        log_msg(LOG_DEBUG, "Lost primary %s\n", primary_path);
+    }
+    return NULL;
+}
+
+/* Snapshots the persistent history every snapshot_interval_s seconds, the
+   storage lock is only held to rotate the log and to switch snapshots. */
+void* snapshot_thread_function(void* arg) {
+    struct snap_map map;
+    uint64_t last_ms = now_ms();
+    int status;
+
+    status = pthread_sigmask(SIG_BLOCK, &cur_set, NULL);
+    if (status != 0) {
+        printf("signal masking failed\n");
         return NULL;
     }
 
-    // free buffers
-    free(recv_buf);
-    free(send_buf);
+    while (run_flag) {
+        poll(NULL, 0, POLL_INTERVAL_MS);
+        if (now_ms() - last_ms < (uint64_t) snapshot_interval_s * 1000) {
+            continue;
+        }
+        last_ms = now_ms();
 
-    close(client_fd);
-    close(file_fd);
-    syslog(LOG_DEBUG, "Closed connection from %s\n", ip_addr);	   
-    thread_info->complete_flag = true;
+        pthread_mutex_lock(&mutex);
+        status = storage_snapshot_begin(&storage);
+        pthread_mutex_unlock(&mutex);
+        if (status != 1) {
+            continue;
+        }
 
+        // a failed snapshot keeps its segment, the next one retries it
+        if (storage_snapshot_write(&storage, &map) != 0) {
+            log_msg(LOG_ERR, "Snapshot of %s failed\n", snapshot_path);
+            continue;
+        }
+
+        pthread_mutex_lock(&mutex);
+        storage_snapshot_end(&storage, &map);
+        pthread_mutex_unlock(&mutex);
+        log_msg(LOG_DEBUG, "Snapshot %llu: %zu chunks, %zu bytes\n",
+                (unsigned long long) map.seq, map.num_chunks, map.data_len);
+    }
     return NULL;
 }
 
 void program_cleanup() {
-    printf("** Program cleanup\n");
+    log_msg(LOG_DEBUG, "** Program cleanup");
+    log_stop();
 
     pthread_mutex_destroy(&mutex);
     closelog();
     close(socket_num);
-    close(file_fd);
-    close(client_fd);
-
-    #ifndef USE_AESD_CHAR_DEVICE
-    if (remove(OUTPUT_FILE_PATH) == -1) {
-       perror("remove");
+    if (shm_socket_num != -1) {
+        close(shm_socket_num);
+        unlink(shm_socket_path);
     }
-    #endif
+    if (repl_socket_num != -1) {
+        close(repl_socket_num);
+        unlink(repl_socket_path);
+    }
+    storage_close(&storage);
     exit(EXIT_SUCCESS);
 }
 
 
 int main(int argc, char** argv) {
     int status;
+    int opt;
     bool daemon_flag = false;
+    const char* backend_name = DEFAULT_STORAGE_BACKEND;
+    const char* log_path = NULL;
+    unsigned int log_rate = DEFAULT_LOG_RATE;
+    unsigned int client_rate = 0;
+    unsigned int client_burst = 0;
+    const char* acceptor_cpus = NULL;
+    const char* worker_cpus = NULL;
+    bool steer_flag = false;
+    pthread_attr_t thread_attr;
     pid_t pid = 0;
 
-    printf("** Starting server **\n");
+    log_msg(LOG_DEBUG, "** Starting server **");
 
     // initialize mutex
     pthread_mutex_init(&mutex, NULL);
@@ -308,20 +1286,150 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    // no SA_RESTART, accept has to return so main can write the dump
+    struct sigaction usr1_action;
+    memset(&usr1_action, 0, sizeof(usr1_action));
+    usr1_action.sa_handler = handle_signals;
+    if (sigaction(SIGUSR1, &usr1_action, NULL) == -1) {
+        printf("SIGUSR1 setup error\n");
+        return -1;
+    }
+
     // setup signal masking (happens during recv and send)
     sigemptyset(&cur_set);
     sigaddset(&cur_set, SIGINT);
     sigaddset(&cur_set, SIGTERM);
+    sigaddset(&cur_set, SIGUSR1);
 
     // process command line arguments
-    if (argc == 2 && strncmp("-d", argv[1], 3) == 0) {
-        daemon_flag = true;
+    while ((opt = getopt(argc, argv, "db:W:L:P:T:l:R:tu:r:B:S:F:p:a:c:sk:K:C")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon_flag = true;
+            break;
+        case 'b':
+            backend_name = optarg;
+            break;
+        case 'W':
+            high_watermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            low_watermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            if (strcmp(optarg, "throttle") == 0) {
+                slow_reader_policy = SLOW_READER_THROTTLE;
+            }
+            else if (strcmp(optarg, "disconnect") == 0) {
+                slow_reader_policy = SLOW_READER_DISCONNECT;
+            }
+            else {
+                printf("Unknown slow reader policy %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            stall_timeout_ms = atoi(optarg);
+            break;
+        case 'l':
+            log_path = optarg;
+            break;
+        case 'R':
+            log_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            if (trace_init() != 0) {
+                return -1;
+            }
+            break;
+        case 'u':
+            shm_socket_path = optarg;
+            break;
+        case 'r':
+            client_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            client_burst = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            repl_socket_path = optarg;
+            break;
+        case 'F':
+            primary_path = optarg;
+            follower_flag = true;
+            break;
+        case 'p':
+            port_num = optarg;
+            break;
+        case 'a':
+            acceptor_cpus = optarg;
+            break;
+        case 'c':
+            worker_cpus = optarg;
+            break;
+        case 's':
+            steer_flag = true;
+            break;
+        case 'C':
+            persistent_flag = true;
+            break;
+        case 'k':
+            snapshot_path = optarg;
+            break;
+        case 'K':
+            snapshot_interval_s = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            printf("Usage: %s [-d] [-b chardev|file|memory|memlog] [-W high_watermark] [-L low_watermark]\n"
+                   "          [-P throttle|disconnect] [-T stall_timeout_ms] [-l log_file] [-R log_rate] [-t]\n"
+                   "          [-u shm_socket_path] [-r requests_per_sec_per_ip] [-B burst]\n"
+                   "          [-S replication_socket_path | -F primary_socket_path] [-p port]\n"
+                   "          [-a acceptor_cpus] [-c connection_cpus] [-s]\n"
+                   "          [-k snapshot_path] [-K snapshot_interval_s] [-C]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if (low_watermark > high_watermark) {
+        low_watermark = high_watermark;
+    }
+
+    // a follower's copy lives in memory, the other backends would share the primary's device or file;
+    // the primary's hello may switch it to the bounded memory backend
+    if (follower_flag) {
+        if (repl_socket_path != NULL) {
+            printf("-S and -F are exclusive, followers do not chain\n");
+            return -1;
+        }
+        backend_name = "memlog";
+    }
+
+    // burst defaults to one second worth of requests
+    fair_init(client_rate, (client_burst != 0) ? client_burst : client_rate);
+
+    // pinned before any thread exists, the logger, the timer and a daemon child inherit it
+    if (affinity_init(acceptor_cpus, worker_cpus, steer_flag) != 0 || affinity_pin_acceptor() != 0) {
+        return -1;
+    }
+
+    if (storage_init(&storage, backend_name) != 0) {
+        printf("Unknown storage backend %s\n", backend_name);
+        return -1;
+    }
+    if (snapshot_path != NULL && storage_set_snapshot(&storage, snapshot_path) != 0) {
+        printf("-k needs the file backend\n");
+        return -1;
+    }
+    if (storage_open(&storage) != 0) {
+        printf("Could not open %s storage\n", backend_name);
+        return -1;
     }
 
     // setup addrinfo data structure
     struct addrinfo hints;
     struct addrinfo* server_info;
-    socklen_t client_addr_len = sizeof(struct sockaddr);
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
@@ -330,7 +1438,7 @@ int main(int argc, char** argv) {
     hints.ai_protocol = 0;
 
     // initialize server_info data structure
-    status = getaddrinfo(NULL, PORT_NUM, &hints, &server_info);
+    status = getaddrinfo(NULL, port_num, &hints, &server_info);
     if (status != 0) {
         perror("getaddrinfo");
         freeaddrinfo(server_info);
@@ -397,13 +1505,48 @@ int main(int argc, char** argv) {
             close(STDERR_FILENO);
         }
     }
-    
+
+    // the logger thread is started after fork, threads do not survive it
+    if (log_start(log_path, log_rate) != 0) {
+        return -1;
+    }
+
  	// listen on socket
     status = listen(socket_num, MAX_BACKLOG);
     if (status == -1) {
         perror("listen");
         return -1;
     }
+
+    // local clients on shared memory, the socket path is relative to / in daemon mode
+    if (shm_socket_path != NULL) {
+        shm_socket_num = shm_listen(shm_socket_path);
+        if (shm_socket_num == -1) {
+            return -1;
+        }
+    }
+
+    // followers subscribe here
+    if (repl_socket_path != NULL) {
+        repl_socket_num = repl_listen(repl_socket_path);
+        if (repl_socket_num == -1) {
+            return -1;
+        }
+    }
+
+    // a follower starts empty and fills up from the primary's snapshot
+    pthread_t repl_client_thread;
+    if (follower_flag && pthread_create(&repl_client_thread, NULL, repl_client_function, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    // snapshots are written in the background, startup only mapped the last one
+    pthread_t snapshot_thread;
+    if (snapshot_path != NULL && pthread_create(&snapshot_thread, NULL, snapshot_thread_function, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
          	
 	// set up timer in child process if daemon is running
     timer_t timer_id;
@@ -415,12 +1558,17 @@ int main(int argc, char** argv) {
         memset(&sev, 0, sizeof(struct sigevent));
         sev.sigev_notify = SIGEV_THREAD;
         sev.sigev_notify_function = timer_thread;
+        pthread_attr_init(&thread_attr);
+        if (affinity_acceptor_attr(&thread_attr)) {
+            sev.sigev_notify_attributes = &thread_attr;
+        }
 
         // create timer
         if (timer_create(clock_id, &sev, &timer_id) != 0) {
 			perror("timer_create");
             program_cleanup();
         }
+        pthread_attr_destroy(&thread_attr); // timer_create keeps its own copy
 
         // get current time for start
         if (clock_gettime(clock_id, &start_time) != 0) {
@@ -439,20 +1587,63 @@ int main(int argc, char** argv) {
         }
     }
 
+    // TCP clients, plus local shared memory clients when -u was given and followers with -S
+    struct pollfd listen_fds[3];
+    int num_listen_fds = 1;
+    int shm_index = -1;
+    int repl_index = -1;
+    int i;
+    void* (*connection_function)(void*);
+    struct list_data* next_ptr;
+
+    listen_fds[0].fd = socket_num;
+    listen_fds[0].events = POLLIN;
+    if (shm_socket_num != -1) {
+        shm_index = num_listen_fds++;
+        listen_fds[shm_index].fd = shm_socket_num;
+        listen_fds[shm_index].events = POLLIN;
+    }
+    if (repl_socket_num != -1) {
+        repl_index = num_listen_fds++;
+        listen_fds[repl_index].fd = repl_socket_num;
+        listen_fds[repl_index].events = POLLIN;
+    }
+
 	// main loop for creating threads
     while (run_flag == true) {
         
-        // accept connection from client
-        client_fd = accept(socket_num, (struct sockaddr*) &client_addr, &client_addr_len);
+        // wait for a connection on any socket, signals always interrupt poll
+        status = poll(listen_fds, num_listen_fds, -1);
+
+        if (trace_dump_flag) {
+            trace_dump_flag = false;
+            status = trace_dump(TRACE_DUMP_PATH);
+            log_msg(LOG_DEBUG, "Dumped %d trace records to %s", status, TRACE_DUMP_PATH);
+            fair_log_stats();
+            continue;
+        }
 
         if (run_flag != false) {
 
-            // check for errors on accept call
-            if (client_fd == -1) {
-                perror("accept");
+            if (status == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("poll");
                 return -1;
             }
 
+            // an error on a listener shows up on every poll, the TCP one is fatal and the others stop taking clients
+            for (i = 0; i < num_listen_fds; i++) {
+                if (listen_fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                    log_msg(LOG_ERR, "Listening socket %d failed, revents 0x%x\n", listen_fds[i].fd, listen_fds[i].revents);
+                    if (i == 0) {
+                        return -1;
+                    }
+                    listen_fds[i].fd = -1;
+                    listen_fds[i].revents = 0;
+                }
+            }
+
             // add node to linked list
             list_ptr = malloc(sizeof(struct list_data));
             if (list_ptr == NULL) {
@@ -460,33 +1651,93 @@ int main(int argc, char** argv) {
                 exit(EXIT_FAILURE);
             }
 
+            if (listen_fds[0].revents & POLLIN) {
+                // accept connection from client, the thread gets its own copy of the address
+                client_addr_len = sizeof(client_addr);
+                client_fd = accept(socket_num, (struct sockaddr*) &client_addr, &client_addr_len);
+
+                // check for errors on accept call
+                if (client_fd == -1) {
+                    perror("accept");
+                    return -1;
+                }
+                (list_ptr->info).client_addr = client_addr;
+                connection_function = thread_function;
+            }
+            else if (shm_index != -1 && (listen_fds[shm_index].revents & POLLIN)) {
+                // handshake failures only affect that client
+                if (shm_accept(shm_socket_num, &(list_ptr->info).shm) != 0) {
+                    free(list_ptr);
+                    continue;
+                }
+                client_fd = (list_ptr->info).shm.sock_fd;
+                connection_function = shm_thread_function;
+            }
+            else if (repl_index != -1 && (listen_fds[repl_index].revents & POLLIN)) {
+                client_fd = accept4(repl_socket_num, NULL, NULL, SOCK_CLOEXEC);
+                if (client_fd == -1) {
+                    perror("accept");
+                    free(list_ptr);
+                    continue;
+                }
+                connection_function = repl_thread_function;
+            }
+            else {
+                // only a failed listener woke poll up
+                free(list_ptr);
+                continue;
+            }
+
             (list_ptr->info).connection_fd = client_fd;
             (list_ptr->info).complete_flag = false;
-            SLIST_INSERT_HEAD(&head, list_ptr, entries);
 
-            // create new thread with fd from accept
-            status = pthread_create(&((list_ptr->info).thread_id), NULL, thread_function, (void*) &(list_ptr->info));
-            if (status == -1) {
-                perror("pthread_create");
-                return -1;
+            // create new thread with fd from accept, placed before it allocates its buffers
+            pthread_attr_init(&thread_attr);
+            affinity_worker_attr(&thread_attr, client_fd);
+            status = pthread_create(&((list_ptr->info).thread_id), &thread_attr, connection_function, (void*) &(list_ptr->info));
+            pthread_attr_destroy(&thread_attr);
+            if (status != 0) {
+                // returns the error instead of setting errno, only this client is lost
+                log_msg(LOG_ERR, "pthread_create: %s\n", strerror(status));
+                if (connection_function == shm_thread_function) {
+                    shm_close(&(list_ptr->info).shm);
+                }
+                else {
+                    close(client_fd);
+                }
+                free(list_ptr);
+                continue;
             }
+            SLIST_INSERT_HEAD(&head, list_ptr, entries);
 
-            // join each thread in list with flag marked as completed
-            SLIST_FOREACH(list_ptr, &head, entries) {
+            // join each thread in list with flag marked as completed, and drop its node
+            list_ptr = SLIST_FIRST(&head);
+            while (list_ptr != NULL) {
+                next_ptr = SLIST_NEXT(list_ptr, entries);
                 if ((list_ptr->info).complete_flag == true) {
                     pthread_join((list_ptr->info).thread_id, NULL);
+                    SLIST_REMOVE(&head, list_ptr, list_data, entries);
+                    free(list_ptr);
                 }
+                list_ptr = next_ptr;
             }
         }
 
     }
 	
 	// after exiting main loop, do cleanup activities
+    log_msg(LOG_DEBUG, "Caught signal, exiting");
 
     // join all threads
     SLIST_FOREACH(list_ptr, &head, entries) {
         pthread_join((list_ptr->info).thread_id, NULL);
     }
+    if (follower_flag) {
+        pthread_join(repl_client_thread, NULL);
+    }
+    if (snapshot_path != NULL) {
+        pthread_join(snapshot_thread, NULL);
+    }
 
     // free all nodes of linked list
     while (!SLIST_EMPTY(&head)) {
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Syncs a replication follower (aesdsocket -F) from a file backend primary
+# whose history is bigger than one snapshot record and than the follower's
+# backlog limit, then checks the follower answers with the primary's history.
+# Run from the server directory after make, with nothing on ports 9000/9001.
+
+set -e
+set -u
+
+SIZE_MB=${1:-80}
+REPL_SOCKET=/tmp/aesdsocket-repl-test.sock
+WORKDIR=/tmp/aesdsocket-repl-test
+PRIMARY_PID=
+FOLLOWER_PID=
+
+cleanup() {
+	[ -n "${FOLLOWER_PID}" ] && kill "${FOLLOWER_PID}" 2>/dev/null
+	[ -n "${PRIMARY_PID}" ] && kill "${PRIMARY_PID}" 2>/dev/null
+	rm -rf "${WORKDIR}"
+	rm -f /var/tmp/aesdsocketdata
+}
+trap cleanup EXIT
+
+rm -rf "${WORKDIR}"
+mkdir -p "${WORKDIR}"
+rm -f /var/tmp/aesdsocketdata
+
+echo "Starting primary and writing ${SIZE_MB} MiB of history"
+./aesdsocket -b file -S "${REPL_SOCKET}" > "${WORKDIR}/primary.log" 2>&1 &
+PRIMARY_PID=$!
+sleep 1
+# one packet, a connection is closed after its first reply
+head -c $((SIZE_MB * 1024 * 1024)) /dev/zero | tr '\0' 'x' > "${WORKDIR}/history"
+echo >> "${WORKDIR}/history"
+nc localhost 9000 -w 5 < "${WORKDIR}/history" > /dev/null
+
+echo "Starting follower"
+./aesdsocket -F "${REPL_SOCKET}" -p 9001 > "${WORKDIR}/follower.log" 2>&1 &
+FOLLOWER_PID=$!
+sleep 3
+
+# answered from the follower's copy once the primary acked the write
+echo "follower probe" | nc localhost 9001 -w 5 > "${WORKDIR}/follower_reply"
+echo "primary probe" | nc localhost 9000 -w 5 > "${WORKDIR}/primary_reply"
+
+follower_size=$(wc -c < "${WORKDIR}/follower_reply")
+if [ "${follower_size}" -le $((SIZE_MB * 1024 * 1024)) ]; then
+	echo "failed: follower replied with ${follower_size} bytes"
+	exit 1
+fi
+# the primary's history only grew since, so it starts with the follower's reply
+if ! head -c "${follower_size}" "${WORKDIR}/primary_reply" | cmp -s - "${WORKDIR}/follower_reply"; then
+	echo "failed: follower's history differs from the primary's"
+	exit 1
+fi
+echo "success: follower synced ${follower_size} bytes"